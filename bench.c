@@ -0,0 +1,1391 @@
+/*
+ * Author: shiweid
+ *
+ * bench.c include the benchmarks of the proxy, "make bench" builds them.
+ *
+ *   ./bench load [-c clients] [-n requests] [-o objects] [-s size] [-k]
+ *                [-u] [-S] [-P port] -- <proxy> [proxy args]
+ *
+ * load starts the proxy with its arguments and the port, and an origin
+ * server of its own. A first pass fetches the objects of size bytes once,
+ * then the clients send the requests through the proxy, spread over the
+ * objects. With -k the clients keep their connection, with -u the origin
+ * forbids caching the objects. It prints the requests per second and the
+ * bytes per second the clients received, and the CPU time the proxy spent
+ * per request and per GB. With -S the system calls of the proxy, all its
+ * threads included, are counted with ptrace instead: the proxy then runs
+ * far slower, so only the calls per request are printed.
+ *
+ *   ./bench lookup [-n lookups]
+ *
+ * lookup times the hits and the misses of get_obj_from_cache() as the
+ * number of cached objects grows, next to the list the cache was before it
+ * had a hash index: one walked with strcmp() and a lock taken per object,
+ * the hit moved to the head.
+ *
+ *   ./bench policy [-n requests] [-o objects] [-a alpha] [-S scan]
+ *
+ * policy replays a trace on the cache with each eviction policy: requests
+ * for objects of 1 to 20 KB picked by a Zipf law of exponent alpha, with a
+ * scan of one hit wonders taking scan requests out of every thousand. A
+ * miss stores the object. It prints the hit ratio, in requests and in
+ * bytes, then the ns a hit takes on the cache the trace left.
+ *
+ *   ./bench headers [-n blocks]
+ *
+ * headers classifies every field of a request and a response header block
+ * the way the proxy did before the header parser, a case insensitive
+ * prefix compare per known name until one matches, then with
+ * header_next() and its perfect hash. It prints the headers per second.
+ *
+ *   ./bench chunked [-P port] -- <proxy> [proxy args]
+ *
+ * chunked is a check rather than a benchmark: it starts the proxy like
+ * load, with an origin which sends chunked responses to HTTP/1.1 requests
+ * and responses ended by closing the connection to HTTP/1.0 ones. HTTP/1.0
+ * clients must never get chunks: not when they are the first to ask, not
+ * from the cache, not when they wait on the fetch of an HTTP/1.1 client.
+ * It exits with 1 if any of them did.
+ */
+
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include "header.h"
+#include <math.h>
+#include <netinet/tcp.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#define BENCH_PORT 15400           /* default port of the proxy */
+#define BENCH_BODY (1024 * 1024)   /* what the origin writes at once */
+#define BENCH_CHUNK 1000           /* the chunks of a chunked content */
+
+/* The load to run */
+typedef struct bench_load
+{
+    int clients;
+    long requests;
+    int objects;
+    size_t size;
+    int keepalive;
+    int nostore;
+    int proxyport;
+    int originport;
+    int trace;               /* the proxy runs under ptrace */
+    long errors;             /* failed requests, updated atomically */
+    long long bytes;         /* of the responses, updated atomically */
+    long next;               /* requests handed out, updated atomically */
+}benchload;
+
+/* A request of the chunked check */
+typedef struct bench_get
+{
+    int proxyport;
+    int originport;
+    char *path;
+    int http11;
+    size_t size;   /* of the content which must come back */
+    int res;       /* 0 if it did, -1 otherwise */
+}benchget;
+
+/* An object of the list the cache was before the hash index */
+typedef struct list_obj
+{
+    char *uri;
+    struct list_obj *prev;
+    struct list_obj *next;
+}listobj;
+
+typedef struct obj_list_cache
+{
+    listobj *head;
+    listobj *rear;
+    pthread_rwlock_t lock;
+}listcache;
+
+/* Header blocks as browsers and servers send them */
+static char reqblock[] =
+    "GET http://www.example.com/static/js/app.min.js?v=20240611 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+    "(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: http://www.example.com/products/index.html\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Cookie: session=8f2a61c4b9d04e7f; theme=dark; _ga=GA1.1.1234567.1700000000\r\n"
+    "If-None-Match: \"5f3c-61a2b9e4c8d40\"\r\n"
+    "\r\n";
+static char resblock[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Tue, 11 Jun 2024 09:12:44 GMT\r\n"
+    "Server: Apache/2.4.58 (Unix)\r\n"
+    "Last-Modified: Mon, 10 Jun 2024 17:03:12 GMT\r\n"
+    "ETag: \"5f3c-61a2b9e4c8d40\"\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Length: 24380\r\n"
+    "Cache-Control: public, max-age=86400, stale-while-revalidate=60\r\n"
+    "Vary: Accept-Encoding\r\n"
+    "Content-Type: application/javascript\r\n"
+    "X-Content-Type-Options: nosniff\r\n"
+    "Keep-Alive: timeout=5, max=100\r\n"
+    "Connection: Keep-Alive\r\n"
+    "\r\n";
+
+static char body[BENCH_BODY];
+static volatile int counting;   /* system calls of the proxy are counted */
+
+/* Static helper functions */
+static int bench_load(int argc, char **argv);
+static void usage(char *prog);
+static void *origin_thread(void *vargp);
+static void *origin_serve(void *vargp);
+static void *load_thread(void *vargp);
+static void *client_thread(void *vargp);
+static int client_get(benchload *bl, int *fd, rio_t *rio, int obj);
+static pid_t proxy_start(char **argv, int port, int trace);
+static int proxy_wait(int port);
+static double proxy_cpu(pid_t pid);
+static int bench_lookup(int argc, char **argv);
+static listobj *list_lookup(listcache *lc, char *uri);
+static int bench_policy(int argc, char **argv);
+static size_t policy_size(int obj);
+static int bench_lines(int argc, char **argv);
+static void rio_fill(rio_t *rio, char *block, size_t len);
+static ssize_t old_rio_read(rio_t *rp, char *usrbuf, size_t n);
+static ssize_t old_rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+static int bench_reqhdrs(int argc, char **argv);
+static int old_request(rio_t *rio, char *req, int bytewise);
+static int old_requesthdrs(rio_t *rio, char *req, int bytewise);
+static int bench_headers(int argc, char **argv);
+static int old_header_id(char *line, size_t len);
+static int bench_chunked(int argc, char **argv);
+static void *chunked_thread(void *vargp);
+static int chunked_get(benchget *g);
+static ssize_t chunked_decode(char *content, size_t len);
+static char **bench_uris(int n);
+static unsigned long long bench_rand(void);
+static double now(void);
+
+int main(int argc, char **argv)
+{
+    Signal(SIGPIPE, SIG_IGN);
+    if (argc >= 2 && strcmp(argv[1], "load") == 0)
+        return bench_load(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "lookup") == 0)
+        return bench_lookup(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "policy") == 0)
+        return bench_policy(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "lines") == 0)
+        return bench_lines(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "reqhdrs") == 0)
+        return bench_reqhdrs(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "headers") == 0)
+        return bench_headers(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "chunked") == 0)
+        return bench_chunked(argc - 1, argv + 1);
+    usage(argv[0]);
+    return 1;
+}
+
+/*
+ * usage - print the modes of the benchmark
+ */
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s load [-c clients] [-n requests] "
+            "[-o objects] [-s size] [-k] [-u] [-S] [-P port] "
+            "-- <proxy> [args]\n", prog);
+    fprintf(stderr, "       %s lookup [-n lookups]\n", prog);
+    fprintf(stderr, "       %s policy [-n requests] [-o objects] "
+            "[-a alpha] [-S scan]\n", prog);
+    fprintf(stderr, "       %s lines [-n blocks]\n", prog);
+    fprintf(stderr, "       %s reqhdrs [-n requests] [-H headers]\n", prog);
+    fprintf(stderr, "       %s headers [-n blocks]\n", prog);
+    fprintf(stderr, "       %s chunked [-P port] -- <proxy> [args]\n",
+            prog);
+}
+
+/*
+ * bench_load - run the load benchmark, see the top of the file
+ */
+static int bench_load(int argc, char **argv)
+{
+    benchload bl = { 4, 20000, 100, 10240, 0, 0, BENCH_PORT, 0, 0, 0, 0, 0 };
+    int opt, listenfd, status, i;
+    long long stops = 0;
+    pthread_t tid;
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    pid_t pid, w;
+
+    while ((opt = getopt(argc, argv, "c:n:o:s:kuSP:")) != -1) {
+        switch (opt) {
+        case 'c': bl.clients = atoi(optarg); break;
+        case 'n': bl.requests = atol(optarg); break;
+        case 'o': bl.objects = atoi(optarg); break;
+        case 's': bl.size = strtoul(optarg, NULL, 10); break;
+        case 'k': bl.keepalive = 1; break;
+        case 'u': bl.nostore = 1; break;
+        case 'S': bl.trace = 1; break;
+        case 'P': bl.proxyport = atoi(optarg); break;
+        default: usage("bench"); return 1;
+        }
+    }
+    if (optind >= argc || bl.clients <= 0 || bl.objects <= 0) {
+        usage("bench");
+        return 1;
+    }
+
+    memset(body, 'x', sizeof(body));
+    if ((listenfd = Open_listenfd(0)) < 0)
+        return 1;
+    getsockname(listenfd, (SA *)&sa, &len);
+    bl.originport = ntohs(sa.sin_port);
+    Pthread_create(&tid, NULL, origin_thread, (void *)(long)listenfd);
+
+    if ((pid = proxy_start(argv + optind, bl.proxyport, bl.trace)) < 0)
+        return 1;
+    printf("load:");
+    for (i = optind; i < argc; i++)
+        printf(" %s", argv[i]);
+    printf(", %d clients, %ld requests of %zu bytes over %d objects%s%s\n",
+            bl.clients, bl.requests, bl.size, bl.objects,
+            bl.keepalive ? ", keep-alive" : "",
+            bl.nostore ? ", not cached" : "");
+
+    /* The ptrace requests come from the thread which forked the proxy, the
+     * clients run in another one meanwhile */
+    Pthread_create(&tid, NULL, load_thread, &bl);
+    if (bl.trace) {
+        while ((w = waitpid(-1, &status, __WALL)) > 0) {
+            if (WIFEXITED(status) || WIFSIGNALED(status)) {
+                if (w == pid)
+                    break;
+                continue;
+            }
+            if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+                stops += counting;
+            ptrace(PTRACE_SYSCALL, w, NULL, (WSTOPSIG(status) == SIGTRAP ||
+                        WSTOPSIG(status) == (SIGTRAP | 0x80) ||
+                        WSTOPSIG(status) == SIGSTOP) ?
+                    0 : (void *)(long)WSTOPSIG(status));
+        }
+    }
+    else
+        waitpid(pid, &status, 0);
+    Pthread_join(tid, NULL);
+    if (bl.errors < 0)
+        return 1;
+    if (bl.trace)
+        printf("  proxy syscalls: %.1f/request\n",
+                (double)stops / 2 / bl.requests);
+    return 0;
+}
+
+/*
+ * load_thread - warm the cache up, run the clients and report, then stop
+ * the proxy
+ */
+static void *load_thread(void *vargp)
+{
+    benchload *bl = vargp;
+    pthread_t *tids = Malloc(bl->clients * sizeof(pthread_t));
+    double start, secs, cpu0, cpu;
+    rio_t rio;
+    int i, fd = -1;
+
+    if (proxy_wait(bl->proxyport) < 0) {
+        bl->errors = -1;
+        proxy_cpu(-1);
+        return NULL;
+    }
+    for (i = 0; i < bl->objects; i++)
+        client_get(bl, &fd, &rio, i);
+    if (fd >= 0)
+        Close(fd);
+    bl->errors = 0;
+    bl->bytes = 0;
+    bl->next = 0;
+
+    cpu0 = proxy_cpu(0);
+    counting = 1;
+    start = now();
+    for (i = 0; i < bl->clients; i++)
+        Pthread_create(&tids[i], NULL, client_thread, bl);
+    for (i = 0; i < bl->clients; i++)
+        Pthread_join(tids[i], NULL);
+    secs = now() - start;
+    counting = 0;
+    cpu = proxy_cpu(0) - cpu0;
+
+    printf("  %ld errors\n", bl->errors);
+    if (!bl->trace) {
+        printf("  %.0f requests/s, %.1f MB/s\n", bl->requests / secs,
+                bl->bytes / secs / 1e6);
+        printf("  proxy cpu: %.1f us/request, %.2f s/GB\n",
+                cpu * 1e6 / bl->requests,
+                bl->bytes ? cpu * 1e9 / bl->bytes : 0);
+    }
+    fflush(stdout);
+    proxy_cpu(-1);   /* stop it */
+    Free(tids);
+    return NULL;
+}
+
+/*
+ * client_thread - send requests through the proxy until every request of
+ * the load was sent
+ */
+static void *client_thread(void *vargp)
+{
+    benchload *bl = vargp;
+    rio_t rio;
+    long i;
+    int fd = -1;
+
+    while ((i = __sync_fetch_and_add(&bl->next, 1)) < bl->requests) {
+        if (client_get(bl, &fd, &rio, (i * 7919) % bl->objects) < 0)
+            __sync_fetch_and_add(&bl->errors, 1);
+    }
+    if (fd >= 0)
+        Close(fd);
+    return NULL;
+}
+
+/*
+ * client_get - fetch the object obj through the proxy, over *fd if it is
+ * kept open
+ * Return 0 on success -1 on error
+ */
+static int client_get(benchload *bl, int *fd, rio_t *rio, int obj)
+{
+    char buf[MAXLINE];
+    static char sink[BENCH_BODY];
+    long clen = -1;
+    ssize_t n;
+    size_t want;
+    int len;
+
+    if (*fd < 0) {
+        if ((*fd = open_clientfd("127.0.0.1", bl->proxyport)) < 0)
+            return -1;
+        rio_readinitb(rio, *fd);
+    }
+    len = snprintf(buf, sizeof(buf), "GET http://127.0.0.1:%d/o%d/%zu%s "
+            "HTTP/1.%d\r\nHost: 127.0.0.1:%d\r\n\r\n", bl->originport, obj,
+            bl->size, bl->nostore ? "/nostore" : "", bl->keepalive,
+            bl->originport);
+    if (rio_writen(*fd, buf, len) != len)
+        goto fail;
+
+    while ((n = rio_readlineb(rio, buf, sizeof(buf))) > 0 &&
+            strcmp(buf, "\r\n") != 0) {
+        if (strncasecmp(buf, "Content-Length:", 15) == 0)
+            clen = atol(buf + 15);
+    }
+    if (n <= 0 || clen < 0)
+        goto fail;
+    for (want = clen; want > 0; want -= n) {
+        if ((n = rio_readnb(rio, sink, want < sizeof(sink) ?
+                        want : sizeof(sink))) <= 0)
+            goto fail;
+    }
+    __sync_fetch_and_add(&bl->bytes, clen);
+    if (!bl->keepalive) {
+        Close(*fd);
+        *fd = -1;
+    }
+    return 0;
+
+fail:
+    Close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+/*
+ * origin_thread - accept the connections of the proxy to the origin, one
+ * thread each
+ */
+static void *origin_thread(void *vargp)
+{
+    int listenfd = (int)(long)vargp, connfd;
+    pthread_t tid;
+
+    Pthread_detach(pthread_self());
+    while ((connfd = accept(listenfd, NULL, NULL)) >= 0)
+        Pthread_create(&tid, NULL, origin_serve, (void *)(long)connfd);
+    return NULL;
+}
+
+/*
+ * origin_serve - answer the requests of a connection: /o<n>/<size> is
+ * size bytes, cached an hour unless the uri has /nostore. With /chunked
+ * its length is not told, it is sent in chunks of BENCH_CHUNK bytes to an
+ * HTTP/1.1 request and until the connection is closed otherwise. /slow
+ * holds the content back for a moment
+ */
+static void *origin_serve(void *vargp)
+{
+    int fd = (int)(long)vargp, keep = 1, chunked, slow;
+    char line[MAXLINE], hdrs[MAXLINE], clen[64];
+    size_t size, left, n;
+    rio_t rio;
+    int len;
+
+    Pthread_detach(pthread_self());
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &keep, sizeof(keep));
+    rio_readinitb(&rio, fd);
+    while (rio_readlineb(&rio, line, sizeof(line)) > 0) {
+        keep = (strstr(line, "HTTP/1.1") != NULL);
+        chunked = (strstr(line, "/chunked") != NULL);
+        slow = (strstr(line, "/slow") != NULL);
+        size = (strchr(line + 6, '/') != NULL) ?
+            strtoul(strchr(line + 6, '/') + 1, NULL, 10) : 0;
+        if (!chunked)
+            sprintf(clen, "Content-Length: %zu\r\n", size);
+        len = snprintf(hdrs, sizeof(hdrs), "HTTP/1.1 200 OK\r\n"
+                "%sCache-Control: %s\r\n%s\r\n", !chunked ? clen : keep ?
+                "Transfer-Encoding: chunked\r\n" : "",
+                strstr(line, "/nostore") ? "no-store" : "max-age=3600",
+                keep ? "" : "Connection: close\r\n");
+        while (rio_readlineb(&rio, line, sizeof(line)) > 0 &&
+                strcmp(line, "\r\n") != 0)
+            ;
+        if (rio_writen(fd, hdrs, len) != len)
+            break;
+        if (slow)
+            usleep(200000);
+        chunked = chunked && keep;
+        for (left = size; left > 0; left -= n) {
+            n = left < sizeof(body) ? left : sizeof(body);
+            if (chunked && n > BENCH_CHUNK)
+                n = BENCH_CHUNK;
+            len = sprintf(clen, "%zx;n=%zu\r\n", n, size - left);
+            if ((chunked && rio_writen(fd, clen, len) != len) ||
+                    rio_writen(fd, body, n) != n ||
+                    (chunked && rio_writen(fd, "\r\n", 2) != 2))
+                break;
+        }
+        if (chunked && rio_writen(fd, "0\r\nX-Trailer: 1\r\n\r\n", 22) != 22)
+            break;
+        if (!keep)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+/*
+ * proxy_start - run the proxy of argv with port appended, under ptrace if
+ * trace
+ * Return its pid, -1 on error
+ */
+static pid_t proxy_start(char **argv, int port, int trace)
+{
+    char portstr[16], **args;
+    int n, status, devnull;
+    pid_t pid;
+
+    for (n = 0; argv[n] != NULL; n++)
+        ;
+    args = Calloc(n + 2, sizeof(char *));
+    memcpy(args, argv, n * sizeof(char *));
+    sprintf(portstr, "%d", port);
+    args[n] = portstr;
+
+    if ((pid = fork()) < 0) {
+        unix_error("fork error");
+        return -1;
+    }
+    if (pid == 0) {
+        if ((devnull = open("/dev/null", O_WRONLY)) >= 0)
+            dup2(devnull, STDOUT_FILENO);
+        if (trace) {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+        execv(args[0], args);
+        _exit(127);
+    }
+    Free(args);
+    proxy_cpu(pid);
+
+    if (trace) {
+        waitpid(pid, &status, 0);
+        ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)(long)(
+                    PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                    PTRACE_O_EXITKILL));
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+    }
+    return pid;
+}
+
+/*
+ * proxy_wait - wait until the proxy accepts connections on port
+ * Return 0 once it does, -1 if it did not within 5 seconds
+ */
+static int proxy_wait(int port)
+{
+    int i, fd;
+
+    for (i = 0; i < 100; i++) {
+        if ((fd = open_clientfd("127.0.0.1", port)) >= 0) {
+            Close(fd);
+            return 0;
+        }
+        usleep(50000);
+    }
+    fprintf(stderr, "the proxy does not accept on port %d\n", port);
+    return -1;
+}
+
+/*
+ * proxy_cpu - the CPU seconds the proxy has used so far. A pid > 0 tells
+ * which process the proxy is, -1 kills it
+ */
+static double proxy_cpu(pid_t pid)
+{
+    static pid_t proxy;
+    char path[64], stat[1024], *p;
+    unsigned long utime, stime;
+    FILE *fp;
+    int n;
+
+    if (pid > 0) {
+        proxy = pid;
+        return 0;
+    }
+    if (pid < 0) {
+        kill(proxy, SIGKILL);
+        return 0;
+    }
+
+    sprintf(path, "/proc/%d/stat", (int)proxy);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    n = fread(stat, 1, sizeof(stat) - 1, fp);
+    fclose(fp);
+    stat[n > 0 ? n : 0] = '\0';
+
+    /* utime and stime are the 12th and 13th fields after the name */
+    if ((p = strrchr(stat, ')')) == NULL ||
+            sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                "%lu %lu", &utime, &stime) != 2)
+        return 0;
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/*
+ * bench_lookup - run the lookup benchmark, see the top of the file
+ */
+static int bench_lookup(int argc, char **argv)
+{
+    static int counts[] = { 100, 1000, 10000, 100000 };
+    long lookups = 1000000, reflookups, i;
+    char hdrs[] = "HTTP/1.0 200 OK\r\n\r\n", **uris;
+    int c, n, opt, *picks;
+    double hit, miss, refhit, refmiss, start;
+    pxycache cache;
+    cacheobj *obj;
+    listcache lc;
+    listobj *lo;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': lookups = atol(optarg); break;
+        default: usage("bench"); return 1;
+        }
+    }
+
+    printf("lookup: ns per lookup\n");
+    printf("  %8s %8s %8s %10s %10s\n", "objects", "hit", "miss",
+            "list hit", "list miss");
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        n = counts[c];
+        /* the first n are cached, the next n are not */
+        uris = bench_uris(2 * n);
+        picks = Malloc(lookups * sizeof(int));
+        for (i = 0; i < lookups; i++)
+            picks[i] = bench_rand() % n;
+
+        init_cache(&cache, "lru");
+        lc.head = lc.rear = NULL;
+        pthread_rwlock_init(&lc.lock, NULL);
+        for (i = 0; i < n; i++) {
+            obj = new_obj(uris[i], hdrs, strlen(hdrs), chunks_copy("x", 1),
+                    1);
+            obj_refresh(obj, time(NULL) + 3600);
+            insert_object(&cache, obj);
+            lo = Malloc(sizeof(listobj));
+            lo->uri = uris[i];
+            lo->prev = NULL;
+            if ((lo->next = lc.head) != NULL)
+                lc.head->prev = lo;
+            else
+                lc.rear = lo;
+            lc.head = lo;
+        }
+
+        start = now();
+        for (i = 0; i < lookups; i++) {
+            if ((obj = get_obj_from_cache(&cache, uris[picks[i]], NULL)))
+                obj_read_done(obj);
+        }
+        hit = (now() - start) * 1e9 / lookups;
+        start = now();
+        for (i = 0; i < lookups; i++)
+            get_obj_from_cache(&cache, uris[n + picks[i]], NULL);
+        miss = (now() - start) * 1e9 / lookups;
+
+        /* The list is walked far slower, fewer lookups do */
+        reflookups = lookups / (n / 100);
+        start = now();
+        for (i = 0; i < reflookups; i++) {
+            list_lookup(&lc, uris[picks[i]]);
+            pthread_rwlock_unlock(&lc.lock);
+        }
+        refhit = (now() - start) * 1e9 / reflookups;
+        start = now();
+        for (i = 0; i < reflookups; i++)
+            list_lookup(&lc, uris[n + picks[i]]);
+        refmiss = (now() - start) * 1e9 / reflookups;
+
+        printf("  %8d %8.0f %8.0f %10.0f %10.0f\n", n, hit, miss, refhit,
+                refmiss);
+        while ((lo = lc.head) != NULL) {
+            lc.head = lo->next;
+            Free(lo);
+        }
+        for (i = 0; i < 2 * n; i++)
+            Free(uris[i]);
+        Free(uris);
+        Free(picks);
+    }
+    return 0;
+}
+
+/*
+ * list_lookup - the lookup of the cache before it had a hash index
+ * Return the object of uri with the reader lock held, NULL otherwise
+ */
+static listobj *list_lookup(listcache *lc, char *uri)
+{
+    listobj *tmp = lc->head;
+
+    while (tmp != NULL) {
+        pthread_rwlock_rdlock(&lc->lock);
+        if (strcmp(uri, tmp->uri) == 0) {
+            pthread_rwlock_unlock(&lc->lock);
+
+            /* LRU: put tmp at the head */
+            pthread_rwlock_wrlock(&lc->lock);
+            if (tmp->prev != NULL) {
+                if ((tmp->prev->next = tmp->next) != NULL)
+                    tmp->next->prev = tmp->prev;
+                else
+                    lc->rear = tmp->prev;
+                tmp->next = lc->head;
+                tmp->prev = NULL;
+                lc->head->prev = tmp;
+                lc->head = tmp;
+            }
+            pthread_rwlock_unlock(&lc->lock);
+
+            pthread_rwlock_rdlock(&lc->lock);
+            return tmp;
+        }
+        pthread_rwlock_unlock(&lc->lock);
+        tmp = tmp->next;
+    }
+    return NULL;
+}
+
+/*
+ * bench_policy - run the eviction policy benchmark, see the top of the
+ * file
+ */
+static int bench_policy(int argc, char **argv)
+{
+    static char *policies[] = { "lru", "clock", "s3fifo", "tinylfu", "gdsf" };
+    long requests = 200000, lookups = 1000000, hits, i, j;
+    int objects = 2000, scan = 300, opt, p, nhot, *trace, *hot;
+    long long bytes, hitbytes;
+    char hdrs[] = "HTTP/1.0 200 OK\r\n\r\n", **uris, buf[MAXLINE];
+    double alpha = 0.9, *cdf, sum, start;
+    pxycache cache;
+    cacheobj *obj;
+    size_t size;
+
+    while ((opt = getopt(argc, argv, "n:o:a:S:")) != -1) {
+        switch (opt) {
+        case 'n': requests = atol(optarg); break;
+        case 'o': objects = atoi(optarg); break;
+        case 'a': alpha = atof(optarg); break;
+        case 'S': scan = atoi(optarg); break;
+        default: usage("bench"); return 1;
+        }
+    }
+    if (objects <= 0 || scan < 0 || scan > 1000) {
+        usage("bench");
+        return 1;
+    }
+
+    /* The trace: -1 - i is the i-th one hit wonder, the Zipf picks are
+     * found in the cumulated probabilities */
+    cdf = Malloc(objects * sizeof(double));
+    for (i = 0, sum = 0; i < objects; i++)
+        cdf[i] = (sum += 1 / pow(i + 1, alpha));
+    trace = Malloc(requests * sizeof(int));
+    for (i = 0; i < requests; i++) {
+        double r = (bench_rand() >> 11) * 0x1.0p-53 * sum;
+        long lo = 0, hi = objects - 1;
+
+        if (i % 1000 < scan) {
+            trace[i] = -1 - i;
+            continue;
+        }
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (cdf[mid] < r)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        trace[i] = lo;
+    }
+    uris = bench_uris(objects);
+    hot = Malloc(objects * sizeof(int));
+
+    printf("policy: %ld requests over %d objects, Zipf %.2f, %d/1000 "
+            "scanned, %d KB cache\n", requests, objects, alpha, scan,
+            MAX_CACHE_SIZE / 1024);
+    printf("  %8s %8s %10s %8s\n", "policy", "hits", "byte hits",
+            "hit ns");
+    for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        init_cache(&cache, policies[p]);
+        hits = 0;
+        bytes = hitbytes = 0;
+        for (i = 0; i < requests; i++) {
+            if (trace[i] < 0)
+                sprintf(buf, "http://www.example.com:80/scan/%d", -trace[i]);
+            else
+                strcpy(buf, uris[trace[i]]);
+            size = policy_size(trace[i]);
+            bytes += size;
+            if ((obj = get_obj_from_cache(&cache, buf, NULL)) != NULL) {
+                hits++;
+                hitbytes += size;
+                obj_read_done(obj);
+                continue;
+            }
+            obj = new_obj(buf, hdrs, strlen(hdrs), chunks_copy(body, size),
+                    size);
+            obj_refresh(obj, time(NULL) + 3600);
+            obj->cost = 1000 + size / 100;   /* about a LAN fetch */
+            insert_object(&cache, obj);
+        }
+
+        /* The hit path, on the objects the trace left cached */
+        for (i = nhot = 0; i < objects; i++) {
+            if (iscached(&cache, uris[i]))
+                hot[nhot++] = i;
+        }
+        start = now();
+        for (i = j = 0; nhot > 0 && i < lookups; i++, j = (j + 1) % nhot) {
+            if ((obj = get_obj_from_cache(&cache, uris[hot[j]], NULL)))
+                obj_read_done(obj);
+        }
+        printf("  %8s %7.1f%% %9.1f%% %8.0f\n", policies[p],
+                100.0 * hits / requests, 100.0 * hitbytes / bytes,
+                nhot > 0 ? (now() - start) * 1e9 / lookups : 0);
+    }
+    for (i = 0; i < objects; i++)
+        Free(uris[i]);
+    Free(uris);
+    Free(trace);
+    Free(hot);
+    Free(cdf);
+    return 0;
+}
+
+/*
+ * policy_size - the size of the object obj of the policy trace, 1 to 20 KB
+ */
+static size_t policy_size(int obj)
+{
+    return 1024 + ((unsigned int)obj * 2654435761U) % (19 * 1024);
+}
+
+/*
+ * bench_lines - run the line reader benchmark, see the top of the file
+ */
+static int bench_lines(int argc, char **argv)
+{
+    static char *names[] = { "byte at a time", "rio_readlineb", "rio_readlinev" };
+    char *blocks[] = { reqblock, resblock }, line[MAXLINE], *v;
+    long n = 1000000, i, lines;
+    int b, r, opt;
+    size_t len;
+    double start, secs;
+    rio_t rio;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': n = atol(optarg); break;
+        default: usage("bench"); return 1;
+        }
+    }
+
+    printf("lines: %ld header blocks read line by line\n", n);
+    printf("  %-16s %-9s %10s %12s %8s\n", "reader", "block", "ns/block",
+            "lines/s", "MB/s");
+    for (b = 0; b < 2; b++) {
+        len = strlen(blocks[b]);
+        for (r = 0; r < 3; r++) {
+            lines = 0;
+            start = now();
+            for (i = 0; i < n; i++) {
+                rio_fill(&rio, blocks[b], len);
+                switch (r) {
+                case 0:
+                    while (old_rio_readlineb(&rio, line, MAXLINE) > 2)
+                        lines++;
+                    break;
+                case 1:
+                    while (rio_readlineb(&rio, line, MAXLINE) > 2)
+                        lines++;
+                    break;
+                case 2:
+                    while (rio_readlinev(&rio, &v) > 2)
+                        lines++;
+                    break;
+                }
+            }
+            secs = now() - start;
+            printf("  %-16s %-9s %10.0f %12.0f %8.0f\n", names[r],
+                    b ? "response" : "request", secs * 1e9 / n,
+                    lines / secs, n * len / secs / 1e6);
+        }
+    }
+    return 0;
+}
+
+/*
+ * rio_fill - make block, len bytes, what rio has buffered. Its descriptor
+ * is not valid, the readers stop at the blank line before reading more
+ */
+static void rio_fill(rio_t *rio, char *block, size_t len)
+{
+    rio_readinitb(rio, -1);
+    memcpy(rio->rio_buf, block, len);
+    rio->rio_cnt = len;
+}
+
+/*
+ * old_rio_read - rio_read() as the reader below used it, copied from the
+ * csapp.c it was taken out of
+ */
+static ssize_t old_rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR) /* interrupted by sig handler return */
+                return -1;
+        }
+        else if (rp->rio_cnt == 0)  /* EOF */
+            return 0;
+        else
+            rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
+    }
+
+    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
+    cnt = n;
+    if (rp->rio_cnt < n)
+        cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+/*
+ * old_rio_readlineb - rio_readlineb() before it scanned with memchr(), one
+ * rio_read() per byte
+ */
+static ssize_t old_rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = old_rio_read(rp, &c, 1)) == 1) {
+            *bufp++ = c;
+            if (c == '\n')
+                break;
+        } else if (rc == 0) {
+            if (n == 1)
+                return 0; /* EOF, no data read */
+            else
+                break;    /* EOF, some data was read */
+        } else
+            return -1;    /* error */
+    }
+    *bufp = 0;
+    return n;
+}
+
+/*
+ * bench_reqhdrs - run the request building benchmark, see the top of the
+ * file
+ */
+static int bench_reqhdrs(int argc, char **argv)
+{
+    static char *names[] = { "sprintf, bytewise", "sprintf",
+        "parse_request" };
+    char block[RIO_BUFSIZE], req[MAXBUF], method[MAXLINE], uri[MAXLINE];
+    char host[MAXLINE];
+    long n = 200000, i;
+    int headers = 50, len, r, opt, port, keepalive;
+    double start, secs;
+    rio_t rio;
+
+    while ((opt = getopt(argc, argv, "n:H:")) != -1) {
+        switch (opt) {
+        case 'n': n = atol(optarg); break;
+        case 'H': headers = atoi(optarg); break;
+        default: usage("bench"); return 1;
+        }
+    }
+
+    /* The request of the browser, then made up headers up to the count */
+    len = strstr(reqblock, "\r\n\r\n") + 2 - reqblock;
+    memcpy(block, reqblock, len);
+    for (r = 16; r < headers && len < RIO_BUFSIZE - 128; r++)
+        len += sprintf(block + len, "X-Request-Tag-%02d: "
+                "v=%08llx; region=eu-west-1; tier=edge\r\n", r,
+                bench_rand() & 0xffffffffULL);
+    len += sprintf(block + len, "\r\n");
+
+    printf("reqhdrs: %ld requests of %d headers, %d bytes\n", n, r, len);
+    printf("  %-18s %10s %12s\n", "builder", "ns/request", "requests/s");
+    for (r = 0; r < 3; r++) {
+        start = now();
+        for (i = 0; i < n; i++) {
+            rio_fill(&rio, block, len);
+            if (r < 2)
+                old_request(&rio, req, r == 0);
+            else
+                parse_request(&rio, method, uri, req, host, &port,
+                        &keepalive);
+        }
+        secs = now() - start;
+        printf("  %-18s %10.0f %12.0f\n", names[r], secs * 1e9 / n,
+                n / secs);
+    }
+    return 0;
+}
+
+/* The old code as it was: it could overflow its buffers, and append by
+ * copying req onto itself, which is what made it quadratic */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wrestrict"
+#pragma GCC diagnostic ignored "-Wformat-overflow"
+
+/*
+ * old_request - build req from the request in rio the way doproxy() did
+ * before the header builder, reading the lines a byte at a time if
+ * bytewise
+ * Return what read_requesthdrs() returned
+ */
+static int old_request(rio_t *rio, char *req, int bytewise)
+{
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], protocal[MAXLINE];
+    char reqbuf[MAXBUF], furi[MAXLINE], host[MAXLINE];
+    int hdr_res, port;
+
+    if ((bytewise ? old_rio_readlineb(rio, buf, MAXLINE) :
+                rio_readlineb(rio, buf, MAXLINE)) < 0)
+        return -1;
+    if (sscanf(buf, "%s %s %s", method, uri, protocal) != 3)
+        return -1;
+    if ((hdr_res = old_requesthdrs(rio, reqbuf, bytewise)) == -1)
+        return -1;
+
+    /* parse_uri() */
+    sscanf(uri, "%*[^:]://%[^/]%s", host, furi);
+    if (strstr(host, ":")) {
+        strcpy(buf, host);
+        sscanf(buf, "%[^:]:%d", host, &port);
+    }
+    if (!hdr_res) {
+        sprintf(req, "Host %s\r\n%s", host, reqbuf);
+        sprintf(reqbuf, "%s", req);
+    }
+    sprintf(req, "GET %s HTTP/1.0\r\n%s", furi, reqbuf);
+    return hdr_res;
+}
+
+/*
+ * old_requesthdrs - read_requesthdrs() before the header builder
+ */
+static int old_requesthdrs(rio_t *rio, char *req, int bytewise)
+{
+    static const char *user_agent = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+    static const char *accepts = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
+    static const char *accept_encoding = "Accept-Encoding: gzip, deflate\r\n";
+    static const char *connection = "Connection: close\r\n";
+    static const char *proxy_connection = "Proxy-Connection: close\r\n";
+    char buf[MAXLINE] = "";
+    char host[MAXLINE];
+    int ret = 0;
+    int user_agt = 0;
+    int acc = 0;
+    int accept_enc = 0;
+    int conn = 0;
+    int proxy_conn = 0;
+
+    req[0] = '\0';
+    while(strcmp(buf, "\r\n") != 0) {
+        if ((bytewise ? old_rio_readlineb(rio, buf, MAXLINE) :
+                    rio_readlineb(rio, buf, MAXLINE)) < 0)
+            return -1;
+        if (strstr(buf, "Host:")) {
+            ret = 1;
+            sscanf(buf, "%*[^:]: %s", host);
+            sprintf(req, "Host: %s\r\n", host);
+        }
+        else if (strstr(buf, "User-Agent:")) {
+            sprintf(req, "%s%s", req, user_agent);
+            user_agt = 1;
+        }
+        else if (strstr(buf, "Accept:")) {
+            sprintf(req, "%s%s", req, accepts);
+            acc = 1;
+        }
+        else if (strstr(buf, "Accept-Encoding:")){
+            sprintf(req, "%s%s", req, accept_encoding);
+            accept_enc = 1;
+        }
+        else if (strstr(buf, "Connection:")){
+            sprintf(req, "%s%s", req, connection);
+            conn = 1;
+        }
+        else if (strstr(buf, "Proxy-Connectioan:")){
+            sprintf(req, "%s%s", req, proxy_connection);
+            proxy_conn = 1;
+        }
+        else {
+            if (strcmp(buf, "\r\n") != 0)
+                sprintf(req, "%s%s", req, buf);
+        }
+    }
+
+    /* Format a new req which will be foward to server later*/
+    if (user_agt == 0)
+        sprintf(req, "%s%s", req, user_agent);
+    if (acc == 0)
+        sprintf(req, "%s%s", req, accepts);
+    if (accept_enc == 0)
+        sprintf(req, "%s%s", req, accept_encoding);
+    if (conn == 0)
+        sprintf(req, "%s%s", req, connection);
+    if (proxy_conn == 0)
+        sprintf(req, "%s%s", req, proxy_connection);
+    sprintf(req, "%s\r\n", req);
+
+    return ret;
+}
+#pragma GCC diagnostic pop
+
+/*
+ * bench_headers - run the header parsing benchmark, see the top of the
+ * file
+ */
+static int bench_headers(int argc, char **argv)
+{
+    static char *names[] = { "prefix compares", "perfect hash" };
+    char *blocks[] = { reqblock, resblock }, *pos, *nl;
+    long n = 1000000, i, fields, known;
+    int b, r, opt;
+    double start, secs;
+    hdrfield f;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n': n = atol(optarg); break;
+        default: usage("bench"); return 1;
+        }
+    }
+
+    printf("headers: %ld header blocks classified field by field\n", n);
+    printf("  %-16s %-9s %10s %12s %6s\n", "parser", "block", "ns/block",
+            "headers/s", "known");
+    for (b = 0; b < 2; b++) {
+        for (r = 0; r < 2; r++) {
+            fields = known = 0;
+            start = now();
+            for (i = 0; i < n; i++) {
+                pos = header_first(blocks[b]);
+                if (r == 0) {
+                    while ((nl = strchr(pos, '\n')) != NULL &&
+                            nl - pos > 1) {
+                        if (old_header_id(pos, nl + 1 - pos) != HDR_OTHER)
+                            known++;
+                        fields++;
+                        pos = nl + 1;
+                    }
+                } else {
+                    while (header_next(&pos, &f)) {
+                        known += f.id != HDR_OTHER;
+                        fields++;
+                    }
+                }
+            }
+            secs = now() - start;
+            printf("  %-16s %-9s %10.0f %12.0f %6ld\n", names[r],
+                    b ? "response" : "request", secs * 1e9 / n,
+                    fields / secs, known / n);
+        }
+    }
+    return 0;
+}
+
+/*
+ * old_header_id - the id of the header line of len bytes, found with one
+ * prefix compare per known name as header_is() did
+ */
+static int old_header_id(char *line, size_t len)
+{
+    static char *names[] = { NULL, "Host:", "User-Agent:", "Accept:",
+        "Accept-Encoding:", "Connection:", "Proxy-Connection:",
+        "Keep-Alive:", "Content-Length:", "Transfer-Encoding:",
+        "Cache-Control:", "Expires:", "Date:", "Last-Modified:", "Age:",
+        "ETag:", "Vary:", "If-None-Match:", "If-Modified-Since:" };
+    size_t n;
+    int id;
+
+    for (id = HDR_OTHER + 1; id < HDR_IDS; id++) {
+        n = strlen(names[id]);
+        if (len > n && strncasecmp(line, names[id], n) == 0)
+            return id;
+    }
+    return HDR_OTHER;
+}
+
+/*
+ * bench_chunked - run the chunked check, see the top of the file
+ */
+static int bench_chunked(int argc, char **argv)
+{
+    /* The path, the version of the client and the size of each request,
+     * the HTTP/1.0 client of the third one waits on the fetch of the
+     * HTTP/1.1 client of the second */
+    static benchget gets[] = {
+        { 0, 0, "/c1/3000/chunked", 0, 3000, 0 },
+        { 0, 0, "/c2/25000/chunked/slow", 1, 25000, 0 },
+        { 0, 0, "/c2/25000/chunked/slow", 0, 25000, 0 },
+        { 0, 0, "/c2/25000/chunked/slow", 0, 25000, 0 },
+        { 0, 0, "/c2/25000/chunked/slow", 1, 25000, 0 },
+        { 0, 0, "/c3/4000/chunked/nostore", 1, 4000, 0 },
+        { 0, 0, "/c3/4000/chunked/nostore", 0, 4000, 0 },
+    };
+    static char *names[] = { "HTTP/1.0 client, not cached",
+        "HTTP/1.1 client, fetching", "HTTP/1.0 client, waiting on it",
+        "HTTP/1.0 client, from the cache", "HTTP/1.1 client, from the cache",
+        "HTTP/1.1 client, not to be cached",
+        "HTTP/1.0 client, not to be cached" };
+    int opt, listenfd, i, port = BENCH_PORT, failed = 0;
+    pthread_t tid;
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "P:")) != -1) {
+        switch (opt) {
+        case 'P': port = atoi(optarg); break;
+        default: usage("bench"); return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage("bench");
+        return 1;
+    }
+
+    memset(body, 'x', sizeof(body));
+    if ((listenfd = Open_listenfd(0)) < 0)
+        return 1;
+    getsockname(listenfd, (SA *)&sa, &len);
+    Pthread_create(&tid, NULL, origin_thread, (void *)(long)listenfd);
+    if ((pid = proxy_start(argv + optind, port, 0)) < 0)
+        return 1;
+    if (proxy_wait(port) < 0) {
+        proxy_cpu(-1);
+        return 1;
+    }
+
+    printf("chunked:");
+    for (i = optind; i < argc; i++)
+        printf(" %s", argv[i]);
+    printf("\n");
+    for (i = 0; i < sizeof(gets) / sizeof(gets[0]); i++) {
+        gets[i].proxyport = port;
+        gets[i].originport = ntohs(sa.sin_port);
+    }
+    chunked_get(&gets[0]);
+    Pthread_create(&tid, NULL, chunked_thread, &gets[1]);
+    usleep(50000);
+    chunked_get(&gets[2]);
+    Pthread_join(tid, NULL);
+    for (i = 3; i < sizeof(gets) / sizeof(gets[0]); i++)
+        chunked_get(&gets[i]);
+
+    for (i = 0; i < sizeof(gets) / sizeof(gets[0]); i++) {
+        printf("  %-36s %s\n", names[i], gets[i].res == 0 ? "ok" : "FAILED");
+        failed |= gets[i].res;
+    }
+    proxy_cpu(-1);
+    waitpid(pid, NULL, 0);
+
+    /* The listener of an io_uring proxy is closed after it exited, wait
+     * for it so a next run gets the port */
+    for (i = 0; i < 100 && (listenfd = open_clientfd("127.0.0.1", port)) >= 0;
+            i++) {
+        Close(listenfd);
+        usleep(50000);
+    }
+    return failed ? 1 : 0;
+}
+
+/*
+ * chunked_thread - chunked_get() from a thread of its own
+ */
+static void *chunked_thread(void *vargp)
+{
+    chunked_get(vargp);
+    return NULL;
+}
+
+/*
+ * chunked_get - send the request g through the proxy, over a connection
+ * closed after it, and check what comes back: chunks only to an HTTP/1.1
+ * client, and the size bytes of the content
+ * Return g->res, 0 if the response was right, -1 otherwise
+ */
+static int chunked_get(benchget *g)
+{
+    char req[MAXLINE], *res, *content;
+    size_t cap = g->size + MAXBUF, got = 0;
+    ssize_t n;
+    int fd, len, chunked;
+    hdrfield f;
+
+    g->res = -1;
+    if ((fd = open_clientfd("127.0.0.1", g->proxyport)) < 0)
+        return -1;
+    len = snprintf(req, sizeof(req), "GET http://127.0.0.1:%d%s HTTP/1.%d"
+            "\r\nHost: 127.0.0.1:%d\r\n%s\r\n", g->originport, g->path,
+            g->http11, g->originport, g->http11 ? "Connection: close\r\n" :
+            "");
+    res = Malloc(cap + 1);
+    if (rio_writen(fd, req, len) == len) {
+        while (got < cap && (n = read(fd, res + got, cap - got)) > 0)
+            got += n;
+    }
+    Close(fd);
+    res[got] = '\0';
+
+    if ((content = strstr(res, "\r\n\r\n")) != NULL) {
+        content[2] = '\0';
+        content += 4;
+        len = got - (content - res);
+        chunked = (header_find(res, HDR_TRANSFER_ENCODING, &f) &&
+                header_token(&f, "chunked"));
+        if (chunked && g->http11)
+            len = chunked_decode(content, len);
+        if (strncmp(res, "HTTP/1.1 200 ", 13) == 0 && (!chunked ||
+                    g->http11) && len == g->size &&
+                strspn(content, "x") == g->size)
+            g->res = 0;
+    }
+    Free(res);
+    return g->res;
+}
+
+/*
+ * chunked_decode - decode in place the chunked content of len bytes
+ * Return the length of the decoded content, -1 if it is not chunked right
+ */
+static ssize_t chunked_decode(char *content, size_t len)
+{
+    char *p = content, *end = content + len, *out = content, *nl;
+    size_t n;
+
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+        n = strtoul(p, NULL, 16);
+        p = nl + 1;
+        if (n == 0) {
+            *out = '\0';
+            return out - content;
+        }
+        if (n + 2 > end - p || p[n] != '\r')
+            return -1;
+        memmove(out, p, n);
+        out += n;
+        p += n + 2;
+    }
+    return -1;
+}
+
+/*
+ * bench_uris - n distinct uris looking like the ones of a web site
+ */
+static char **bench_uris(int n)
+{
+    char **uris = Malloc(n * sizeof(char *)), buf[MAXLINE];
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sprintf(buf, "http://www.example.com:80/static/img/%d/%08llx%d.png",
+                i % 97, bench_rand() & 0xffffffffULL, i);
+        uris[i] = strdup(buf);
+    }
+    return uris;
+}
+
+/*
+ * bench_rand - a xorshift pseudo random number, the same sequence every
+ * run
+ */
+static unsigned long long bench_rand(void)
+{
+    static unsigned long long x = 88172645463325252ULL;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+/*
+ * now - the time in seconds
+ */
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
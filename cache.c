@@ -4,251 +4,551 @@
  * cache.h include the structure and basic functions of a cache specialy designed
  * for the web proxy. 
  * The common operations involve searching the cache, insert or delete a cached object
- * These operations are thread-safe using pthread reader-writer lock
+ * These operations are thread-safe using one pthread reader-writer lock per shard,
+ * the objects themselves are kept alive by their reference count
  */
 
 #include "cache.h"
+#include "slab.h"
+#include "evict.h"
+#include "disk.h"
+#include "snap.h"
+#include "refresh.h"
+#include "header.h"
 
 /* Static helper function */ 
 static void destroy_obj(cacheobj *obj);
+static void put_obj(cacheobj *obj);
+static void unlink_obj(pxycache *Pxycache, cacheshard *shard,
+        cacheobj *obj);
+static cacheobj *lookup(cacheshard *shard, char *uri, unsigned long long hash);
+static void index_add(cacheshard *shard, cacheobj *obj);
+static void index_remove(cacheshard *shard, cacheobj *obj);
+static void index_grow(cacheshard *shard);
+static cacheobj *get_obj_from_disk(pxycache *Pxycache, char *uri,
+        unsigned long long hash);
+
+/* Whether hits carry an Age header */
+static int cache_age = 0;
 
 /*
- * insert_object - insert an object into cache
+ * insert_object - insert an object into cache, with the reference new_obj()
+ * gave the cache. An object too big only drops that reference, so one
+ * pinned by the caller lives until it is done with it
  * Return -1 on fail
  * Return 1 on success
  */
 int insert_object(pxycache *Pxycache, cacheobj *obj)
 {
     size_t content_size = obj->content_size;
+    cacheshard *shard;
+    cacheobj *old, *evicted = NULL;
+    freshinfo fi;
 
     /* if the object size exceeds, return -1 */ 
     if (content_size > MAX_OBJECT_SIZE) {
         dbg_printf("content_size exceeds maximum, disacard!\n");
-        destroy_obj(obj);
+        put_obj(obj);
         return -1;
     }
 
     /* Writer: need to lock to ensure safety */ 
-    pthread_rwlock_wrlock(&(Pxycache->lock));
-
-    if ((content_size + Pxycache->cur_size) <= MAX_CACHE_SIZE) {
-        if (Pxycache->head != NULL)
-            Pxycache->head->prev = obj;
-        obj->next = Pxycache->head;
-        Pxycache->head = obj;
-        if (obj->next == NULL) {
-            Pxycache->rear = obj;
-        }
-        Pxycache->cur_size += content_size;
-    }
-    else { /* Need eviction */ 
-        size_t tmp = 0;
-        while ((content_size + Pxycache->cur_size) > MAX_CACHE_SIZE) {
-            dbg_printf("Eviction! size: %d\n", (int)Pxycache->rear->content_size);
-            tmp = Pxycache->rear->content_size;
-            delete_object(Pxycache, Pxycache->rear);
-            Pxycache->cur_size -= tmp;
-        }
+    shard = SHARD(Pxycache, obj->hash);
+    pthread_rwlock_wrlock(&(shard->lock));
 
-        if (Pxycache->head != NULL)
-            Pxycache->head->prev = obj;
-        obj->next = Pxycache->head;
-        Pxycache->head = obj;
-        if (obj->next == NULL)
-            Pxycache->rear = obj;
-        Pxycache->cur_size += content_size;
+    /* Concurrent misses may store the same uri, keep the newest copy */
+    if ((old = lookup(shard, obj->uri, obj->hash)) != NULL) {
+        unlink_obj(Pxycache, shard, old);
+        put_obj(old);
     }
 
-    pthread_rwlock_unlock(&(Pxycache->lock));
+    Pxycache->policy->insert(shard, obj);
+    shard->cur_size += content_size;
+    index_add(shard, obj);
+
+    /* Need eviction, the policy may pick the new object itself. Readers
+     * still sending an evicted object keep it */ 
+    while (shard->cur_size > SHARD_SIZE &&
+            (old = Pxycache->policy->victim(shard)) != NULL) {
+        dbg_printf("Eviction! size: %d\n", (int)old->content_size);
+        unlink_obj(Pxycache, shard, old);
+        old->next = evicted;
+        evicted = old;
+    }
+    pthread_rwlock_unlock(&(shard->lock));
+
+    /* The evicted objects go to the disk tier once the shard is unlocked */
+    while ((old = evicted) != NULL) {
+        evicted = old->next;
+        fi.expires = old->expires;
+        fi.born = old->born;
+        fi.swr = old->swr;
+        fi.sie = old->sie;
+        disk_store(old->uri, old->hash, old->reshdrs, old->hdrlen,
+                old->content, old->content_size, old->cost, &fi);
+        put_obj(old);
+    }
     dbg_printf("insertion complete\n\n");
     return 1;
 }
 
 /*
  * delete_object - delete the cache object from the cache
+ * Notice: the caller holds the writer lock of the object's shard
  */
 void delete_object(pxycache *Pxycache, cacheobj *obj)
 {
-    if (obj->next == NULL) {
-        Pxycache->rear = obj->prev;
-        if (obj->prev != NULL)
-            obj->prev->next = NULL;
-        else
-            Pxycache->head = NULL;
-        destroy_obj(obj);
-    }
-    else {
-        if (obj->prev != NULL) {
-            obj->prev->next = obj->next;
-            obj->next->prev = obj->prev;
-        }
-        else {
-            obj->next->prev = NULL;
-            Pxycache->head = obj->next;
-        }
-        destroy_obj(obj);
-    }
+    unlink_obj(Pxycache, SHARD(Pxycache, obj->hash), obj);
+    put_obj(obj);
 }
 
 /*
  * iscached - search the cache for uri
- * Return 1 on cached -1 otherwise
+ * Return 1 on cached 0 otherwise
  */
 int iscached(pxycache *Pxycache, char* uri) 
 {
-    cacheobj *tmp;
-    tmp = Pxycache->head;
+    unsigned long long hash = hash_uri(uri);
+    cacheshard *shard = SHARD(Pxycache, hash);
+    int ret;
 
-    while (tmp != NULL) {
-        if ((strcmp(uri, tmp->uri) == 0)) {
-            dbg_printf("cache hit!\n");
-            return 1;
-        }
-        tmp = tmp->next;
-    }
+    pthread_rwlock_rdlock(&(shard->lock));
+    ret = (lookup(shard, uri, hash) != NULL);
+    pthread_rwlock_unlock(&(shard->lock));
 
-    dbg_printf("cache miss!\n");
-    return 0;
+    dbg_printf(ret ? "cache hit!\n" : "cache miss!\n");
+    return ret;
 }
 
 /*
  * get_obj_from_cache - search the cache for uri
  * Return the address of the obj on cached NULL otherwise
- * Notice: this function uses LRU policy
+ * The object is pinned, the caller must call obj_read_done() once it is done
+ * with it. No lock is held when this function returns.
+ * An object found in the snapshot loaded at startup or in the disk tier is
+ * moved back to the memory cache.
+ * A stale object is a miss, unless it may be served while it is refreshed
+ * in the background. If stale is not NULL it is set to the stale object,
+ * pinned as well, so the caller may revalidate it, or to NULL.
+ * Notice: the hit is reported to the eviction policy
  */
-cacheobj *get_obj_from_cache(pxycache *Pxycache, char* uri) 
+cacheobj *get_obj_from_cache(pxycache *Pxycache, char* uri, cacheobj **stale)
 {
+    unsigned long long hash = hash_uri(uri);
+    cacheshard *shard = SHARD(Pxycache, hash);
+    cachepolicy *policy = Pxycache->policy;
     cacheobj *tmp;
-    tmp = Pxycache->head;
+    time_t now = time(NULL);
+
+    if (stale != NULL)
+        *stale = NULL;
+
+    /* A miss, or a hit which does not change the lists, only needs the
+     * reader lock */
+    pthread_rwlock_rdlock(&(shard->lock));
+    if (policy->access != NULL)
+        policy->access(shard, hash);
+    if ((tmp = lookup(shard, uri, hash)) != NULL && !OBJ_SWR(tmp, now)) {
+        dbg_printf("The cached object is stale\n");
+        if (stale != NULL) {
+            __atomic_add_fetch(&tmp->refcnt, 1, __ATOMIC_RELAXED);
+            *stale = tmp;
+        }
+        pthread_rwlock_unlock(&(shard->lock));
+        return NULL;
+    }
+    if (tmp != NULL && !policy->hitlock) {
+        policy->hit(shard, tmp);
+        __atomic_add_fetch(&tmp->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&(shard->lock));
+    if (tmp == NULL) {
+        /* What was saved may have gone stale meanwhile as well */
+        if ((tmp = get_obj_from_disk(Pxycache, uri, hash)) != NULL &&
+                !OBJ_SWR(tmp, now)) {
+            if (stale != NULL)
+                *stale = tmp;
+            else
+                obj_read_done(tmp);
+            return NULL;
+        }
+        if (tmp != NULL && tmp->expires <= now)
+            refresh_schedule(tmp);
+        return tmp;
+    }
+    if (!policy->hitlock) {
+        if (tmp->expires <= now)
+            refresh_schedule(tmp);
+        return tmp;
+    }
 
-    while (tmp != NULL) {
-        pthread_rwlock_rdlock(&(Pxycache->lock));
-        if ((strcmp(uri, tmp->uri) == 0)) {
-            pthread_rwlock_unlock(&(Pxycache->lock));
+    /* Report the hit and pin tmp. It may have been evicted or replaced
+     * while no lock was held, so look it up again */ 
+    pthread_rwlock_wrlock(&(shard->lock));
+    if ((tmp = lookup(shard, uri, hash)) != NULL && OBJ_SWR(tmp, now)) {
+        policy->hit(shard, tmp);
+        __atomic_add_fetch(&tmp->refcnt, 1, __ATOMIC_RELAXED);
+    }
+    else
+        tmp = NULL;
+    pthread_rwlock_unlock(&(shard->lock));
+    if (tmp != NULL && tmp->expires <= now)
+        refresh_schedule(tmp);
+    return tmp;
+}
 
-            /* LRU: put tmp at the head */ 
-            pthread_rwlock_wrlock(&(Pxycache->lock));
-            if (tmp != NULL) {
-                if (tmp->prev != NULL) {
-                    if (tmp->next == NULL) {
-                        Pxycache->rear = tmp->prev;
-                        tmp->prev->next = NULL;
-                        tmp->next = Pxycache->head;
-                        tmp->prev = NULL;
-                        Pxycache->head->prev = tmp;
-                        Pxycache->head = tmp;
-                    }
-                    else {
-                        tmp->prev->next = tmp->next;
-                        tmp->next->prev = tmp->prev;
-                        tmp->next = Pxycache->head;
-                        tmp->prev = NULL;
-                        Pxycache->head->prev = tmp;
-                        Pxycache->head = tmp;
-                    }
-                }
-            }
-            pthread_rwlock_unlock(&(Pxycache->lock));
+/*
+ * get_obj_from_disk - move the object of uri from the snapshot or the disk
+ * tier back to the memory cache
+ * Return the object pinned, NULL if neither has it or it is too big for
+ * the memory cache
+ */
+static cacheobj *get_obj_from_disk(pxycache *Pxycache, char *uri,
+        unsigned long long hash)
+{
+    cacheobj *obj;
 
-            /* The return pointer is a reader pointer, it can only
-             * be released after reading is done */ 
-            pthread_rwlock_rdlock(&(Pxycache->lock));
-            return tmp;
-        }
-        else 
-            pthread_rwlock_unlock(&(Pxycache->lock));
+    if ((obj = snap_take(uri, hash)) == NULL &&
+            (obj = disk_promote(uri, hash)) == NULL)
+        return NULL;
+    if (obj->content_size > MAX_OBJECT_SIZE) {
+        destroy_obj(obj);
+        return NULL;
+    }
+    dbg_printf("Restored from disk\n");
+    obj->refcnt++;   /* the reference of the caller */
+    insert_object(Pxycache, obj);
+    return obj;
+}
+
+/*
+ * hash_uri - 64-bit FNV-1a hash of the uri
+ */
+unsigned long long hash_uri(char *uri)
+{
+    unsigned long long hash = 14695981039346656037ULL;
 
-        tmp = tmp->next;
+    while (*uri != '\0') {
+        hash ^= (unsigned char)*uri++;
+        hash *= 1099511628211ULL;
     }
+    return hash;
+}
 
-    return NULL;
+/*
+ * init_cache - init the proxy cache with the eviction policy called policy
+ * Return -1 if there is no such policy, 0 otherwise
+ */
+int init_cache(pxycache *Pxycache, char *policy)
+{
+    int i;
+    cacheshard *shard;
+
+    if ((Pxycache->policy = find_policy(policy)) == NULL)
+        return -1;
+
+    slab_init();
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        shard = &Pxycache->shards[i];
+        shard->cur_size = 0;
+        memset(shard->lists, 0, sizeof(shard->lists));
+        memset(shard->ghost, 0, sizeof(shard->ghost));
+        shard->ghostpos = 0;
+        shard->sketch = NULL;
+        shard->sketch_adds = 0;
+        shard->inflation = 0;
+        shard->heap = NULL;
+        shard->heaplen = shard->heapcap = 0;
+        if (Pxycache->policy->init != NULL)
+            Pxycache->policy->init(shard);
+        shard->nbuckets = CACHE_BUCKETS;
+        shard->buckets = Calloc(CACHE_BUCKETS, sizeof(cacheobj *));
+        shard->nobjs = 0;
+        memset(shard->inflight, 0, sizeof(shard->inflight));
+        pthread_rwlock_init(&(shard->lock), NULL);
+    }
+    return 0;
 }
 
 /*
- * init_cache - init the proxy cache
+ * cache_size - the total size of the cached contents
+ * Notice: the shards are summed without locking, the result is a snapshot
  */
-void init_cache(pxycache *Pxycache)
+size_t cache_size(pxycache *Pxycache)
 {
-    Pxycache->cur_size = 0;
-    Pxycache->head = NULL;
-    Pxycache->rear = NULL;
+    size_t size = 0;
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
+        size += Pxycache->shards[i].cur_size;
+    return size;
 }
 
 /*
- * init_obj - init a cache object
+ * new_obj - create a cache object for uri. The object, a copy of uri and
+ * a copy of the hdrlen bytes of reshdrs are allocated as one block, the
+ * object takes over the content chunks
  */
-void init_obj(cacheobj * obj, char *uri, char *content, size_t content_size, char *reshdrs) 
+cacheobj *new_obj(char *uri, char *reshdrs, size_t hdrlen,
+        objchunk *content, size_t content_size)
 {
-    obj->content_size = content_size;
+    size_t urilen = strlen(uri);
+    size_t memsize = sizeof(cacheobj) + urilen + 1 + hdrlen + 1;
+    cacheobj *obj = slab_alloc(memsize);
+
     dbg_printf("the content length is %d\n", (int)content_size);
-    /*dbg_printf("the uri is %s\n", uri);*/
-    if (content_size <= MAX_OBJECT_SIZE) {
-        obj->uri = uri;
-        obj->content = Malloc(content_size);
-        memcpy(obj->content, content, content_size);
-        obj->reshdrs = reshdrs;
-    }
-    else { /* If the content_size if larger than max size, make the obj a phony obj 
-    with only content_size */ 
-        obj->uri = NULL;
-        obj->content = NULL;
-        obj->reshdrs = NULL;
-    }
+    obj->memsize = memsize;
+    obj->uri = (char *)(obj + 1);
+    memcpy(obj->uri, uri, urilen + 1);
+    obj->reshdrs = obj->uri + urilen + 1;
+    memcpy(obj->reshdrs, reshdrs, hdrlen);
+    obj->reshdrs[hdrlen] = '\0';
+    /* Every hit is sent with its own connection headers, and Age */
+    header_strip(obj->reshdrs, HDR_CONNECTION);
+    header_strip(obj->reshdrs, HDR_PROXY_CONNECTION);
+    header_strip(obj->reshdrs, HDR_KEEP_ALIVE);
+    if (cache_age)
+        header_strip(obj->reshdrs, HDR_AGE);
+    obj->hdrlen = strlen(obj->reshdrs);
+    obj->hash = hash_uri(uri);
+    obj->content = content;
+    obj->content_size = content_size;
+    obj->refcnt = 1;   /* the reference of the cache */
+    obj->list = 0;
+    obj->freq = 0;
+    obj->cost = 0;
+    obj->expires = 0;
+    obj->born = time(NULL);
+    obj->swr = 0;
+    obj->sie = 0;
+    obj->refreshing = 0;
+    obj->prio = 0;
     obj->prev = NULL;
     obj->next = NULL;
+    obj->hnext = NULL;
+    return obj;
+}
+
+/*
+ * chunk_new - allocate an empty chunk, size bytes with its header
+ */
+objchunk *chunk_new(size_t size)
+{
+    objchunk *chunk = slab_alloc(size);
+
+    chunk->next = NULL;
+    chunk->len = 0;
+    chunk->cap = size - sizeof(objchunk);
+    return chunk;
+}
+
+/*
+ * chunks_copy - copy the size bytes at data into new chunks, each as big
+ * as what is left needs, up to CHUNK_MAX
+ * Return the first chunk, NULL if size is 0
+ */
+objchunk *chunks_copy(char *data, size_t size)
+{
+    objchunk *head = NULL, *tail = NULL, *chunk;
+    size_t csize, n;
+
+    for (; size > 0; size -= n, data += n) {
+        csize = CHUNK_MIN;
+        while (csize < sizeof(objchunk) + size && csize < CHUNK_MAX)
+            csize *= 2;
+        chunk = chunk_new(csize);
+        n = (size < chunk->cap) ? size : chunk->cap;
+        memcpy(chunk->data, data, n);
+        chunk->len = n;
+        if (tail == NULL)
+            head = chunk;
+        else
+            tail->next = chunk;
+        tail = chunk;
+    }
+    return head;
+}
+
+/*
+ * chunks_free - free the list of chunks starting at chunk
+ */
+void chunks_free(objchunk *chunk)
+{
+    objchunk *next;
+
+    while (chunk != NULL) {
+        next = chunk->next;
+        slab_free(chunk, sizeof(objchunk) + chunk->cap);
+        chunk = next;
+    }
 }
 
 /*
  * check_cache - check the cache, print out error information on error
  * 1. Every object's size smaller than Maximum
- * 2. Total size smaller than Maximum
- * 3. The double link list is ok
+ * 2. Total size of every shard smaller than its share
+ * 3. The double link lists are ok
  * 4. The content_size matches the content
  * 5. The rear is at the end
+ * 6. Every object can be found through the hash index of its shard
+ * 7. The lists add up to the size of the shard
  */
 void check_cache(pxycache *Pxycache)
 {
-    pthread_rwlock_rdlock(&(Pxycache->lock));
-    if (Pxycache->cur_size > MAX_CACHE_SIZE)
-        printf("Error: current size in cache exceeds maximum\n");
-    
-    printf("The current size of the cache is %d\n", (int)Pxycache->cur_size);
+    int i, l;
+    cacheshard *shard;
+    cacheobj *tmp;
+    objchunk *chunk;
+    size_t size, total;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        shard = &Pxycache->shards[i];
+        pthread_rwlock_rdlock(&(shard->lock));
+        if (shard->cur_size > SHARD_SIZE)
+            printf("Error: current size in shard %d exceeds maximum\n", i);
+
+        total = 0;
+        for (l = 0; l < CACHE_LISTS; l++) {
+            total += shard->lists[l].size;
+            tmp = shard->lists[l].head;
+            while(tmp != NULL) {
+                if ((tmp->content == NULL && tmp->content_size > 0) ||
+                        (tmp->reshdrs == NULL) || (tmp->uri == NULL))
+                    printf("Error: important info missing\n");
+
+                if (tmp->content_size > MAX_OBJECT_SIZE)
+                    printf("Error: the size of the content exceeds maximum\n");
+
+                size = 0;
+                for (chunk = tmp->content; chunk != NULL; chunk = chunk->next)
+                    size += chunk->len;
+                if (size != tmp->content_size)
+                    printf("Error: the content_size doesn't match the chunks\n");
 
-    cacheobj *tmp = Pxycache->head;
+                if (tmp->prev != NULL) {
+                    if (tmp->prev->next != tmp)
+                        printf("Link list error: prev->next doesn't match current\n");
+                }
 
-    while(tmp != NULL) {
-        if ((tmp->content == NULL) || (tmp->reshdrs == NULL) || (tmp->uri == NULL))
-            printf("Error: important info missing\n");
+                if (tmp->next != NULL) {
+                    if (tmp->next->prev != tmp)
+                        printf("Link list error: next->prev doesn't match current\n");
+                }
 
-        if (tmp->content_size > MAX_OBJECT_SIZE)
-            printf("Error: the size of the content exceeds maximum\n");
+                if (tmp->next == NULL)
+                    if (shard->lists[l].rear != tmp)
+                        printf("Link list error: rear doesn't macth\n");
 
-        if (tmp->prev != NULL) {
-            if (tmp->prev->next != tmp)
-                printf("Link list error: prev->next doesn't match current\n");
-        }
+                if (tmp->list != l)
+                    printf("Link list error: the object is on another list\n");
 
-        if (tmp->next != NULL) {
-            if (tmp->next->prev != tmp)
-                printf("Link list error: next->prev doesn't match current\n");
+                if (SHARD(Pxycache, tmp->hash) != shard ||
+                        lookup(shard, tmp->uri, tmp->hash) != tmp)
+                    printf("Index error: object missing from the hash index\n");
+
+                tmp = tmp->next;
+            }
+        }
+        if (total != shard->cur_size)
+            printf("Error: the lists of shard %d don't add up\n", i);
+
+        for (size = 0; size < shard->heaplen; size++) {
+            tmp = shard->heap[size];
+            if (tmp->heapidx != size)
+                printf("Heap error: the object is somewhere else\n");
+            if (size > 0 && tmp->prio < shard->heap[(size - 1) / 2]->prio)
+                printf("Heap error: the parent has a higher priority\n");
         }
+        pthread_rwlock_unlock(&(shard->lock));
+    }
 
-        if (tmp->next == NULL)
-            if (Pxycache->rear != tmp)
-                printf("Link list error: rear doesn't macth\n");
+    printf("The current size of the cache is %d\n", (int)cache_size(Pxycache));
+}
 
-        tmp = tmp->next;
+/*
+ * obj_refresh - a revalidation found obj still good until expires, the
+ * readers checking its freshness without a lock see either time. Its age
+ * starts again from 0
+ */
+void obj_refresh(cacheobj *obj, time_t expires)
+{
+    __atomic_store_n(&obj->born, time(NULL), __ATOMIC_RELAXED);
+    __atomic_store_n(&obj->expires, expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * obj_iov - point iov, OBJ_IOV entries, at the response of obj: the
+ * headers, with the Age header if hits carry one and the header line
+ * line unless it is NULL written into extra, OBJ_EXTRALEN bytes, then
+ * the content. *rest is set to the first chunk which did not fit, NULL if
+ * all did
+ * Return the number of entries used
+ */
+int obj_iov(cacheobj *obj, char *extra, const char *line, struct iovec *iov,
+        objchunk **rest)
+{
+    time_t now = time(NULL), born = obj->born;
+    int n = 1, len = 0;
+
+    iov[0].iov_base = obj->reshdrs;
+    iov[0].iov_len = obj->hdrlen;
+    if ((cache_age || line != NULL) && obj->hdrlen >= 4) {
+        /* Before the blank line ending the headers */
+        iov[0].iov_len -= 2;
+        if (cache_age)
+            len = snprintf(extra, OBJ_EXTRALEN, "Age: %ld\r\n",
+                    (long)(now > born ? now - born : 0));
+        len += snprintf(extra + len, OBJ_EXTRALEN - len, "%s\r\n",
+                (line != NULL) ? line : "");
+        iov[1].iov_base = extra;
+        iov[1].iov_len = len;
+        n = 2;
+    }
+    return n + chunks_iov(obj->content, iov + n, OBJ_IOV - n, rest);
+}
+
+/*
+ * chunks_iov - point up to max entries of iov at chunk and the ones after
+ * it, *rest is set to the first chunk which did not fit
+ * Return the number of entries used
+ */
+int chunks_iov(objchunk *chunk, struct iovec *iov, int max, objchunk **rest)
+{
+    int n = 0;
+
+    for (; chunk != NULL && n < max; chunk = chunk->next) {
+        iov[n].iov_base = chunk->data;
+        iov[n].iov_len = chunk->len;
+        n++;
     }
+    *rest = chunk;
+    return n;
+}
 
-    pthread_rwlock_unlock(&(Pxycache->lock));
+/*
+ * cache_set_age - whether hits carry an Age header
+ * Notice: must be called before any object is created
+ */
+void cache_set_age(int on)
+{
+    cache_age = on;
 }
 
 /*
- * obj_read_done - release the reader lock
+ * obj_read_done - drop the reference taken by get_obj_from_cache()
  */
-void obj_read_done(pxycache *Pxycache)
+void obj_read_done(cacheobj *obj)
 {
-    pthread_rwlock_unlock(&(Pxycache->lock));
+    put_obj(obj);
+}
+
+/*
+ * put_obj - drop a reference to obj, destroy it with the last one
+ */
+static void put_obj(cacheobj *obj)
+{
+    if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+        destroy_obj(obj);
 }
 
 /*
@@ -256,13 +556,91 @@ void obj_read_done(pxycache *Pxycache)
  */
 static void destroy_obj(cacheobj *obj) 
 {
-    if (obj->uri != NULL)
-        Free(obj->uri);
-    if (obj->content != NULL)
-        Free(obj->content);
-    if (obj->reshdrs != NULL)
-        Free(obj->reshdrs);
-    Free(obj);
+    chunks_free(obj->content);
+    slab_free(obj, obj->memsize);
+}
+
+/*
+ * unlink_obj - take obj off its eviction list, what else its policy keeps
+ * and the hash index of shard
+ */
+static void unlink_obj(pxycache *Pxycache, cacheshard *shard,
+        cacheobj *obj)
+{
+    list_remove(shard, obj);
+    if (Pxycache->policy->remove != NULL)
+        Pxycache->policy->remove(shard, obj);
+    shard->cur_size -= obj->content_size;
+    index_remove(shard, obj);
+}
+
+/*
+ * lookup - find the object of uri in the hash index of shard
+ * Return the object, NULL if it is not cached
+ * Notice: the caller holds the lock of the shard
+ */
+static cacheobj *lookup(cacheshard *shard, char *uri, unsigned long long hash)
+{
+    cacheobj *tmp = shard->buckets[hash & (shard->nbuckets - 1)];
+
+    while (tmp != NULL) {
+        if (tmp->hash == hash && strcmp(uri, tmp->uri) == 0)
+            return tmp;
+        tmp = tmp->hnext;
+    }
+    return NULL;
+}
+
+/*
+ * index_add - add obj to the hash index, growing it when it gets full
+ */
+static void index_add(cacheshard *shard, cacheobj *obj)
+{
+    size_t b;
+
+    if (shard->nobjs >= shard->nbuckets)
+        index_grow(shard);
+    b = obj->hash & (shard->nbuckets - 1);
+    obj->hnext = shard->buckets[b];
+    shard->buckets[b] = obj;
+    shard->nobjs++;
 }
 
+/*
+ * index_remove - remove obj from the hash index
+ */
+static void index_remove(cacheshard *shard, cacheobj *obj)
+{
+    cacheobj **pp = &shard->buckets[obj->hash & (shard->nbuckets - 1)];
+
+    while (*pp != NULL) {
+        if (*pp == obj) {
+            *pp = obj->hnext;
+            shard->nobjs--;
+            return;
+        }
+        pp = &(*pp)->hnext;
+    }
+}
 
+/*
+ * index_grow - double the number of buckets, the stored hashes avoid
+ * hashing the uris again
+ */
+static void index_grow(cacheshard *shard)
+{
+    size_t i, n = shard->nbuckets * 2;
+    cacheobj **buckets = Calloc(n, sizeof(cacheobj *));
+    cacheobj *tmp, *next;
+
+    for (i = 0; i < shard->nbuckets; i++) {
+        for (tmp = shard->buckets[i]; tmp != NULL; tmp = next) {
+            next = tmp->hnext;
+            tmp->hnext = buckets[tmp->hash & (n - 1)];
+            buckets[tmp->hash & (n - 1)] = tmp;
+        }
+    }
+    Free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = n;
+}
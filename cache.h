@@ -4,42 +4,148 @@
  * cache.h include the structure and basic functions of a cache specialy designed
  * for the web proxy. 
  * The common operations involve searching the cache, insert or delete a cached object
- * These operations are thread-safe using pthread reader-writer lock
+ * The cache is split into shards selected by the hash of the uri. Each shard has
+ * its own eviction lists, hash index, share of MAX_CACHE_SIZE and pthread
+ * reader-writer lock, so threads working on different shards do not contend.
+ * Which object to evict is decided by the eviction policy chosen at startup
+ * (evict.h).
+ * A stale object is a miss, it stays until it is revalidated, replaced or
+ * evicted. One allowed to be served stale while it is revalidated is a hit
+ * and gets refreshed in the background.
+ * Objects are reference counted: the cache holds one reference while the object
+ * is linked, and every reader pins the object with another one, so a reader
+ * never holds a lock while it sends the object and an evicted object is only
+ * freed when its last reader is done.
+ * The content of an object is a list of chunks, the buffers it was received
+ * into, so storing a response does not copy it. The object itself, its uri
+ * and its headers share one block. All of them come from the slab
+ * allocator (slab.h).
+ * A hit is sent with one writev()/sendmsg(): the headers, then the chunks.
+ * When asked for, an Age header is added as an iovec of its own so the
+ * stored headers are never rebuilt; the Age header of the server is then
+ * not stored.
  */
 
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
 #include "csapp.h"
+#include <sys/uio.h>
 
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define CACHE_BUCKETS 64      /* initial size of the hash index of a shard */
+#define FILL_BUCKETS 16       /* buckets for the responses being fetched */
+#define CACHE_SHARD_BITS 3
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+#define SHARD_SIZE (MAX_CACHE_SIZE / CACHE_SHARDS)
+
+#define CACHE_LISTS 2         /* eviction lists of a shard */
+#define GHOST_SIZE 64         /* recently evicted uris remembered by a shard */
+#define CHUNK_MIN 4096        /* the first chunk of a content, with its header */
+#define CHUNK_MAX 32768       /* chunks double up to this size, a slab class */
+#define OBJ_IOV 16            /* iovecs a hit is sent with at once */
+#define OBJ_EXTRALEN 64       /* room for the headers added to a hit */
+
+#if SHARD_SIZE < MAX_OBJECT_SIZE
+#error "every cache shard must be able to hold the biggest object"
+#endif
+
+typedef struct obj_chunk
+{
+    struct obj_chunk *next;
+    size_t len;       /* bytes used */
+    size_t cap;
+    char data[];
+}objchunk;
 
 typedef struct cache_object
 {
     char *uri;
+    unsigned long long hash;  /* hash of the uri */
     size_t content_size;
-    char *content;
+    objchunk *content;
     char *reshdrs;    /* response headers */ 
+    size_t hdrlen;    /* their length */
+    size_t memsize;   /* the block of the object, uri and headers */
+    int refcnt;       /* the cache and the readers using the object */
+    int list;         /* the eviction list of the shard holding it */
+    unsigned char freq;   /* hits seen by the eviction policy */
+    unsigned long cost;   /* microseconds it took to fetch */
+    time_t expires;       /* when it goes stale (fresh.h) */
+    time_t born;          /* when its age was 0, for the Age header */
+    unsigned int swr;     /* seconds it is served stale while refreshed */
+    unsigned int sie;     /* seconds it is served stale if the server fails */
+    int refreshing;       /* queued for a background refresh */
+    double prio;          /* priority of the object for gdsf */
+    size_t heapidx;       /* and its place in the heap of the shard */
     struct cache_object *prev;
     struct cache_object *next;
+    struct cache_object *hnext;   /* next object in the same bucket */
 }cacheobj;
 
-typedef struct cache
+typedef struct obj_list
 {
-    size_t cur_size;
     cacheobj *head;
     cacheobj *rear;
+    size_t size;      /* bytes of content in the list */
+}objlist;
+
+typedef struct cache_shard
+{
+    size_t cur_size;
+    objlist lists[CACHE_LISTS];   /* eviction lists, their use is up to the policy */
+    unsigned long long ghost[GHOST_SIZE];   /* hashes of evicted uris */
+    int ghostpos;
+    unsigned char *sketch;        /* access frequencies of the uris */
+    unsigned long sketch_adds;
+    double inflation;             /* priority of the last gdsf victim */
+    cacheobj **heap;              /* gdsf objects, a min-heap of priorities */
+    size_t heaplen;
+    size_t heapcap;
+    cacheobj **buckets;   /* hash index of the objects by uri */
+    size_t nbuckets;      /* always a power of two */
+    size_t nobjs;
+    struct cache_fill *inflight[FILL_BUCKETS];  /* responses being fetched */
     pthread_rwlock_t lock;
+}__attribute__((aligned(64))) cacheshard;   /* one shard per cache line */
+
+typedef struct cache
+{
+    cacheshard shards[CACHE_SHARDS];
+    struct cache_policy *policy;
 }pxycache;
 
-void init_cache(pxycache *Pxycache);
+/* The shard holding the objects whose uri hashes to hash. The bucket of
+ * the hash index uses the low bits, the shard the high ones */
+#define SHARD(cache, hash) \
+    (&(cache)->shards[(hash) >> (64 - CACHE_SHARD_BITS)])
+
+/* Whether obj may be served at now while it is refreshed, which includes
+ * being fresh, and whether it may be served because the server failed */
+#define OBJ_SWR(obj, now) ((now) < (obj)->expires + (time_t)(obj)->swr)
+#define OBJ_SIE(obj, now) ((now) < (obj)->expires + (time_t)(obj)->sie)
+/* Whether obj may still be served at all, so it is worth keeping */
+#define OBJ_KEPT(obj, now) (OBJ_SWR(obj, now) || OBJ_SIE(obj, now))
+
+int init_cache(pxycache *Pxycache, char *policy);
 int insert_object(pxycache *Pxycache, cacheobj *obj);
 void delete_object(pxycache *Pxycache, cacheobj *obj);
 int iscached(pxycache *Pxycache, char* uri); 
-cacheobj *get_obj_from_cache(pxycache *Pxycache, char *uri);
-void init_obj(cacheobj * obj, char *uri, char *content, size_t content_size, char *reshdrs);
+cacheobj *get_obj_from_cache(pxycache *Pxycache, char *uri, cacheobj **stale);
+cacheobj *new_obj(char *uri, char *reshdrs, size_t hdrlen,
+        objchunk *content, size_t content_size);
 void check_cache(pxycache *Pxycache);
-void obj_read_done(pxycache *Pxycache);
+void obj_refresh(cacheobj *obj, time_t expires);
+int obj_iov(cacheobj *obj, char *extra, const char *line, struct iovec *iov,
+        objchunk **rest);
+int chunks_iov(objchunk *chunk, struct iovec *iov, int max, objchunk **rest);
+void cache_set_age(int on);
+void obj_read_done(cacheobj *obj);
+size_t cache_size(pxycache *Pxycache);
+unsigned long long hash_uri(char *uri);
+objchunk *chunk_new(size_t size);
+objchunk *chunks_copy(char *data, size_t size);
+void chunks_free(objchunk *chunk);
 
 #endif
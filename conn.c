@@ -0,0 +1,827 @@
+/*
+ * Author: shiweid
+ *
+ * conn.c include the per-connection state machine used by the event driven
+ * proxy engine. See conn.h for the overview.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include "conn.h"
+#include "fresh.h"
+#include "header.h"
+#include "pool.h"
+
+/* Static helper functions */
+static void conn_recv(conn *c, int state, int fd, char *buf, size_t len);
+static void conn_send(conn *c, int state, int fd, char *out, size_t outlen);
+static void conn_error(conn *c, char *cause, char *errnum,
+        char *shortmsg, char *longmsg);
+static void conn_done(conn *c);
+static void conn_finish(conn *c);
+static void conn_release(conn *c);
+static void conn_dispatch(conn *c);
+static void conn_fetch(conn *c);
+static void conn_connect(conn *c, int pooled);
+static void conn_resolved(resolvereq *r);
+static void conn_socket(conn *c);
+static void conn_reconnect(conn *c);
+static void conn_unreachable(conn *c);
+static void conn_serve(conn *c);
+static void conn_sendmsg(conn *c, int n);
+static size_t conn_iov_advance(conn *c, size_t res);
+static void conn_serve_disk(conn *c);
+static void conn_reshdrs(conn *c);
+static void conn_relay(conn *c, size_t hdrlen, size_t n);
+static void conn_relayed(conn *c);
+static void conn_serve_stale(conn *c);
+static int conn_disk_stale(conn *c);
+static void conn_follow(conn *c);
+static void conn_wake(fillwaiter *w);
+static void conn_push(conn *c);
+
+/*
+ * conn_new - create the connection for a newly accepted client and set up
+ * the first operation: reading the request. sockflags are or-ed into the
+ * type of the server socket, the epoll engine wants SOCK_NONBLOCK. A
+ * follower woken up is pushed on wakeq
+ */
+conn *conn_new(int clientfd, int sockflags, connqueue *wakeq)
+{
+    conn *c = Malloc(sizeof(conn));
+
+    c->clientfd = clientfd;
+    c->serverfd = -1;
+    c->srvwatch = 0;
+    c->sockflags = sockflags;
+    c->srvhost = NULL;
+    c->reused = 0;
+    frame_init(&c->frame, NULL);
+    c->keepalive = 0;
+    c->corked = 0;
+    c->served = 0;
+    c->idle = 0;
+    c->uri = NULL;
+    c->obj = NULL;
+    c->stale = NULL;
+    c->notmod = 0;
+    c->chunk = NULL;
+    c->fill = NULL;
+    c->leader = 0;
+    c->filloff = 0;
+    c->waiter.wake = conn_wake;
+    c->rreq.done = conn_resolved;
+    c->rreq.addr = &c->addr;
+    c->waiter.next = NULL;
+    c->dpinned = 0;
+    c->wakeq = wakeq;
+    c->next = NULL;
+    c->wnext = NULL;
+    c->iprev = NULL;
+    c->inext = NULL;
+    client_nodelay(clientfd);
+    rio_readinitb(&c->rio, clientfd);
+    conn_recv(c, CS_READ_REQ, clientfd, c->rio.rio_buf, RIO_BUFSIZE);
+    return c;
+}
+
+/*
+ * conn_free - close the descriptors of the connection and free it. The
+ * connection to the server goes back to the pool if it can carry another
+ * response
+ */
+void conn_free(conn *c)
+{
+    if (c->clientfd >= 0)
+        Close(c->clientfd);
+    conn_release(c);
+    if (c->uri != NULL)
+        Free(c->uri);
+    if (c->obj != NULL)
+        obj_read_done(c->obj);
+    if (c->stale != NULL)
+        obj_read_done(c->stale);
+    if (c->dpinned)
+        disk_read_done(&c->dref);
+    if (c->fill != NULL && c->leader)   /* gave up before the end */
+        fill_end(Pxycache, c->fill, 0);
+    else if (c->fill != NULL)
+        fill_leave(c->fill);
+    Free(c);
+}
+
+/*
+ * conn_advance - feed the result of the outstanding operation into the
+ * state machine and set up the next operation.
+ * res is what recv()/send() returned, or 0/-1 for a connect
+ */
+void conn_advance(conn *c, ssize_t res)
+{
+    switch (c->state) {
+    case CS_READ_REQ:
+        if (res <= 0) {
+            conn_done(c);
+            return;
+        }
+        c->rio.rio_cnt += res;
+        if (memmem(c->rio.rio_bufptr, c->rio.rio_cnt, "\r\n\r\n", 4) != NULL)
+            conn_dispatch(c);
+        else if (c->rio.rio_cnt == RIO_BUFSIZE)
+            conn_error(c, "", "400", "Bad Request",
+                    "The request header is too large");
+        else
+            conn_recv(c, CS_READ_REQ, c->clientfd,
+                    c->rio.rio_buf + c->rio.rio_cnt,
+                    RIO_BUFSIZE - c->rio.rio_cnt);
+        break;
+
+    case CS_RESOLVE:
+        conn_socket(c);
+        break;
+
+    case CS_CONNECT:
+        /* A connection of the pool is connected already */
+        if (res < 0 && c->reused && errno != EISCONN)
+            conn_reconnect(c);
+        else if (res < 0 && !c->reused)
+            conn_unreachable(c);
+        else
+            conn_send(c, CS_SEND_REQ, c->serverfd, c->buf, strlen(c->buf));
+        break;
+
+    case CS_SEND_REQ:
+    case CS_RELAY_SEND:
+    case CS_SERVE:
+    case CS_DISK_HDRS:
+    case CS_DISK_BODY:
+        if (res <= 0) {
+            conn_done(c);
+            return;
+        }
+        c->outoff += res;
+        if (c->outoff < c->outlen) {
+            c->opbuf = c->out + c->outoff;
+            c->oplen = c->outlen - c->outoff;
+        }
+        else if (c->state == CS_DISK_HDRS)
+            conn_serve_disk(c);
+        else if (c->state == CS_SERVE || c->state == CS_DISK_BODY)
+            conn_finish(c);
+        else if (c->state == CS_RELAY_SEND && c->frame.done)
+            conn_relayed(c);
+        else if (c->state == CS_SEND_REQ) {
+            c->inlen = 0;
+            conn_recv(c, CS_READ_HDRS, c->serverfd, c->buf,
+                    MAXBUF - 1 - CLIENT_HDRLEN);
+        }
+        else
+            conn_recv(c, CS_RELAY_READ, c->serverfd, c->buf, MAXBUF);
+        break;
+
+    case CS_SERVE_OBJ:
+        if (res <= 0) {
+            conn_done(c);
+            return;
+        }
+        if (conn_iov_advance(c, res) > 0)
+            break;
+        if (c->chunk != NULL)
+            conn_sendmsg(c, chunks_iov(c->chunk, c->iov, OBJ_IOV, &c->chunk));
+        else
+            conn_finish(c);
+        break;
+
+    case CS_RELAY_READ:
+        if (res < 0) {
+            conn_done(c);
+            return;
+        }
+        if (res == 0)   /* the server closed the connection */
+            conn_relayed(c);
+        else
+            conn_relay(c, 0, res);
+        break;
+
+    case CS_READ_HDRS:
+        if (res <= 0 && c->inlen == 0 && c->reused) {
+            /* Nothing was read over the request in buf */
+            conn_reconnect(c);
+            break;
+        }
+        if (res < 0 && c->stale == NULL && conn_disk_stale(c) == 0)
+            return;
+        if (res < 0 && (c->stale == NULL || !OBJ_SIE(c->stale, time(NULL)))) {
+            conn_done(c);
+            return;
+        }
+        if (res > 0)
+            c->inlen += res;
+        /* Room is left for the Connection header of the client */
+        if (res > 0 && c->inlen < MAXBUF - 1 - CLIENT_HDRLEN &&
+                memmem(c->buf, c->inlen, "\r\n\r\n", 4) == NULL)
+            conn_recv(c, CS_READ_HDRS, c->serverfd, c->buf + c->inlen,
+                    MAXBUF - 1 - CLIENT_HDRLEN - c->inlen);
+        else
+            conn_reshdrs(c);
+        break;
+
+    case CS_FOLLOW_SEND:
+        if (res <= 0) {
+            conn_done(c);
+            return;
+        }
+        c->outoff += res;
+        c->filloff += res;
+        if (c->outoff < c->outlen) {
+            c->opbuf = c->out + c->outoff;
+            c->oplen = c->outlen - c->outoff;
+        }
+        else
+            conn_follow(c);
+        break;
+
+    case CS_FOLLOW:
+        conn_follow(c);
+        break;
+
+    default:
+        conn_done(c);
+    }
+}
+
+/*
+ * conn_dispatch - the request header is complete: parse it, then serve the
+ * object from the cache or start connecting to the server
+ */
+static void conn_dispatch(conn *c)
+{
+    char method[MAXLINE], uri[MAXLINE], host[MAXLINE], *hdrs;
+    int port;
+    size_t len;
+    cacheobj *obj;
+
+    switch (parse_request(&c->rio, method, uri, c->buf, host, &port,
+                &c->keepalive)) {
+    case -1:
+        conn_done(c);
+        return;
+    case -2:
+        conn_error(c, method, "501", "Not Implemented",
+                "Proxy does not support method other than GET");
+        return;
+    case -3:
+        conn_error(c, "", "400", "Bad Request",
+                "The request header is too large");
+        return;
+    }
+    dbg_printf("The request to the server is \r\n%s", c->buf);
+
+    c->uri = Malloc(strlen(uri)+1);
+    strcpy(c->uri, uri);
+
+    /* The object stays pinned until the connection is freed. A client
+     * whose copy is still good gets a 304 */
+    if ((obj = get_obj_from_cache(Pxycache, uri, &c->stale)) != NULL) {
+        dbg_printf("--------Cache hit--------\n");
+        c->obj = obj;
+        if (fresh_notmodified(c->buf, obj->reshdrs))
+            conn_send(c, CS_SERVE, c->clientfd, c->buf,
+                    client_304(obj->reshdrs, c->buf, &c->keepalive));
+        else
+            conn_serve(c);
+        return;
+    }
+
+    /* A big object of the disk tier, its segment stays pinned as well */
+    if (disk_lookup(uri, hash_uri(uri), &c->dref, 0) == 0) {
+        dbg_printf("--------Disk hit--------\n");
+        c->dpinned = 1;
+        hdrs = client_diskhdrs(&c->dref, c->buf, &len, &c->keepalive);
+        conn_send(c, CS_DISK_HDRS, c->clientfd, hdrs, len);
+        return;
+    }
+
+    /* What was held back for the client goes before waiting for the
+     * server */
+    dbg_printf("++++++++Cache miss+++++++\n");
+    client_cork(c->clientfd, &c->corked, 0);
+    c->srvhost = Malloc(strlen(host)+1);
+    strcpy(c->srvhost, host);
+    c->srvport = port;
+    c->fill = fill_begin(Pxycache, uri, &c->leader);
+    if (c->fill != NULL && !c->leader) {
+        dbg_printf("Following the fetch in flight\n");
+        conn_follow(c);
+        return;
+    }
+    conn_fetch(c);
+}
+
+/*
+ * conn_fetch - fetch the response to the request in buf from the server,
+ * as the leader of the fill if there is one
+ */
+static void conn_fetch(conn *c)
+{
+    /* A stale copy with validators is revalidated, one allowed to be
+     * served on errors is kept in case the server fails */
+    c->notmod = (c->stale != NULL &&
+            fresh_notmodified(c->buf, c->stale->reshdrs));
+    if (!fresh_condreq(c->buf, (c->stale != NULL) ? c->stale->reshdrs : NULL)
+            && c->stale != NULL && !OBJ_SIE(c->stale, time(NULL))) {
+        obj_read_done(c->stale);
+        c->stale = NULL;
+    }
+    conn_connect(c, 1);
+}
+
+/*
+ * conn_connect - set up connecting to the server, over an idle connection
+ * of its pool if pooled and there is one. The connect() of that one only
+ * reports that it is connected, the engine still gets to watch it.
+ * Otherwise the address of the server is resolved first
+ */
+static void conn_connect(conn *c, int pooled)
+{
+    socklen_t len = sizeof(c->addr);
+
+    c->reused = (pooled && (c->serverfd = pool_get(c->srvhost, c->srvport,
+                    c->sockflags, &c->srvborn)) >= 0);
+    if (c->reused && getpeername(c->serverfd, (SA *)&c->addr, &len) < 0) {
+        Close(c->serverfd);
+        c->reused = 0;
+    }
+    c->rreq.addrlen = len;
+    if (c->reused) {
+        c->srvwatch = 0;
+        c->state = CS_CONNECT;
+        c->op = OP_CONNECT;
+        c->opfd = c->serverfd;
+        return;
+    }
+
+    /* conn_resolved() hands it back to the engine */
+    c->rreq.host = c->srvhost;
+    c->rreq.port = c->srvport;
+    c->state = CS_RESOLVE;
+    c->op = OP_WAIT;
+    if (resolve_start(&c->rreq) == 0)
+        conn_socket(c);
+}
+
+/*
+ * conn_resolved - the done function of the resolution of the server:
+ * push the connection on the wake queue of its engine. Called by a
+ * resolver thread
+ */
+static void conn_resolved(resolvereq *r)
+{
+    conn_push((conn *)((char *)r - offsetof(conn, rreq)));
+}
+
+/*
+ * conn_socket - the address of the server is resolved: set up connecting
+ * to it over a new socket
+ */
+static void conn_socket(conn *c)
+{
+    if (c->rreq.res < 0 || (c->serverfd = socket(c->addr.ss_family,
+                    SOCK_STREAM | c->sockflags, 0)) < 0) {
+        conn_unreachable(c);
+        return;
+    }
+    c->srvborn = time(NULL);
+    c->srvwatch = 0;
+    c->state = CS_CONNECT;
+    c->op = OP_CONNECT;
+    c->opfd = c->serverfd;
+}
+
+/*
+ * conn_reconnect - the server closed the idle connection of the pool
+ * meanwhile: send the request again over a new connection
+ */
+static void conn_reconnect(conn *c)
+{
+    Close(c->serverfd);
+    c->serverfd = -1;
+    conn_connect(c, 0);
+}
+
+/*
+ * conn_unreachable - the server can not be reached: serve the stale
+ * object if there is one, an error otherwise
+ */
+static void conn_unreachable(conn *c)
+{
+    if (c->stale != NULL)
+        conn_serve_stale(c);
+    else if (conn_disk_stale(c) < 0)
+        conn_error(c, c->srvhost, "400", "Bad Request",
+                "The host name or port number maybe invalid");
+}
+
+/*
+ * conn_release - done with the connection to the server: it goes back to
+ * the pool if it can carry another response, it is closed otherwise
+ */
+static void conn_release(conn *c)
+{
+    if (conn_server_idle(c))
+        pool_put(c->srvhost, c->srvport, c->sockflags, c->serverfd,
+                c->srvborn);
+    else if (c->serverfd >= 0)
+        Close(c->serverfd);
+    c->serverfd = -1;
+    c->srvwatch = 0;
+    if (c->srvhost != NULL) {
+        Free(c->srvhost);
+        c->srvhost = NULL;
+    }
+}
+
+/*
+ * conn_server_idle - whether the connection to the server can carry
+ * another response: the response it carried was read to its end and the
+ * server keeps it open
+ */
+int conn_server_idle(conn *c)
+{
+    return c->serverfd >= 0 && c->frame.done && c->frame.keepalive;
+}
+
+/*
+ * conn_recv - wait for len bytes at most from fd into buf
+ */
+static void conn_recv(conn *c, int state, int fd, char *buf, size_t len)
+{
+    c->state = state;
+    c->op = OP_RECV;
+    c->opfd = fd;
+    c->opbuf = buf;
+    c->oplen = len;
+}
+
+/*
+ * conn_send - send the outlen bytes of out to fd
+ */
+static void conn_send(conn *c, int state, int fd, char *out, size_t outlen)
+{
+    c->state = state;
+    c->out = out;
+    c->outlen = outlen;
+    c->outoff = 0;
+    c->op = OP_SEND;
+    c->opfd = fd;
+    c->opbuf = out;
+    c->oplen = outlen;
+}
+
+/*
+ * conn_error - send an error message to the client, then finish
+ */
+static void conn_error(conn *c, char *cause, char *errnum,
+        char *shortmsg, char *longmsg)
+{
+    int len = build_clienterror(c->buf, cause, errnum, shortmsg, longmsg);
+
+    c->keepalive = 0;
+    conn_send(c, CS_SERVE, c->clientfd, c->buf, len);
+}
+
+/*
+ * conn_done - the connection has nothing more to do
+ */
+static void conn_done(conn *c)
+{
+    c->state = CS_DONE;
+    c->op = OP_NONE;
+}
+
+/*
+ * conn_finish - the response was sent whole, the client may send another
+ * request if it keeps the connection
+ */
+static void conn_finish(conn *c)
+{
+    if (!c->keepalive) {
+        conn_done(c);
+        return;
+    }
+    c->state = CS_NEXT;
+    c->op = OP_NONE;
+}
+
+/*
+ * conn_next - forget the request which was served and serve the next one,
+ * at once if the client already sent it. The engine let go of the
+ * connection to the server, which goes back to the pool if it can
+ */
+void conn_next(conn *c)
+{
+    conn_release(c);
+    c->reused = 0;
+    frame_init(&c->frame, NULL);
+    if (c->uri != NULL) {
+        Free(c->uri);
+        c->uri = NULL;
+    }
+    if (c->obj != NULL) {
+        obj_read_done(c->obj);
+        c->obj = NULL;
+    }
+    if (c->stale != NULL) {
+        obj_read_done(c->stale);
+        c->stale = NULL;
+    }
+    if (c->dpinned) {
+        disk_read_done(&c->dref);
+        c->dpinned = 0;
+    }
+    c->notmod = 0;
+    c->chunk = NULL;
+    c->leader = 0;
+    c->served++;
+
+    /* The rest of what the client sent moves to the start of rio */
+    memmove(c->rio.rio_buf, c->rio.rio_bufptr, c->rio.rio_cnt);
+    c->rio.rio_bufptr = c->rio.rio_buf;
+    if (client_pipelined(&c->rio)) {
+        client_cork(c->clientfd, &c->corked, 1);
+        conn_dispatch(c);
+        return;
+    }
+    client_cork(c->clientfd, &c->corked, 0);
+    conn_recv(c, CS_READ_REQ, c->clientfd, c->rio.rio_buf + c->rio.rio_cnt,
+            RIO_BUFSIZE - c->rio.rio_cnt);
+}
+
+/*
+ * conn_serve - send the cached object, as many of its buffers at once as
+ * iov holds, with the Connection header of the client
+ */
+static void conn_serve(conn *c)
+{
+    c->keepalive = c->keepalive && frame_delimited(c->obj->reshdrs);
+    conn_sendmsg(c, obj_iov(c->obj, c->extra,
+                client_connection(c->keepalive), c->iov, &c->chunk));
+}
+
+/*
+ * conn_sendmsg - send the first n buffers of iov to the client
+ */
+static void conn_sendmsg(conn *c, int n)
+{
+    memset(&c->msg, 0, sizeof(c->msg));
+    c->msg.msg_iov = c->iov;
+    c->msg.msg_iovlen = n;
+    c->state = CS_SERVE_OBJ;
+    c->op = OP_SENDMSG;
+    c->opfd = c->clientfd;
+}
+
+/*
+ * conn_iov_advance - skip the res bytes of msg which were sent
+ * Return the number of buffers left
+ */
+static size_t conn_iov_advance(conn *c, size_t res)
+{
+    struct iovec *iov = c->msg.msg_iov;
+    size_t n = c->msg.msg_iovlen;
+
+    while (n > 0 && res >= iov->iov_len) {
+        res -= iov->iov_len;
+        iov++;
+        n--;
+    }
+    if (n > 0) {
+        iov->iov_base = (char *)iov->iov_base + res;
+        iov->iov_len -= res;
+    }
+    c->msg.msg_iov = iov;
+    c->msg.msg_iovlen = n;
+    return n;
+}
+
+/*
+ * conn_serve_disk - send the content of the object of the disk tier from
+ * its file
+ */
+static void conn_serve_disk(conn *c)
+{
+    if (c->dref.bodylen == 0) {
+        conn_finish(c);
+        return;
+    }
+    conn_send(c, CS_DISK_BODY, c->clientfd, disk_base() + c->dref.bodyoff,
+            c->dref.bodylen);
+    c->op = OP_SENDFILE;
+}
+
+/*
+ * conn_reshdrs - the headers of the response are in buf, with maybe the
+ * start of its content, set up its framing. When revalidating, a 304
+ * refreshes the stale object and serves it, so does a server error while
+ * the object may be served on errors, and a big one of the disk tier is
+ * served the same way. Anything else is relayed
+ */
+static void conn_reshdrs(conn *c)
+{
+    char *end;
+    size_t hdrlen;
+    int status;
+
+    c->buf[c->inlen] = '\0';
+    end = memmem(c->buf, c->inlen, "\r\n\r\n", 4);
+    hdrlen = (end != NULL) ? (size_t)(end + 4 - c->buf) : c->inlen;
+    frame_init(&c->frame, (end != NULL) ? c->buf : NULL);
+    status = header_status(c->buf);
+    if (c->stale != NULL && (status == 304 || ((status < 0 ||
+                        status >= 500) && OBJ_SIE(c->stale, time(NULL))))) {
+        frame_feed(&c->frame, c->buf + hdrlen, c->inlen - hdrlen);
+        if (status == 304) {
+            dbg_printf("Revalidated the stale object\n");
+            obj_refresh(c->stale, fresh_revalidate(c->stale->reshdrs,
+                        c->buf, time(NULL)));
+        }
+        conn_serve_stale(c);
+        return;
+    }
+
+    if (c->stale != NULL) {
+        obj_read_done(c->stale);
+        c->stale = NULL;
+    }
+    else if ((status < 0 || status >= 500) && conn_disk_stale(c) == 0)
+        return;
+    conn_relay(c, hdrlen, c->inlen);
+}
+
+/*
+ * conn_relay - forward the n bytes of the response in buf, the first
+ * hdrlen of them its headers, to the fill and the client, which gets its
+ * own connection headers. What follows the end of the response is dropped
+ */
+static void conn_relay(conn *c, size_t hdrlen, size_t n)
+{
+    n = hdrlen + frame_feed(&c->frame, c->buf + hdrlen, n - hdrlen);
+    if (n == 0) {
+        conn_relayed(c);
+        return;
+    }
+    if (c->fill != NULL)
+        fill_append(c->fill, c->buf, n);
+    if (hdrlen > 0)
+        n = client_reshdrs(c->buf, hdrlen, n, MAXBUF, &c->keepalive);
+    conn_send(c, CS_RELAY_SEND, c->clientfd, c->buf, n);
+}
+
+/*
+ * conn_relayed - the response was forwarded up to where it ended, it is
+ * stored if that is where its framing said it would. Only then may the
+ * client send another request
+ */
+static void conn_relayed(conn *c)
+{
+    if (c->fill != NULL) {
+        fill_end(Pxycache, c->fill, c->frame.done ||
+                c->frame.mode == FRAME_CLOSE);
+        c->fill = NULL;
+    }
+    if (c->frame.done)
+        conn_finish(c);
+    else
+        conn_done(c);
+}
+
+/*
+ * conn_serve_stale - serve the stale object, revalidated or kept because
+ * the server failed, to the client and the followers
+ */
+static void conn_serve_stale(conn *c)
+{
+    cacheobj *obj = c->stale;
+
+    c->stale = NULL;
+    if (c->fill != NULL) {
+        fill_reuse(Pxycache, c->fill, obj);
+        c->fill = NULL;
+    }
+    c->obj = obj;
+    if (c->notmod)
+        conn_send(c, CS_SERVE, c->clientfd, c->buf,
+                client_304(obj->reshdrs, c->buf, &c->keepalive));
+    else
+        conn_serve(c);
+}
+
+/*
+ * conn_disk_stale - the server failed: serve the big object of the disk
+ * tier if it may be served on errors
+ * Return 0 if it is served, -1 if there is none
+ */
+static int conn_disk_stale(conn *c)
+{
+    size_t len;
+    char *hdrs;
+
+    if (disk_lookup(c->uri, hash_uri(c->uri), &c->dref, 1) < 0)
+        return -1;
+    dbg_printf("Serving the stale disk object on error\n");
+    if (c->fill != NULL) {
+        fill_end(Pxycache, c->fill, 0);
+        c->fill = NULL;
+    }
+    c->dpinned = 1;
+    hdrs = client_diskhdrs(&c->dref, c->buf, &len, &c->keepalive);
+    conn_send(c, CS_DISK_HDRS, c->clientfd, hdrs, len);
+    return 0;
+}
+
+/*
+ * conn_follow - forward the next bytes of the response the leader is
+ * fetching, or wait until it has more. A follower the leader released
+ * fetches the response itself
+ */
+static void conn_follow(conn *c)
+{
+    ssize_t n = fill_read(c->fill, c->filloff, c->buf, MAXBUF, &c->waiter);
+
+    if (n == -2) {   /* conn_wake() hands it back to the engine */
+        c->state = CS_FOLLOW;
+        c->op = OP_WAIT;
+    }
+    else if (n == FILL_ALONE) {
+        fill_leave(c->fill);
+        c->fill = NULL;
+        conn_fetch(c);
+    }
+    else if (n > 0)
+        conn_send(c, CS_FOLLOW_SEND, c->clientfd, c->buf, n);
+    else if (n < 0 && c->filloff == 0)
+        conn_error(c, c->uri, "400", "Bad Request",
+                "The host name or port number maybe invalid");
+    else
+        conn_done(c);
+}
+
+/*
+ * conn_wake - the wake function of a follower: push it on the wake queue
+ * of its engine. Called by the leader, maybe from another thread
+ */
+static void conn_wake(fillwaiter *w)
+{
+    conn_push((conn *)((char *)w - offsetof(conn, waiter)));
+}
+
+/*
+ * conn_push - push the connection on the wake queue of its engine, which
+ * calls conn_advance() again
+ */
+static void conn_push(conn *c)
+{
+    connqueue *q = c->wakeq;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&q->lock);
+    c->wnext = q->head;
+    q->head = c;
+    pthread_mutex_unlock(&q->lock);
+    if (write(q->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        unix_error("eventfd write error");
+}
+
+/*
+ * connqueue_init - create an empty wake queue, flags are or-ed into the
+ * flags of its eventfd
+ * Return 0 on success -1 on error
+ */
+int connqueue_init(connqueue *q, int flags)
+{
+    if ((q->efd = eventfd(0, EFD_CLOEXEC | flags)) < 0) {
+        unix_error("eventfd error");
+        return -1;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    q->head = NULL;
+    return 0;
+}
+
+/*
+ * connqueue_take - take every connection of the wake queue, linked by
+ * wnext
+ */
+conn *connqueue_take(connqueue *q)
+{
+    conn *head;
+
+    pthread_mutex_lock(&q->lock);
+    head = q->head;
+    q->head = NULL;
+    pthread_mutex_unlock(&q->lock);
+    return head;
+}
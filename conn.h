@@ -0,0 +1,148 @@
+/*
+ * Author: shiweid
+ *
+ * conn.h include the per-connection state machine used by the event driven
+ * proxy engine.
+ * A connection walks through reading the request, connecting to the server,
+ * forwarding the request, relaying the response (or serving it from the
+ * cache) and has at most one outstanding I/O operation at any time. The
+ * engine performs that operation once the descriptor is ready and hands
+ * the result to conn_advance(), which sets up the next one. When op is
+ * OP_NONE the connection is finished and can be freed, unless its state
+ * is CS_NEXT: the client keeps the connection for another request, the
+ * engine then lets go of the connection to the server and calls
+ * conn_next(). A kept connection waits for that request at most
+ * client_idle seconds (proxy.h), requests the client pipelined are served
+ * one after the other and the responses of those which are hits leave
+ * together, see client_cork().
+ * A miss on a uri another connection is already fetching follows that
+ * fetch (fill.h). While no new byte is there its op is OP_WAIT: the leader
+ * pushes it on the wake queue of its engine, which then calls
+ * conn_advance() again.
+ * The response of the server is read until its headers are complete,
+ * which tell where it ends (frame.h), then relayed through buf: unlike the
+ * threaded workers, which splice() a response that will not be cached,
+ * the engines copy every byte. A stale object is revalidated by its
+ * miss: a 304 then serves the object. A connection to the server which
+ * can carry another response goes back to the pool (pool.h) when the
+ * connection is freed, and a miss starts with an idle one from the pool
+ * when there is one. Otherwise the name of the server is resolved by the
+ * resolver threads (resolve.h) while the connection is in OP_WAIT.
+ * A big object of the disk tier is sent straight from its file: the op
+ * is OP_SENDFILE and opbuf points into the mapping of the file.
+ * A cached object is sent with OP_SENDMSG, its headers and chunks in one
+ * call unless it has more than OBJ_IOV buffers.
+ */
+
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "fill.h"
+#include "disk.h"
+#include "frame.h"
+#include "resolve.h"
+
+/* I/O operations a connection can wait for */
+#define OP_NONE    0
+#define OP_RECV    1
+#define OP_SEND    2
+#define OP_CONNECT 3
+#define OP_WAIT    4   /* woken up through the wake queue of the engine */
+#define OP_SENDFILE 5  /* send from the file of the disk tier */
+#define OP_SENDMSG 6   /* send the buffers of msg */
+
+/* Connection states */
+#define CS_READ_REQ   0   /* reading the request from the client */
+#define CS_CONNECT    1   /* connecting to the server */
+#define CS_SEND_REQ   2   /* forwarding the request to the server */
+#define CS_RELAY_READ 3   /* reading the response from the server */
+#define CS_RELAY_SEND 4   /* forwarding the response to the client */
+#define CS_SERVE_OBJ  5   /* sending a cached object */
+#define CS_SERVE      6   /* sending an error or a 304 */
+#define CS_FOLLOW     7   /* waiting for the response another one fetches */
+#define CS_FOLLOW_SEND 8  /* forwarding that response to the client */
+#define CS_DISK_HDRS  9   /* sending the headers of an object on disk */
+#define CS_DISK_BODY  10  /* sending its content from the file */
+#define CS_READ_HDRS  11  /* reading the headers of the response */
+#define CS_NEXT       12  /* the response was sent, the client keeps it */
+#define CS_RESOLVE    13  /* waiting for the address of the server */
+#define CS_DONE       14
+
+typedef struct connection
+{
+    int state;
+    int clientfd;
+    int serverfd;
+    int srvwatch;              /* serverfd registered with the engine */
+    int sockflags;             /* or-ed into the type of the server socket */
+
+    /* The outstanding I/O operation */
+    int op;
+    int opfd;
+    char *opbuf;
+    size_t oplen;
+    struct sockaddr_storage addr;   /* server address for OP_CONNECT */
+    resolvereq rreq;           /* the resolution of that address, and its
+                                  length */
+    char *srvhost;             /* the server, the key of its pool */
+    int srvport;
+    time_t srvborn;            /* when serverfd was connected */
+    int reused;                /* serverfd came from the pool */
+    frame frame;               /* where the response of the server ends */
+    int keepalive;             /* the client keeps the connection */
+    int corked;                /* client_cork() holds the responses back */
+    int served;                /* responses sent on the connection */
+    time_t idle;               /* when the engine started its idle timeout */
+
+    /* Bytes being sent by CS_SEND_REQ, CS_RELAY_SEND and CS_SERVE */
+    char *out;
+    size_t outlen;
+    size_t outoff;
+
+    char *uri;                 /* the requested uri, the cache key */
+    cacheobj *obj;             /* the cached object being served, pinned */
+    cacheobj *stale;           /* the stale object being revalidated, pinned */
+    int notmod;                /* the copy of the client matches it */
+    size_t inlen;              /* bytes of the answer read into buf */
+    objchunk *chunk;           /* its chunks not in iov yet */
+    struct msghdr msg;         /* the buffers of OP_SENDMSG */
+    struct iovec iov[OBJ_IOV];
+    char extra[OBJ_EXTRALEN];  /* the headers added to the object */
+    cachefill *fill;           /* the in-flight response of the uri */
+    int leader;                /* this connection fetches it */
+    size_t filloff;            /* bytes of it a follower has sent */
+    fillwaiter waiter;
+    diskref dref;              /* the object of the disk tier being sent */
+    int dpinned;               /* dref pins its segment */
+    struct conn_queue *wakeq;  /* where the engine takes woken connections */
+
+    struct connection *next;   /* link used by the engine */
+    struct connection *wnext;  /* link in the wake queue, or in the queue
+                                * of the io_uring engine waiting for room
+                                * in its SQ */
+    struct connection *iprev;  /* links in the idle list of the engine */
+    struct connection *inext;
+    rio_t rio;                 /* request bytes read from the client */
+    char buf[MAXBUF];          /* request to the server, then relay chunks */
+}conn;
+
+/* Connections woken up by another thread, handed back to their engine,
+ * which watches the eventfd */
+typedef struct conn_queue
+{
+    int efd;
+    pthread_mutex_t lock;
+    conn *head;
+}connqueue;
+
+conn *conn_new(int clientfd, int sockflags, connqueue *wakeq);
+void conn_free(conn *c);
+void conn_advance(conn *c, ssize_t res);
+int conn_server_idle(conn *c);
+void conn_next(conn *c);
+int connqueue_init(connqueue *q, int flags);
+conn *connqueue_take(connqueue *q);
+
+#endif
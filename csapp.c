@@ -446,16 +446,21 @@ struct hostent *Gethostbyaddr(const char *addr, int len, int type)
 }
 
 /*
- * Getaddrinfo - threadsafe wrapper for getaddrinfo
+ * Getaddrinfo - threadsafe wrapper for getaddrinfo, the IPv4 and IPv6
+ *   addresses of hostname with port filled in
  */
-int Getaddrinfo (char *hostname, struct addrinfo **addr_info) 
+int Getaddrinfo (char *hostname, int port, struct addrinfo **addr_info) 
 {
     struct addrinfo hint;
+    char service[16];
+
     bzero((void *)&hint, sizeof(hint));
     hint.ai_socktype = SOCK_STREAM;
-    hint.ai_family = AF_INET;
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_flags = AI_NUMERICSERV;
+    sprintf(service, "%d", port);
 
-    if (getaddrinfo(hostname, NULL, &hint, addr_info)) {
+    if (getaddrinfo(hostname, service, &hint, addr_info)) {
         return -1;
     }
 
@@ -661,33 +666,110 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - read at most n bytes without waiting for all of them:
+ *    what the internal buffer holds, or what one read() returns (buffered)
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    return rio_read(rp, usrbuf, n);
+}
+
 /* 
- * rio_readlineb - robustly read a text line (buffered)
+ * rio_readlineb - robustly read a text line (buffered). The newline is
+ *    searched with memchr() in the internal buffer and the line copied
+ *    out at once
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
+    size_t n = 0, cnt;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (nl == NULL && n + 1 < maxlen) {
+	while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
+	    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+	    if (rp->rio_cnt < 0) {
+		if (errno != EINTR)
+		    return -1;  /* error */
+	    }
+	    else if (rp->rio_cnt == 0) {
+		if (n == 0)
+		    return 0;   /* EOF, no data read */
+		bufp[n] = 0;
+		return n;       /* EOF, some data was read */
+	    }
 	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+		rp->rio_bufptr = rp->rio_buf;
+	}
+
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = 0;
+    bufp[n] = 0;
     return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readlinev - robustly read a text line without copying it: *linep
+ *    is set to the line inside the internal buffer, which stays valid
+ *    until the next read from rp. The line is not NUL terminated, a line
+ *    longer than the buffer is returned in pieces. Returns its length
+ *    with the newline, 0 on EOF, -1 on error
+ */
+ssize_t rio_readlinev(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+    size_t cnt;
+    char *nl;
+
+    while (1) {
+	if (rp->rio_cnt > 0 &&
+		(nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt)) != NULL) {
+	    cnt = nl - rp->rio_bufptr + 1;
+	    break;
+	}
+	if (rp->rio_cnt == sizeof(rp->rio_buf)) {  /* full, no newline */
+	    cnt = rp->rio_cnt;
+	    break;
+	}
+
+	/* Move the start of the line to the front and read after it */
+	if (rp->rio_cnt <= 0)
+	    rp->rio_cnt = 0;
+	else if (rp->rio_bufptr != rp->rio_buf)
+	    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_buf;
+	rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+		sizeof(rp->rio_buf) - rp->rio_cnt);
+	if (rc < 0) {
+	    if (errno != EINTR)
+		return -1;
+	}
+	else if (rc == 0) {  /* EOF, the last line has no newline */
+	    if (rp->rio_cnt == 0)
+		return 0;
+	    cnt = rp->rio_cnt;
+	    break;
+	}
+	else
+	    rp->rio_cnt += rc;
+    }
+
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -732,6 +814,17 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     return rc;
 }
 
+ssize_t Rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readsomeb(rp, usrbuf, n)) < 0) {
+        if ((errno != ECONNRESET) && (errno != EPIPE))
+            unix_error("Rio_readsomeb error");
+    }
+    return rc;
+}
+
 /*
  * The wrapper function ignores the ECONNRESET
  */
@@ -746,37 +839,49 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_readlinev(rio_t *rp, char **linep)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readlinev(rp, linep)) < 0) {
+        if ((errno != ECONNRESET) && (errno != EPIPE))
+            unix_error("Rio_readlinev error");
+    }
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
+static int open_listenfd_opt(int port, int reuseport);
+
 /*
  * open_clientfd - open connection to server at <hostname, port> 
  *   and return a socket descriptor ready for reading and writing.
+ *   The addresses of the server, IPv4 or IPv6, are tried in turn.
  *   Returns -1 and sets errno on Unix error. 
- *   Returns -2 and sets h_errno on DNS (gethostbyname) error.
+ *   Returns -2 on DNS (getaddrinfo) error.
  */
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, int port) 
 {
-    int clientfd;
-    struct sockaddr_in serveraddr;
-    struct addrinfo *addr_info;
-
-    if ((clientfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-	return -1; /* check errno for cause of error */
-
-    /* Fill in the server's IP address and port */
-    if ((Getaddrinfo(hostname, &addr_info)) == -1)
-	return -2; /* check h_errno for cause of error */
-    bzero((char *) &serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_port = htons(port);
-    serveraddr.sin_addr.s_addr = ((struct sockaddr_in*)(addr_info->ai_addr))->sin_addr.s_addr;
+    int clientfd = -1;
+    struct addrinfo *addr_info, *p;
+
+    /* Get the server's IP addresses with the port */
+    if ((Getaddrinfo(hostname, port, &addr_info)) == -1)
+	return -2;
+
+    /* Establish a connection with the first one which accepts */
+    for (p = addr_info; p != NULL; p = p->ai_next) {
+        if ((clientfd = socket(p->ai_family, SOCK_STREAM, 0)) < 0)
+            continue;
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(clientfd);
+        clientfd = -1;
+    }
     freeaddrinfo(addr_info);
-
-    /* Establish a connection with the server */
-    if (connect(clientfd, (SA *) &serveraddr, sizeof(serveraddr)) < 0)
-	return -1;
     return clientfd;
 }
 /* $end open_clientfd */
@@ -787,6 +892,23 @@ int open_clientfd(char *hostname, int port)
  */
 /* $begin open_listenfd */
 int open_listenfd(int port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+/* $end open_listenfd */
+
+/*  
+ * open_listenfd_reuseport - open and return a listening socket on port
+ *     that other SO_REUSEPORT sockets may bind too, the kernel then
+ *     spreads the incoming connections between them.
+ *     Returns -1 and sets errno on Unix error.
+ */
+int open_listenfd_reuseport(int port) 
+{
+    return open_listenfd_opt(port, 1);
+}
+
+static int open_listenfd_opt(int port, int reuseport) 
 {
     int listenfd, optval=1;
     struct sockaddr_in serveraddr;
@@ -800,6 +922,10 @@ int open_listenfd(int port)
 		   (const void *)&optval , sizeof(int)) < 0)
 	return -1;
 
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, 
+		   (const void *)&optval , sizeof(int)) < 0)
+	return -1;
+
     /* Listenfd will be an endpoint for all requests to port
        on any IP address for this host */
     bzero((char *) &serveraddr, sizeof(serveraddr));
@@ -814,7 +940,6 @@ int open_listenfd(int port)
 	return -1;
     return listenfd;
 }
-/* $end open_listenfd */
 
 /******************************************
  * Wrappers for the client/server helper routines 
@@ -842,6 +967,15 @@ int Open_listenfd(int port)
         return -1;
     return rc;
 }
+
+int Open_listenfd_reuseport(int port) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+        return -1;
+    return rc;
+}
 /* $end csapp.c */
 
 
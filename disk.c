@@ -0,0 +1,426 @@
+/*
+ * Author: shiweid
+ *
+ * disk.c include the second tier of the cache. See disk.h for the
+ * overview.
+ * A record is a header followed by the uri, the response headers and the
+ * content, padded to 8 bytes. The index and the segments are protected by
+ * one mutex; the bytes of a segment pinned by a reader are never moved or
+ * overwritten, so the reader sends them without the lock. A writer pins
+ * the segment it copies a record into the same way.
+ */
+
+#include <sys/mman.h>
+#include "disk.h"
+
+#define DISK_MAGIC 0x70787964   /* "pxyd" */
+
+typedef struct disk_record
+{
+    unsigned int magic;
+    unsigned int urilen;
+    unsigned int hdrlen;
+    unsigned int bodylen;
+    unsigned long long hash;
+    unsigned long cost;
+    time_t expires;
+    time_t born;
+    unsigned int swr;
+    unsigned int sie;
+}diskrec;
+
+typedef struct disk_entry
+{
+    unsigned long long hash;
+    size_t off;          /* of the record in the file */
+    size_t reclen;
+    int hot;             /* hit since it was written */
+    struct disk_entry *next;
+}diskent;
+
+typedef struct disk_segment
+{
+    size_t used;
+    int pins;            /* readers sending from it, writers copying in */
+}diskseg;
+
+typedef struct disk_tier
+{
+    int fd;
+    char *base;
+    int nsegs;
+    int cur;             /* the segment being written */
+    diskseg *segs;
+    diskent *buckets[DISK_BUCKETS];
+    pthread_mutex_t lock;
+
+    /* Statistics, protected by lock */
+    unsigned long nobjs;
+    unsigned long bytes;     /* of the live records */
+    unsigned long hits;
+    unsigned long compactions;
+    unsigned long kept;      /* records moved by compactions */
+}disktier;
+
+static disktier disk;
+
+/* Static helper functions */
+static diskent *disk_find(char *uri, unsigned long long hash);
+static void disk_remove(diskent *e);
+static int disk_segment(size_t need);
+static void disk_compact(int seg);
+static size_t disk_reclen(size_t urilen, size_t hdrlen, size_t bodylen);
+
+/*
+ * disk_init - create the file at path, size bytes long, and map it
+ * Return 0 on success -1 on error
+ */
+int disk_init(char *path, size_t size)
+{
+    disk.nsegs = size / DISK_SEGMENT;
+    if (disk.nsegs < 2) {
+        fprintf(stderr, "The disk tier needs at least %d MB\n",
+                2 * DISK_SEGMENT / (1024 * 1024));
+        return -1;
+    }
+    size = (size_t)disk.nsegs * DISK_SEGMENT;
+
+    if ((disk.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        unix_error("disk open error");
+        return -1;
+    }
+    if (ftruncate(disk.fd, size) < 0) {
+        unix_error("disk ftruncate error");
+        close(disk.fd);
+        return -1;
+    }
+    disk.base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            disk.fd, 0);
+    if (disk.base == MAP_FAILED) {
+        unix_error("disk mmap error");
+        close(disk.fd);
+        disk.base = NULL;
+        return -1;
+    }
+
+    disk.segs = Calloc(disk.nsegs, sizeof(diskseg));
+    disk.cur = 0;
+    memset(disk.buckets, 0, sizeof(disk.buckets));
+    pthread_mutex_init(&disk.lock, NULL);
+    disk.nobjs = disk.bytes = disk.hits = 0;
+    disk.compactions = disk.kept = 0;
+    return 0;
+}
+
+/*
+ * disk_max_object - the biggest content the tier takes, 0 without a tier
+ */
+size_t disk_max_object(void)
+{
+    return (disk.base != NULL) ? DISK_MAX_OBJECT : 0;
+}
+
+/*
+ * disk_store - append the response to uri to the log, replacing the one
+ * stored before, with the freshness in fi. Nothing is stored if it may not
+ * be served even stale any more or no segment has room.
+ * The room is reserved under the lock and the record copied without it,
+ * its segment pinned meanwhile. It replaces the older one once complete
+ */
+void disk_store(char *uri, unsigned long long hash, char *reshdrs,
+        size_t hdrlen, objchunk *content, size_t content_size,
+        unsigned long cost, freshinfo *fi)
+{
+    size_t urilen = strlen(uri);
+    size_t reclen = disk_reclen(urilen, hdrlen, content_size);
+    diskent *e, *old;
+    diskrec *rec;
+    char *p;
+    int seg;
+
+    if (disk.base == NULL || content_size > DISK_MAX_OBJECT ||
+            !OBJ_KEPT(fi, time(NULL)))
+        return;
+
+    pthread_mutex_lock(&disk.lock);
+    if (disk.segs[disk.cur].used + reclen > DISK_SEGMENT &&
+            disk_segment(reclen) < 0) {
+        pthread_mutex_unlock(&disk.lock);
+        return;
+    }
+    seg = disk.cur;
+    e = Malloc(sizeof(diskent));
+    e->hash = hash;
+    e->off = (size_t)seg * DISK_SEGMENT + disk.segs[seg].used;
+    e->reclen = reclen;
+    e->hot = 0;
+    disk.segs[seg].used += reclen;
+    disk.segs[seg].pins++;
+    pthread_mutex_unlock(&disk.lock);
+
+    rec = (diskrec *)(disk.base + e->off);
+    rec->magic = DISK_MAGIC;
+    rec->urilen = urilen;
+    rec->hdrlen = hdrlen;
+    rec->bodylen = content_size;
+    rec->hash = hash;
+    rec->cost = cost;
+    rec->expires = fi->expires;
+    rec->born = fi->born;
+    rec->swr = fi->swr;
+    rec->sie = fi->sie;
+    p = (char *)(rec + 1);
+    memcpy(p, uri, urilen);
+    memcpy(p + urilen, reshdrs, hdrlen);
+    p += urilen + hdrlen;
+    for (; content != NULL; content = content->next) {
+        memcpy(p, content->data, content->len);
+        p += content->len;
+    }
+
+    pthread_mutex_lock(&disk.lock);
+    if ((old = disk_find(uri, hash)) != NULL)
+        disk_remove(old);
+    e->next = disk.buckets[hash % DISK_BUCKETS];
+    disk.buckets[hash % DISK_BUCKETS] = e;
+    disk.segs[seg].pins--;
+    disk.nobjs++;
+    disk.bytes += reclen;
+    pthread_mutex_unlock(&disk.lock);
+}
+
+/*
+ * disk_lookup - find the object of uri and pin its segment. It is a hit if
+ * it is fresh or may be served while stale, or when onerror, because the
+ * server failed. A big object is not refreshed in the background: the
+ * first miss once it may not be served stale fetches it again.
+ * An object which may not be served even stale any more is dropped
+ * Return 0 and fill ref on a hit, -1 otherwise
+ */
+int disk_lookup(char *uri, unsigned long long hash, diskref *ref,
+        int onerror)
+{
+    diskent *e;
+    diskrec *rec;
+    time_t now = time(NULL);
+
+    if (disk.base == NULL)
+        return -1;
+
+    pthread_mutex_lock(&disk.lock);
+    if ((e = disk_find(uri, hash)) == NULL) {
+        pthread_mutex_unlock(&disk.lock);
+        return -1;
+    }
+    rec = (diskrec *)(disk.base + e->off);
+    if (!OBJ_KEPT(rec, now)) {
+        disk_remove(e);
+        pthread_mutex_unlock(&disk.lock);
+        return -1;
+    }
+    if (!OBJ_SWR(rec, now) && !(onerror && OBJ_SIE(rec, now))) {
+        pthread_mutex_unlock(&disk.lock);
+        return -1;
+    }
+    e->hot = 1;
+    ref->seg = e->off / DISK_SEGMENT;
+    ref->hdrs = (char *)(rec + 1) + rec->urilen;
+    ref->hdrlen = rec->hdrlen;
+    ref->bodyoff = ref->hdrs + rec->hdrlen - disk.base;
+    ref->bodylen = rec->bodylen;
+    disk.segs[ref->seg].pins++;
+    disk.hits++;
+    pthread_mutex_unlock(&disk.lock);
+    return 0;
+}
+
+/*
+ * disk_read_done - unpin the segment pinned by disk_lookup()
+ */
+void disk_read_done(diskref *ref)
+{
+    pthread_mutex_lock(&disk.lock);
+    disk.segs[ref->seg].pins--;
+    pthread_mutex_unlock(&disk.lock);
+}
+
+/*
+ * disk_promote - take the object of uri out of the tier if it fits in the
+ * memory cache and may still be served, fresh or stale
+ * Return a new object for the memory cache, NULL if there is none
+ */
+cacheobj *disk_promote(char *uri, unsigned long long hash)
+{
+    diskent *e;
+    diskrec *rec;
+    char *hdrs;
+    cacheobj *obj;
+
+    if (disk.base == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&disk.lock);
+    if ((e = disk_find(uri, hash)) == NULL ||
+            ((diskrec *)(disk.base + e->off))->bodylen > MAX_OBJECT_SIZE) {
+        pthread_mutex_unlock(&disk.lock);
+        return NULL;
+    }
+    rec = (diskrec *)(disk.base + e->off);
+    if (!OBJ_KEPT(rec, time(NULL))) {
+        disk_remove(e);
+        pthread_mutex_unlock(&disk.lock);
+        return NULL;
+    }
+    hdrs = (char *)(rec + 1) + rec->urilen;
+    obj = new_obj(uri, hdrs, rec->hdrlen,
+            chunks_copy(hdrs + rec->hdrlen, rec->bodylen), rec->bodylen);
+    obj->cost = rec->cost;
+    obj->expires = rec->expires;
+    obj->born = rec->born;
+    obj->swr = rec->swr;
+    obj->sie = rec->sie;
+    disk.hits++;
+    disk_remove(e);
+    pthread_mutex_unlock(&disk.lock);
+    return obj;
+}
+
+/*
+ * disk_fd - the descriptor of the file, for sendfile()
+ */
+int disk_fd(void)
+{
+    return disk.fd;
+}
+
+/*
+ * disk_base - the mapping of the file
+ */
+char *disk_base(void)
+{
+    return disk.base;
+}
+
+/*
+ * disk_stats - print the statistics of the tier to fp
+ */
+void disk_stats(FILE *fp)
+{
+    if (disk.base == NULL)
+        return;
+
+    pthread_mutex_lock(&disk.lock);
+    fprintf(fp, "disk: %lu objects, %lu KB of %lu MB, %lu hits, "
+            "%lu compactions kept %lu objects\n", disk.nobjs,
+            disk.bytes / 1024,
+            (unsigned long)disk.nsegs * DISK_SEGMENT / (1024 * 1024),
+            disk.hits, disk.compactions, disk.kept);
+    pthread_mutex_unlock(&disk.lock);
+}
+
+/*
+ * disk_find - the index entry of uri
+ * Return NULL if it is not stored
+ * Notice: the caller holds the lock
+ */
+static diskent *disk_find(char *uri, unsigned long long hash)
+{
+    diskent *e;
+    diskrec *rec;
+    size_t urilen = strlen(uri);
+
+    for (e = disk.buckets[hash % DISK_BUCKETS]; e != NULL; e = e->next) {
+        rec = (diskrec *)(disk.base + e->off);
+        if (e->hash == hash && rec->urilen == urilen &&
+                memcmp(rec + 1, uri, urilen) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * disk_remove - drop the entry from the index, its record becomes garbage
+ * Notice: the caller holds the lock
+ */
+static void disk_remove(diskent *e)
+{
+    diskent **pp = &disk.buckets[e->hash % DISK_BUCKETS];
+
+    while (*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+    disk.nobjs--;
+    disk.bytes -= e->reclen;
+    Free(e);
+}
+
+/*
+ * disk_segment - move the log to the next segment nobody reads from which
+ * has room for need bytes once compacted. At most DISK_COMPACT_SEGS are
+ * compacted, the lock is held meanwhile
+ * Return 0 on success -1 if there is none
+ * Notice: the caller holds the lock
+ */
+static int disk_segment(size_t need)
+{
+    int i, seg, compacted = 0;
+
+    for (i = 1; i <= disk.nsegs && compacted < DISK_COMPACT_SEGS; i++) {
+        seg = (disk.cur + i) % disk.nsegs;
+        if (disk.segs[seg].pins > 0)
+            continue;
+        disk_compact(seg);
+        compacted++;
+        if (disk.segs[seg].used + need <= DISK_SEGMENT) {
+            disk.cur = seg;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * disk_compact - keep the records of seg hit since they were written at
+ * its front, and drop the others
+ * Notice: the caller holds the lock and nobody reads from seg
+ */
+static void disk_compact(int seg)
+{
+    size_t start = (size_t)seg * DISK_SEGMENT;
+    size_t off = 0, w = 0, reclen;
+    diskrec *rec;
+    diskent *e;
+
+    if (disk.segs[seg].used == 0)
+        return;
+
+    while (off < disk.segs[seg].used) {
+        rec = (diskrec *)(disk.base + start + off);
+        reclen = disk_reclen(rec->urilen, rec->hdrlen, rec->bodylen);
+        for (e = disk.buckets[rec->hash % DISK_BUCKETS]; e != NULL; e = e->next)
+            if (e->off == start + off)
+                break;
+
+        if (e != NULL && e->hot) {
+            e->hot = 0;
+            if (w != off)
+                memmove(disk.base + start + w, rec, reclen);
+            e->off = start + w;
+            w += reclen;
+            disk.kept++;
+        }
+        else if (e != NULL)
+            disk_remove(e);
+        off += reclen;
+    }
+    disk.segs[seg].used = w;
+    disk.compactions++;
+}
+
+/*
+ * disk_reclen - the length of a record, padded to 8 bytes
+ */
+static size_t disk_reclen(size_t urilen, size_t hdrlen, size_t bodylen)
+{
+    return (sizeof(diskrec) + urilen + hdrlen + bodylen + 7) & ~(size_t)7;
+}
@@ -0,0 +1,55 @@
+/*
+ * Author: shiweid
+ *
+ * disk.h include the second tier of the cache: a log-structured file,
+ * mapped in memory, with an index of its objects kept in memory.
+ * Objects evicted from the memory cache, and responses too big for it,
+ * are appended to the log. A hit on an object small enough for the memory
+ * cache moves it back there, a hit on a big one is sent from the file with
+ * sendfile().
+ * The file is split into segments written one after the other. When the
+ * log needs a new segment it takes the oldest one nobody is reading from
+ * and compacts it: the objects hit since they were written are kept at its
+ * front, the others are dropped. An object is dropped when it is looked
+ * up once it may not be served even stale. A big one is served stale
+ * within its stale-while-revalidate window, and within its stale-if-error
+ * one when the server fails, but it is not refreshed in the background.
+ */
+
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "fresh.h"
+
+#define DISK_SIZE 256               /* default budget of the file, in MB */
+#define DISK_SEGMENT (4 * 1024 * 1024)
+#define DISK_MAX_OBJECT (1024 * 1024)
+#define DISK_BUCKETS 4096           /* buckets of the index */
+#define DISK_COMPACT_SEGS 2         /* compacted at most for a new segment */
+
+/* Where an object lies in the file, the segment is pinned */
+typedef struct disk_ref
+{
+    int seg;
+    char *hdrs;        /* the headers, in the mapping */
+    size_t hdrlen;
+    off_t bodyoff;     /* the content, in the file */
+    size_t bodylen;
+}diskref;
+
+int disk_init(char *path, size_t size);
+size_t disk_max_object(void);
+void disk_store(char *uri, unsigned long long hash, char *reshdrs,
+        size_t hdrlen, objchunk *content, size_t content_size,
+        unsigned long cost, freshinfo *fi);
+int disk_lookup(char *uri, unsigned long long hash, diskref *ref,
+        int onerror);
+void disk_read_done(diskref *ref);
+cacheobj *disk_promote(char *uri, unsigned long long hash);
+int disk_fd(void);
+char *disk_base(void);
+void disk_stats(FILE *fp);
+
+#endif
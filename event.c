@@ -0,0 +1,412 @@
+/*
+ * Author: shiweid
+ *
+ * event.c include the event driven engine of the proxy.
+ * Every socket is non-blocking and registered once with edge-triggered
+ * epoll for both directions. A connection only ever waits for one
+ * operation, so on any event its outstanding operation is simply retried
+ * until it would block again.
+ * The connections waiting for a request of their client are on one of two
+ * idle lists in the order they started waiting: the new ones, which get
+ * CLIENT_REQUEST_TIMEOUT seconds from the accept for their first request,
+ * and the ones kept for the next request, which get client_idle seconds.
+ * epoll_wait() times out when the first of them expires.
+ */
+
+#define _GNU_SOURCE
+#include "csapp.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include "conn.h"
+#include "proxy.h"
+#include "event.h"
+#include "uring.h"
+
+/* What a per-CPU loop thread needs to start */
+typedef struct {
+    int listenfd;
+    int cpu;
+    int uring;   /* try the io_uring engine first */
+} cpuloop;
+
+/* Seconds a connection on idle list l waits for a request */
+#define IDLE_TIMEOUT(l) ((l) ? client_idle : CLIENT_REQUEST_TIMEOUT)
+
+/* Static helper functions */
+static void *event_thread(void *vargp);
+static void event_accept(evloop *loop);
+static void event_wakeup(evloop *loop);
+static void event_run(evloop *loop, conn *c);
+static ssize_t event_perform(evloop *loop, conn *c);
+static int event_watch(evloop *loop, int fd, void *ptr, unsigned int events);
+static void event_release(evloop *loop, conn *c);
+static void event_idle(evloop *loop, conn *c, int on);
+static void event_expire(evloop *loop);
+static int event_timeout(evloop *loop);
+static void raise_fd_limit(void);
+
+/*
+ * event_loop - serve the connections accepted on listenfd forever
+ */
+void event_loop(int listenfd)
+{
+    evloop loop;
+    struct epoll_event events[MAXEVENTS];
+    int i, n;
+    conn *c;
+
+    raise_fd_limit();
+
+    loop.listenfd = listenfd;
+    loop.closed = NULL;
+    loop.idle[0] = loop.idle[1] = NULL;
+    loop.idletail[0] = loop.idletail[1] = NULL;
+    if ((loop.epfd = epoll_create1(0)) < 0) {
+        unix_error("epoll_create1 error");
+        return;
+    }
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    /* The listening socket is the only one without a connection, the
+     * eventfd of the wake queue points to the loop itself */
+    if (event_watch(&loop, listenfd, NULL, EPOLLIN) < 0)
+        return;
+    if (connqueue_init(&loop.wakeq, EFD_NONBLOCK) < 0 ||
+            event_watch(&loop, loop.wakeq.efd, &loop, EPOLLIN) < 0)
+        return;
+
+    while (1) {
+        if ((n = epoll_wait(loop.epfd, events, MAXEVENTS,
+                        event_timeout(&loop))) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+            return;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                event_accept(&loop);
+            else if (events[i].data.ptr == &loop)
+                event_wakeup(&loop);
+            else
+                event_run(&loop, events[i].data.ptr);
+        }
+
+        /* Later events of the batch may still point to a finished
+         * connection, so they are only freed here */
+        event_expire(&loop);
+        while ((c = loop.closed) != NULL) {
+            loop.closed = c->next;
+            event_release(&loop, c);
+            conn_free(c);
+        }
+    }
+}
+
+/*
+ * event_loop_percpu - run one event loop per CPU the proxy may use.
+ * Every loop is pinned to its CPU and accepts on its own SO_REUSEPORT
+ * listener, the kernel spreads the connections between the listeners so
+ * each loop serves its connections end to end without sharing a socket.
+ * The calling thread runs the loop of the first CPU. With uring set the
+ * loops use the io_uring engine when it is available.
+ * Return -1 if the listeners can not be opened, never returns otherwise
+ */
+int event_loop_percpu(int port, int uring)
+{
+    cpu_set_t set;
+    cpuloop *loops;
+    pthread_t tid;
+    int cpu, n = 0, i;
+
+    if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+        unix_error("sched_getaffinity error");
+        return -1;
+    }
+
+    /* Open every listener before serving so a busy port is reported */
+    loops = Calloc(CPU_COUNT(&set), sizeof(cpuloop));
+    for (cpu = 0; cpu < CPU_SETSIZE && n < CPU_COUNT(&set); cpu++) {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+        if ((loops[n].listenfd = Open_listenfd_reuseport(port)) < 0) {
+            while (n-- > 0)
+                Close(loops[n].listenfd);
+            Free(loops);
+            return -1;
+        }
+        loops[n].uring = uring;
+        loops[n++].cpu = cpu;
+    }
+
+    for (i = 1; i < n; i++)
+        Pthread_create(&tid, NULL, event_thread, &loops[i]);
+    event_thread(&loops[0]);
+    return 0;
+}
+
+/*
+ * event_thread - pin the thread to its CPU and run its event loop
+ */
+static void *event_thread(void *vargp)
+{
+    cpuloop *cl = vargp;
+    cpu_set_t set;
+    int rc;
+
+    Pthread_detach(pthread_self());
+    CPU_ZERO(&set);
+    CPU_SET(cl->cpu, &set);
+    if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+        posix_error(rc, "pthread_setaffinity_np error");
+
+    if (!cl->uring || uring_loop(cl->listenfd) < 0)
+        event_loop(cl->listenfd);
+    return NULL;
+}
+
+/*
+ * event_accept - accept every pending connection and start serving it
+ */
+static void event_accept(evloop *loop)
+{
+    int connfd;
+    conn *c;
+
+    while ((connfd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        c = conn_new(connfd, SOCK_NONBLOCK, &loop->wakeq);
+        if (event_watch(loop, connfd, c, EPOLLIN | EPOLLOUT | EPOLLRDHUP) < 0) {
+            conn_free(c);
+            continue;
+        }
+        event_run(loop, c);
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        unix_error("accept4 error");
+}
+
+/*
+ * event_wakeup - resume the followers the leaders have woken up
+ */
+static void event_wakeup(evloop *loop)
+{
+    uint64_t cnt;
+    conn *c, *next;
+
+    while (read(loop->wakeq.efd, &cnt, sizeof(cnt)) < 0 && errno == EINTR)
+        ;
+    for (c = connqueue_take(&loop->wakeq); c != NULL; c = next) {
+        next = c->wnext;
+        conn_advance(c, 0);
+        event_run(loop, c);
+    }
+}
+
+/*
+ * event_run - perform the operations of the connection until one of them
+ * would block or the connection is done. A connection waiting for a
+ * request of its client is on an idle list meanwhile
+ */
+static void event_run(evloop *loop, conn *c)
+{
+    ssize_t res;
+
+    if (c->state == CS_DONE)
+        return;
+
+    while (c->op != OP_NONE || c->state == CS_NEXT) {
+        if (c->op == OP_NONE) {
+            /* The client keeps the connection */
+            event_release(loop, c);
+            event_idle(loop, c, 0);
+            conn_next(c);
+            continue;
+        }
+        if (c->op == OP_WAIT)
+            return; /* until event_wakeup() */
+        res = event_perform(loop, c);
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                    errno == EINPROGRESS)) {
+            /* wait for the next edge */
+            event_idle(loop, c, c->state == CS_READ_REQ);
+            return;
+        }
+        conn_advance(c, res);
+    }
+
+    event_idle(loop, c, 0);
+    c->next = loop->closed;
+    loop->closed = c;
+}
+
+/*
+ * event_perform - try the outstanding operation of the connection once
+ * Return what the underlying call returned, errno is set on -1
+ */
+static ssize_t event_perform(evloop *loop, conn *c)
+{
+    ssize_t res;
+    off_t off;
+
+    switch (c->op) {
+    case OP_RECV:
+        while ((res = recv(c->opfd, c->opbuf, c->oplen, 0)) < 0 &&
+                errno == EINTR)
+            ;
+        return res;
+
+    case OP_SEND:
+        while ((res = send(c->opfd, c->opbuf, c->oplen, MSG_NOSIGNAL)) < 0 &&
+                errno == EINTR)
+            ;
+        return res;
+
+    case OP_SENDMSG:
+        while ((res = sendmsg(c->opfd, &c->msg, MSG_NOSIGNAL)) < 0 &&
+                errno == EINTR)
+            ;
+        return res;
+
+    case OP_SENDFILE:   /* opbuf is in the mapping of the disk tier */
+        off = c->opbuf - disk_base();
+        while ((res = sendfile(c->opfd, disk_fd(), &off, c->oplen)) < 0 &&
+                errno == EINTR)
+            ;
+        return res;
+
+    case OP_CONNECT:
+        if (!c->srvwatch) {
+            if (event_watch(loop, c->opfd, c,
+                        EPOLLIN | EPOLLOUT | EPOLLRDHUP) < 0)
+                return -1;
+            c->srvwatch = 1;
+        }
+        /* A repeated connect() reports how the first one went */
+        if (connect(c->opfd, (SA *)&c->addr, c->rreq.addrlen) == 0 ||
+                errno == EISCONN)
+            return 0;
+        if (errno == EALREADY)
+            errno = EINPROGRESS;
+        return -1;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * event_watch - register fd with the epoll instance of loop
+ * Return 0 on success -1 on error
+ */
+static int event_watch(evloop *loop, int fd, void *ptr, unsigned int events)
+{
+    struct epoll_event ev;
+
+    ev.events = events | EPOLLET;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        unix_error("epoll_ctl error");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * event_release - a connection to a server going back to the pool must
+ * not point to the connection which used it anymore
+ */
+static void event_release(evloop *loop, conn *c)
+{
+    if (c->srvwatch && conn_server_idle(c))
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->serverfd, NULL);
+}
+
+/*
+ * event_idle - put the connection at the end of its idle list if on, it
+ * stays where it is if it was there already, or take it off. A connection
+ * which was served a response is on the list of the kept ones
+ */
+static void event_idle(evloop *loop, conn *c, int on)
+{
+    int l = (c->served > 0);
+
+    if (on && c->idle == 0) {
+        c->idle = time(NULL);
+        c->iprev = loop->idletail[l];
+        c->inext = NULL;
+        if (loop->idletail[l] != NULL)
+            loop->idletail[l]->inext = c;
+        else
+            loop->idle[l] = c;
+        loop->idletail[l] = c;
+    }
+    else if (!on && c->idle != 0) {
+        if (c->iprev != NULL)
+            c->iprev->inext = c->inext;
+        else
+            loop->idle[l] = c->inext;
+        if (c->inext != NULL)
+            c->inext->iprev = c->iprev;
+        else
+            loop->idletail[l] = c->iprev;
+        c->idle = 0;
+    }
+}
+
+/*
+ * event_expire - close the connections which waited too long for a
+ * request of their client
+ */
+static void event_expire(evloop *loop)
+{
+    time_t now = time(NULL);
+    conn *c;
+    int l;
+
+    for (l = 0; l < 2; l++) {
+        while ((c = loop->idle[l]) != NULL &&
+                c->idle + IDLE_TIMEOUT(l) <= now) {
+            event_idle(loop, c, 0);
+            c->next = loop->closed;
+            loop->closed = c;
+        }
+    }
+}
+
+/*
+ * event_timeout - the timeout of epoll_wait(), in milliseconds
+ * Return -1 when no connection is idle
+ */
+static int event_timeout(evloop *loop)
+{
+    time_t left, first = -1;
+    int l;
+
+    for (l = 0; l < 2; l++) {
+        if (loop->idle[l] == NULL)
+            continue;
+        left = loop->idle[l]->idle + IDLE_TIMEOUT(l) - time(NULL);
+        if (first < 0 || left < first)
+            first = (left > 0) ? left : 0;
+    }
+    return (first < 0) ? -1 : first * 1000;
+}
+
+/*
+ * raise_fd_limit - every connection needs up to two descriptors, allow
+ * as many as the hard limit permits
+ */
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
@@ -0,0 +1,31 @@
+/*
+ * Author: shiweid
+ *
+ * event.h include the event driven engine of the proxy: a single thread
+ * serves every connection with non-blocking sockets and edge-triggered
+ * epoll, driving the state machine in conn.h. Several independent loops,
+ * one per CPU, can share the port through SO_REUSEPORT listeners.
+ */
+
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "conn.h"
+
+#define MAXEVENTS 256   /* events fetched by one epoll_wait() */
+
+typedef struct event_loop
+{
+    int epfd;
+    int listenfd;
+    conn *closed;   /* finished connections, freed after each batch */
+    conn *idle[2];  /* connections waiting for their first request, and
+                     * for the next one */
+    conn *idletail[2];
+    connqueue wakeq;   /* followers woken up, see conn.h */
+}evloop;
+
+void event_loop(int listenfd);
+int event_loop_percpu(int port, int uring);
+
+#endif
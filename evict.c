@@ -0,0 +1,414 @@
+/*
+ * Author: shiweid
+ *
+ * evict.c include the eviction policies of the cache. See evict.h for the
+ * overview.
+ * Objects are linked into the lists of their shard at the head, victims
+ * are taken from the rear.
+ */
+
+#include "evict.h"
+
+/* Static helper functions */
+static void lru_hit(cacheshard *shard, cacheobj *obj);
+static void lru_insert(cacheshard *shard, cacheobj *obj);
+static cacheobj *lru_victim(cacheshard *shard);
+static void clock_hit(cacheshard *shard, cacheobj *obj);
+static cacheobj *clock_victim(cacheshard *shard);
+static void s3_hit(cacheshard *shard, cacheobj *obj);
+static void s3_insert(cacheshard *shard, cacheobj *obj);
+static cacheobj *s3_victim(cacheshard *shard);
+static void lfu_init(cacheshard *shard);
+static void lfu_access(cacheshard *shard, unsigned long long hash);
+static void lfu_insert(cacheshard *shard, cacheobj *obj);
+static cacheobj *lfu_victim(cacheshard *shard);
+static int sketch_freq(cacheshard *shard, unsigned long long hash);
+static void gdsf_hit(cacheshard *shard, cacheobj *obj);
+static void gdsf_insert(cacheshard *shard, cacheobj *obj);
+static cacheobj *gdsf_victim(cacheshard *shard);
+static void gdsf_remove(cacheshard *shard, cacheobj *obj);
+static void gdsf_prio(cacheshard *shard, cacheobj *obj);
+static void heap_set(cacheshard *shard, size_t i, cacheobj *obj);
+static void heap_up(cacheshard *shard, size_t i);
+static void heap_down(cacheshard *shard, size_t i);
+
+static cachepolicy policies[] = {
+    {"lru", 1, NULL, NULL, lru_hit, lru_insert, lru_victim, NULL},
+    {"clock", 0, NULL, NULL, clock_hit, lru_insert, clock_victim, NULL},
+    {"s3fifo", 0, NULL, NULL, s3_hit, s3_insert, s3_victim, NULL},
+    {"tinylfu", 1, lfu_init, lfu_access, lru_hit, lfu_insert, lfu_victim,
+        NULL},
+    {"gdsf", 1, NULL, NULL, gdsf_hit, gdsf_insert, gdsf_victim, gdsf_remove},
+};
+
+/*
+ * find_policy - the eviction policy called name
+ * Return NULL if there is none
+ */
+cachepolicy *find_policy(char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(name, policies[i].name) == 0)
+            return &policies[i];
+    }
+    return NULL;
+}
+
+/*
+ * list_push - link obj at the head of the given list of shard
+ */
+void list_push(cacheshard *shard, int list, cacheobj *obj)
+{
+    objlist *l = &shard->lists[list];
+
+    obj->list = list;
+    obj->prev = NULL;
+    obj->next = l->head;
+    if (l->head != NULL)
+        l->head->prev = obj;
+    else
+        l->rear = obj;
+    l->head = obj;
+    l->size += obj->content_size;
+}
+
+/*
+ * list_remove - take obj off its list
+ */
+void list_remove(cacheshard *shard, cacheobj *obj)
+{
+    objlist *l = &shard->lists[obj->list];
+
+    if (obj->prev != NULL)
+        obj->prev->next = obj->next;
+    else
+        l->head = obj->next;
+    if (obj->next != NULL)
+        obj->next->prev = obj->prev;
+    else
+        l->rear = obj->prev;
+    obj->prev = obj->next = NULL;
+    l->size -= obj->content_size;
+}
+
+/*
+ * lru_hit - move obj to the head of its list
+ */
+static void lru_hit(cacheshard *shard, cacheobj *obj)
+{
+    if (shard->lists[obj->list].head == obj)
+        return;
+    list_remove(shard, obj);
+    list_push(shard, obj->list, obj);
+}
+
+/*
+ * lru_insert - a new object goes to the head of the first list
+ */
+static void lru_insert(cacheshard *shard, cacheobj *obj)
+{
+    list_push(shard, 0, obj);
+}
+
+/*
+ * lru_victim - the least recently used object
+ */
+static cacheobj *lru_victim(cacheshard *shard)
+{
+    return shard->lists[0].rear;
+}
+
+/*
+ * clock_hit - set the reference bit of obj
+ */
+static void clock_hit(cacheshard *shard, cacheobj *obj)
+{
+    if (obj->freq == 0)
+        __atomic_store_n(&obj->freq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * clock_victim - the oldest object whose reference bit is clear, the ones
+ * passed over get their bit cleared and go back to the head
+ */
+static cacheobj *clock_victim(cacheshard *shard)
+{
+    cacheobj *obj;
+
+    while ((obj = shard->lists[0].rear) != NULL && obj->freq) {
+        obj->freq = 0;
+        list_remove(shard, obj);
+        list_push(shard, 0, obj);
+    }
+    return obj;
+}
+
+/*
+ * s3_hit - count the hit, up to S3_MAXFREQ
+ */
+static void s3_hit(cacheshard *shard, cacheobj *obj)
+{
+    if (obj->freq < S3_MAXFREQ)
+        __atomic_add_fetch(&obj->freq, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * s3_insert - a new object goes to the small FIFO (list 0), unless its
+ * uri was evicted from there recently: then it goes to the main one.
+ * An object restored from a snapshot keeps its hits
+ */
+static void s3_insert(cacheshard *shard, cacheobj *obj)
+{
+    int i;
+
+    for (i = 0; i < GHOST_SIZE; i++) {
+        if (shard->ghost[i] == obj->hash) {
+            shard->ghost[i] = 0;
+            list_push(shard, 1, obj);
+            return;
+        }
+    }
+    list_push(shard, 0, obj);
+}
+
+/*
+ * s3_victim - evict from the small FIFO while it is over its share: an
+ * object hit often enough moves to the main FIFO, the others are evicted
+ * and remembered in the ghost list. Otherwise evict from the main FIFO,
+ * where a hit object gets another round with one hit less
+ */
+static cacheobj *s3_victim(cacheshard *shard)
+{
+    objlist *smallq = &shard->lists[0], *mainq = &shard->lists[1];
+    cacheobj *obj;
+
+    while (1) {
+        if (smallq->rear != NULL && (mainq->rear == NULL ||
+                    smallq->size > SHARD_SIZE * S3_SMALL / 100)) {
+            obj = smallq->rear;
+            if (obj->freq >= S3_PROMOTE) {
+                list_remove(shard, obj);
+                obj->freq = 0;
+                list_push(shard, 1, obj);
+                continue;
+            }
+            shard->ghost[shard->ghostpos] = obj->hash;
+            shard->ghostpos = (shard->ghostpos + 1) % GHOST_SIZE;
+            return obj;
+        }
+
+        if ((obj = mainq->rear) == NULL)
+            return NULL;
+        if (obj->freq == 0)
+            return obj;
+        obj->freq--;
+        list_remove(shard, obj);
+        list_push(shard, 1, obj);
+    }
+}
+
+/*
+ * lfu_init - allocate the sketch of the shard
+ */
+static void lfu_init(cacheshard *shard)
+{
+    shard->sketch = Calloc(SKETCH_DEPTH * SKETCH_WIDTH, 1);
+    shard->sketch_adds = 0;
+}
+
+/*
+ * lfu_access - count an access to the uri with this hash in the sketch
+ */
+static void lfu_access(cacheshard *shard, unsigned long long hash)
+{
+    unsigned char *counter;
+    int i;
+
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        counter = &shard->sketch[i * SKETCH_WIDTH +
+            ((hash >> (16 * i)) & (SKETCH_WIDTH - 1))];
+        if (*counter < SKETCH_MAX)
+            __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&shard->sketch_adds, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * lfu_insert - a new object goes to the head of the window (list 0). The
+ * sketch is aged here, under the writer lock, once enough accesses were
+ * counted
+ */
+static void lfu_insert(cacheshard *shard, cacheobj *obj)
+{
+    int i;
+
+    if (shard->sketch_adds >= SKETCH_SAMPLE) {
+        for (i = 0; i < SKETCH_DEPTH * SKETCH_WIDTH; i++)
+            shard->sketch[i] >>= 1;
+        shard->sketch_adds = 0;
+    }
+    list_push(shard, 0, obj);
+}
+
+/*
+ * lfu_victim - while the window is over its share its oldest object is
+ * the candidate: it enters the main list if it was accessed more often
+ * than the victim of the main list, which is then evicted, otherwise the
+ * candidate itself is evicted
+ */
+static cacheobj *lfu_victim(cacheshard *shard)
+{
+    objlist *window = &shard->lists[0], *mainq = &shard->lists[1];
+    cacheobj *cand, *victim;
+
+    while ((cand = window->rear) != NULL &&
+            window->size > SHARD_SIZE * LFU_WINDOW / 100) {
+        victim = mainq->rear;
+        if (victim != NULL && sketch_freq(shard, cand->hash) <=
+                sketch_freq(shard, victim->hash))
+            return cand;
+        list_remove(shard, cand);
+        list_push(shard, 1, cand);
+        if (victim != NULL)
+            return victim;
+    }
+    return (mainq->rear != NULL) ? mainq->rear : window->rear;
+}
+
+/*
+ * sketch_freq - the estimated number of accesses to the uri with this hash
+ */
+static int sketch_freq(cacheshard *shard, unsigned long long hash)
+{
+    int i, freq = SKETCH_MAX, c;
+
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        c = shard->sketch[i * SKETCH_WIDTH +
+            ((hash >> (16 * i)) & (SKETCH_WIDTH - 1))];
+        if (c < freq)
+            freq = c;
+    }
+    return freq;
+}
+
+/*
+ * gdsf_hit - count the hit and refresh the priority of obj
+ */
+static void gdsf_hit(cacheshard *shard, cacheobj *obj)
+{
+    if (obj->freq < GDSF_MAXFREQ)
+        obj->freq++;
+    gdsf_prio(shard, obj);
+    heap_up(shard, obj->heapidx);
+    heap_down(shard, obj->heapidx);
+}
+
+/*
+ * gdsf_insert - a new object counts as hit once, one restored from a
+ * snapshot keeps its hits
+ */
+static void gdsf_insert(cacheshard *shard, cacheobj *obj)
+{
+    if (obj->freq == 0)
+        obj->freq = 1;
+    gdsf_prio(shard, obj);
+    list_push(shard, 0, obj);
+
+    if (shard->heaplen == shard->heapcap) {
+        shard->heapcap = shard->heapcap ? 2 * shard->heapcap : CACHE_BUCKETS;
+        shard->heap = Realloc(shard->heap,
+                shard->heapcap * sizeof(cacheobj *));
+    }
+    heap_set(shard, shard->heaplen++, obj);
+    heap_up(shard, obj->heapidx);
+}
+
+/*
+ * gdsf_victim - the object of lowest priority, the top of the heap, which
+ * becomes the inflation of the shard. gdsf_remove() takes it off the heap
+ */
+static cacheobj *gdsf_victim(cacheshard *shard)
+{
+    cacheobj *victim;
+
+    if (shard->heaplen == 0)
+        return NULL;
+    victim = shard->heap[0];
+    shard->inflation = victim->prio;
+    return victim;
+}
+
+/*
+ * gdsf_remove - take obj off the heap: the last object of the heap takes
+ * its place and moves to where its priority belongs
+ */
+static void gdsf_remove(cacheshard *shard, cacheobj *obj)
+{
+    size_t i = obj->heapidx;
+    cacheobj *last = shard->heap[--shard->heaplen];
+
+    if (last != obj) {
+        heap_set(shard, i, last);
+        heap_up(shard, i);
+        heap_down(shard, last->heapidx);
+    }
+}
+
+/*
+ * gdsf_prio - the priority of obj: the inflation of its shard plus its
+ * hits times the cost of fetching it per byte
+ */
+static void gdsf_prio(cacheshard *shard, cacheobj *obj)
+{
+    double cost = obj->cost ? obj->cost : 1;
+
+    obj->prio = shard->inflation +
+        obj->freq * cost / (obj->content_size + obj->hdrlen);
+}
+
+/*
+ * heap_set - put obj at the place i of the heap of shard
+ */
+static void heap_set(cacheshard *shard, size_t i, cacheobj *obj)
+{
+    shard->heap[i] = obj;
+    obj->heapidx = i;
+}
+
+/*
+ * heap_up - move the object at the place i of the heap up while its
+ * priority is lower than the one of its parent
+ */
+static void heap_up(cacheshard *shard, size_t i)
+{
+    cacheobj *obj = shard->heap[i];
+
+    while (i > 0 && obj->prio < shard->heap[(i - 1) / 2]->prio) {
+        heap_set(shard, i, shard->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(shard, i, obj);
+}
+
+/*
+ * heap_down - move the object at the place i of the heap down while its
+ * priority is higher than the one of a child
+ */
+static void heap_down(cacheshard *shard, size_t i)
+{
+    cacheobj *obj = shard->heap[i];
+    size_t child;
+
+    while ((child = 2 * i + 1) < shard->heaplen) {
+        if (child + 1 < shard->heaplen &&
+                shard->heap[child + 1]->prio < shard->heap[child]->prio)
+            child++;
+        if (shard->heap[child]->prio >= obj->prio)
+            break;
+        heap_set(shard, i, shard->heap[child]);
+        i = child;
+    }
+    heap_set(shard, i, obj);
+}
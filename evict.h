@@ -0,0 +1,56 @@
+/*
+ * Author: shiweid
+ *
+ * evict.h include the eviction policies of the cache. A policy decides in
+ * which of the eviction lists of a shard an object goes, what a hit does
+ * and which object is evicted when the shard is full.
+ * lru      strict LRU, a hit moves the object to the head of the list
+ * clock    FIFO with a second chance, a hit only sets the reference bit
+ * s3fifo   a small FIFO for new objects, a main FIFO for the ones hit
+ *          again and a ghost list of the uris recently evicted from the
+ *          small one; a hit only counts
+ * tinylfu  a small LRU window and a main LRU; a count-min sketch of the
+ *          access frequencies decides whether the object leaving the
+ *          window may replace the victim of the main list
+ * gdsf     Greedy-Dual-Size-Frequency: the priority of an object is its
+ *          hits times its fetch cost over its size, plus the priority of
+ *          the last victim so old priorities age. The lowest is evicted,
+ *          a min-heap of the shard finds it in O(log n)
+ * The hooks are called with the writer lock of the shard held, except
+ * access() and the hit() of the policies without hitlock, which only
+ * have the reader lock. remove() tells a policy which keeps more than the
+ * lists that an object, evicted or not, leaves the shard.
+ */
+
+#ifndef __EVICT_H__
+#define __EVICT_H__
+
+#include "cache.h"
+
+#define S3_SMALL 10         /* percent of a shard for the small FIFO */
+#define S3_PROMOTE 2        /* hits in the small FIFO to enter the main one */
+#define S3_MAXFREQ 3
+#define LFU_WINDOW 1        /* percent of a shard for the window */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024   /* counters per row, a power of two */
+#define SKETCH_MAX 15
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)   /* accesses between agings */
+#define GDSF_MAXFREQ 255
+
+typedef struct cache_policy
+{
+    char *name;
+    int hitlock;   /* a hit changes the lists, it needs the writer lock */
+    void (*init)(cacheshard *shard);
+    void (*access)(cacheshard *shard, unsigned long long hash);
+    void (*hit)(cacheshard *shard, cacheobj *obj);
+    void (*insert)(cacheshard *shard, cacheobj *obj);
+    cacheobj *(*victim)(cacheshard *shard);
+    void (*remove)(cacheshard *shard, cacheobj *obj);
+}cachepolicy;
+
+cachepolicy *find_policy(char *name);
+void list_push(cacheshard *shard, int list, cacheobj *obj);
+void list_remove(cacheshard *shard, cacheobj *obj);
+
+#endif
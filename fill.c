@@ -0,0 +1,523 @@
+/*
+ * Author: shiweid
+ *
+ * fill.c include the in-flight responses of the cache, used to collapse
+ * concurrent misses on the same uri. See fill.h for the overview.
+ * The fills are indexed in the shard of their uri, under the shard lock.
+ * The content of a fill is protected by its own mutex.
+ */
+
+#define _GNU_SOURCE
+#include "fill.h"
+#include "disk.h"
+#include "fresh.h"
+#include "header.h"
+
+/* Static helper functions */
+static void fill_put(cachefill *fill);
+static fillwaiter *fill_notify(cachefill *fill);
+static void fill_wake(fillwaiter *w);
+static void fill_store(pxycache *Pxycache, cachefill *fill);
+static size_t fill_hdrs(cachefill *fill, char *data, size_t size);
+static void fill_content(cachefill *fill, char *data, size_t size);
+static void fill_chunk(void *arg, char *data, size_t size);
+static int fill_unchunk(cachefill *fill);
+static void fill_drop(cachefill *fill);
+
+/*
+ * fill_begin - join the in-flight response for uri, or start one.
+ * *leader is set to 1 if the caller must fetch the response and append it,
+ * to 0 if it is a follower and must read it with fill_read().
+ * Return NULL if a response too big to be cached is already being fetched,
+ * the caller then fetches on its own without a fill.
+ */
+cachefill *fill_begin(pxycache *Pxycache, char *uri, int *leader)
+{
+    unsigned long long hash = hash_uri(uri);
+    cacheshard *shard = SHARD(Pxycache, hash);
+    cachefill **bucket = &shard->inflight[hash & (FILL_BUCKETS - 1)];
+    cachefill *fill;
+
+    pthread_rwlock_wrlock(&(shard->lock));
+    for (fill = *bucket; fill != NULL; fill = fill->hnext) {
+        if (fill->hash == hash && strcmp(uri, fill->uri) == 0)
+            break;
+    }
+
+    if (fill != NULL) {
+        pthread_mutex_lock(&fill->lock);
+        if (fill->over) {
+            pthread_mutex_unlock(&fill->lock);
+            pthread_rwlock_unlock(&(shard->lock));
+            return NULL;
+        }
+        fill->nfollowers++;
+        fill->refcnt++;
+        pthread_mutex_unlock(&fill->lock);
+        pthread_rwlock_unlock(&(shard->lock));
+        *leader = 0;
+        return fill;
+    }
+
+    fill = Malloc(sizeof(cachefill));
+    fill->uri = Malloc(strlen(uri)+1);
+    strcpy(fill->uri, uri);
+    fill->hash = hash;
+    fill->hdrs = NULL;
+    fill->hdrlen = 0;
+    fill->hdrcap = 0;
+    fill->hdrdone = 0;
+    fill->expires = 0;
+    fill->swr = fill->sie = 0;
+    fill->born = 0;
+    fill->head = NULL;
+    fill->tail = NULL;
+    fill->size = 0;
+    fill->len = 0;
+    fill->chunked = 0;
+    fill->obj = NULL;
+    gettimeofday(&fill->start, NULL);
+    fill->state = FILL_BUSY;
+    fill->over = 0;
+    fill->released = 0;
+    fill->stream = 0;
+    fill->nfollowers = 0;
+    fill->refcnt = 1;
+    fill->waiters = NULL;
+    pthread_mutex_init(&fill->lock, NULL);
+    pthread_cond_init(&fill->cond, NULL);
+    fill->hnext = *bucket;
+    *bucket = fill;
+    pthread_rwlock_unlock(&(shard->lock));
+
+    *leader = 1;
+    return fill;
+}
+
+/*
+ * fill_append - the leader appends a chunk of the response.
+ * Once the response is too big to be cached it is not kept, its
+ * followers are released.
+ */
+void fill_append(cachefill *fill, char *data, size_t size)
+{
+    fillwaiter *w;
+    size_t n;
+
+    pthread_mutex_lock(&fill->lock);
+    if (!fill->over && fill->len + size > MAX_FILL_SIZE + disk_max_object()) {
+        /* It was not streamed, no follower has read any of it */
+        fill->over = 1;
+        fill->released = 1;
+    }
+
+    if (fill->over) {
+        fill_drop(fill);
+        w = fill_notify(fill);
+        pthread_mutex_unlock(&fill->lock);
+        fill_wake(w);
+        return;
+    }
+
+    if (!fill->hdrdone) {
+        n = fill_hdrs(fill, data, size);
+        data += n;
+        size -= n;
+    }
+    if (size > 0 && fill->chunked)
+        frame_decode(&fill->frame, data, size, fill_chunk, fill);
+    else if (size > 0)
+        fill_content(fill, data, size);
+    fill->len = fill->hdrlen + fill->size;
+    w = fill_notify(fill);
+    pthread_mutex_unlock(&fill->lock);
+
+    fill_wake(w);
+}
+
+/*
+ * fill_end - the leader is done: ok tells whether the whole response was
+ * received. A complete response small enough is stored into the cache
+ * before the fill is taken out of the in-flight index, so a new request
+ * for the uri finds one or the other.
+ */
+void fill_end(pxycache *Pxycache, cachefill *fill, int ok)
+{
+    cacheshard *shard = SHARD(Pxycache, fill->hash);
+    cachefill **pp = &shard->inflight[fill->hash & (FILL_BUCKETS - 1)];
+    fillwaiter *w;
+
+    if (ok && !fill->over) {
+        pthread_mutex_lock(&fill->lock);
+        ok = (fill_unchunk(fill) == 0);
+        pthread_mutex_unlock(&fill->lock);
+    }
+    if (ok && !fill->over)
+        fill_store(Pxycache, fill);
+
+    pthread_rwlock_wrlock(&(shard->lock));
+    while (*pp != NULL) {
+        if (*pp == fill) {
+            *pp = fill->hnext;
+            break;
+        }
+        pp = &(*pp)->hnext;
+    }
+    pthread_rwlock_unlock(&(shard->lock));
+
+    pthread_mutex_lock(&fill->lock);
+    fill->state = (ok ? FILL_DONE : FILL_FAILED);
+    w = fill_notify(fill);
+    pthread_mutex_unlock(&fill->lock);
+
+    fill_wake(w);
+    fill_put(fill);
+}
+
+/*
+ * fill_bypass - the leader appended the headers. If they tell the response
+ * will not be cached, the followers were released and the fill is ended,
+ * the leader forwards the rest on its own
+ * Return 0 if the fill was ended, -1 if the leader must go on appending
+ */
+int fill_bypass(pxycache *Pxycache, cachefill *fill)
+{
+    pthread_mutex_lock(&fill->lock);
+    if (!fill->released) {
+        pthread_mutex_unlock(&fill->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&fill->lock);
+
+    fill_end(Pxycache, fill, 0);
+    return 0;
+}
+
+/*
+ * fill_reuse - the leader revalidated the stale object obj instead of
+ * fetching the response: the followers are served obj, which needs no
+ * storing. The fill shares the content of obj and pins it
+ */
+void fill_reuse(pxycache *Pxycache, cachefill *fill, cacheobj *obj)
+{
+    pthread_mutex_lock(&fill->lock);
+    fill_drop(fill);
+    fill->hdrlen = obj->hdrlen;
+    fill->hdrcap = fill->hdrlen + 1;
+    fill->hdrs = Malloc(fill->hdrcap);
+    memcpy(fill->hdrs, obj->reshdrs, fill->hdrcap);
+    fill->hdrdone = 1;
+    fill->head = obj->content;
+    fill->size = obj->content_size;
+    fill->len = fill->hdrlen + fill->size;
+    __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+    fill->obj = obj;
+    fill->over = 1;   /* already cached */
+    pthread_mutex_unlock(&fill->lock);
+
+    fill_end(Pxycache, fill, 1);
+}
+
+/*
+ * fill_read - a follower copies up to size bytes of the response starting
+ * at off into buf. If no byte is there yet, it blocks when w is NULL,
+ * otherwise it registers w to be woken up when there is. Nothing is there
+ * before the headers are complete, nor before the whole response is when
+ * its length was not known to fit.
+ * Return the number of bytes copied, 0 at the end of the response,
+ * -1 if the leader failed, -2 if w was registered, FILL_ALONE if the
+ * follower must fetch the response on its own
+ */
+ssize_t fill_read(cachefill *fill, size_t off, char *buf, size_t size,
+        fillwaiter *w)
+{
+    ssize_t n;
+    objchunk *chunk;
+
+    pthread_mutex_lock(&fill->lock);
+    while (fill->state == FILL_BUSY && !fill->released &&
+            (!fill->stream || off >= fill->len)) {
+        if (w != NULL) {
+            w->next = fill->waiters;
+            fill->waiters = w;
+            pthread_mutex_unlock(&fill->lock);
+            return -2;
+        }
+        pthread_cond_wait(&fill->cond, &fill->lock);
+    }
+
+    if (fill->released)
+        n = FILL_ALONE;
+    else if (!fill->hdrdone || (!fill->stream && fill->state != FILL_DONE))
+        n = -1;
+    else if (off < fill->hdrlen) {
+        n = fill->hdrlen - off;
+        if (n > size)
+            n = size;
+        memcpy(buf, fill->hdrs + off, n);
+    }
+    else if (off < fill->len) {
+        off -= fill->hdrlen;
+        for (chunk = fill->head; off >= chunk->len; chunk = chunk->next)
+            off -= chunk->len;
+        n = chunk->len - off;
+        if (n > size)
+            n = size;
+        memcpy(buf, chunk->data + off, n);
+    }
+    else
+        n = (fill->state == FILL_DONE) ? 0 : -1;
+    pthread_mutex_unlock(&fill->lock);
+    return n;
+}
+
+/*
+ * fill_leave - a follower is done with the fill
+ */
+void fill_leave(cachefill *fill)
+{
+    pthread_mutex_lock(&fill->lock);
+    fill->nfollowers--;
+    pthread_mutex_unlock(&fill->lock);
+    fill_put(fill);
+}
+
+/*
+ * fill_put - drop a reference, free the fill with the last one
+ */
+static void fill_put(cachefill *fill)
+{
+    int refcnt;
+
+    pthread_mutex_lock(&fill->lock);
+    refcnt = --fill->refcnt;
+    pthread_mutex_unlock(&fill->lock);
+    if (refcnt > 0)
+        return;
+
+    pthread_mutex_destroy(&fill->lock);
+    pthread_cond_destroy(&fill->cond);
+    if (fill->obj != NULL) {   /* the object owns the content */
+        fill->head = NULL;
+        obj_read_done(fill->obj);
+    }
+    fill_drop(fill);
+    Free(fill->uri);
+    Free(fill);
+}
+
+/*
+ * fill_notify - wake up the blocking followers and take the list of the
+ * waiting ones, they are woken up once the lock is released
+ * Notice: the caller holds the lock of the fill
+ */
+static fillwaiter *fill_notify(cachefill *fill)
+{
+    fillwaiter *w = fill->waiters;
+
+    fill->waiters = NULL;
+    pthread_cond_broadcast(&fill->cond);
+    return w;
+}
+
+/*
+ * fill_wake - call the wake function of every waiter of the list
+ */
+static void fill_wake(fillwaiter *w)
+{
+    fillwaiter *next;
+
+    while (w != NULL) {
+        next = w->next;
+        w->wake(w);
+        w = next;
+    }
+}
+
+/*
+ * fill_store - store the complete response into the cache. The object
+ * takes over the content chunks, the fill pins it to keep serving its
+ * followers. The time the fetch took is the cost of the object.
+ * A response too big for the memory cache goes to the disk tier
+ */
+static void fill_store(pxycache *Pxycache, cachefill *fill)
+{
+    cacheobj *obj;
+    struct timeval now;
+    unsigned long cost;
+    freshinfo fi;
+
+    if (!fill->hdrdone)
+        return;
+    gettimeofday(&now, NULL);
+    cost = (now.tv_sec - fill->start.tv_sec) * 1000000UL +
+        now.tv_usec - fill->start.tv_usec;
+
+    if (fill->size > MAX_OBJECT_SIZE) {
+        fi.expires = fill->expires;
+        fi.born = fill->born;
+        fi.swr = fill->swr;
+        fi.sie = fill->sie;
+        disk_store(fill->uri, fill->hash, fill->hdrs, fill->hdrlen,
+                fill->head, fill->size, cost, &fi);
+        return;
+    }
+
+    obj = new_obj(fill->uri, fill->hdrs, fill->hdrlen, fill->head, fill->size);
+    obj->cost = cost;
+    obj->expires = fill->expires;
+    obj->swr = fill->swr;
+    obj->sie = fill->sie;
+    obj->born = fill->born;
+    obj->refcnt++;   /* the reference of the fill */
+    fill->obj = obj;
+    insert_object(Pxycache, obj);
+#ifdef DEBUG
+    check_cache(Pxycache);
+#endif
+}
+
+/*
+ * fill_hdrs - append the bytes of data up to the end of the headers to the
+ * headers, and note whether it is reached. Complete headers decide whether
+ * the response may be stored and until when it is fresh. If it may not,
+ * or its length tells it is too big, the followers are released
+ * Return the number of bytes taken
+ * Notice: the caller holds the lock of the fill
+ */
+static size_t fill_hdrs(cachefill *fill, char *data, size_t size)
+{
+    size_t from = (fill->hdrlen < 3) ? 0 : fill->hdrlen - 3;
+    size_t cap, n = size;
+    char *end;
+    freshinfo fi;
+
+    /* Keep room for the terminating NUL of the stored headers */
+    if (fill->hdrlen + size + 1 > fill->hdrcap) {
+        cap = (fill->hdrcap == 0) ? MAXLINE : fill->hdrcap;
+        while (cap < fill->hdrlen + size + 1)
+            cap *= 2;
+        fill->hdrs = Realloc(fill->hdrs, cap);
+        fill->hdrcap = cap;
+    }
+    memcpy(fill->hdrs + fill->hdrlen, data, size);
+
+    end = memmem(fill->hdrs + from, fill->hdrlen + size - from, "\r\n\r\n", 4);
+    if (end != NULL) {
+        n = end + 4 - (fill->hdrs + fill->hdrlen);
+        fill->hdrdone = 1;
+    }
+    fill->hdrlen += n;
+    fill->hdrs[fill->hdrlen] = '\0';
+
+    if (fill->hdrdone) {
+        if (fresh_parse(fill->hdrs, time(NULL), &fi) < 0) {
+            dbg_printf("The response must not be stored\n");
+            fill->over = 1;
+        }
+        fill->expires = fi.expires;
+        fill->swr = fi.swr;
+        fill->sie = fi.sie;
+        fill->born = fi.born;
+        frame_init(&fill->frame, fill->hdrs);
+        if (fill->frame.mode == FRAME_LENGTH && fill->hdrlen +
+                fill->frame.left > MAX_FILL_SIZE + disk_max_object())
+            fill->over = 1;
+        fill->released = fill->over;
+        fill->stream = (fill->frame.mode == FRAME_LENGTH && !fill->over);
+        fill->chunked = (fill->frame.mode == FRAME_CHUNKED);
+    }
+    return n;
+}
+
+/*
+ * fill_content - append data to the content chunks, the chunks double in
+ * size up to CHUNK_MAX
+ * Notice: the caller holds the lock of the fill
+ */
+static void fill_content(cachefill *fill, char *data, size_t size)
+{
+    objchunk *chunk = fill->tail;
+    size_t csize, n;
+
+    while (size > 0) {
+        if (chunk == NULL || chunk->len == chunk->cap) {
+            csize = CHUNK_MIN;
+            if (chunk != NULL)
+                csize = 2 * (sizeof(objchunk) + chunk->cap);
+            if (csize > CHUNK_MAX)
+                csize = CHUNK_MAX;
+            chunk = chunk_new(csize);
+            if (fill->tail == NULL)
+                fill->head = chunk;
+            else
+                fill->tail->next = chunk;
+            fill->tail = chunk;
+        }
+        n = chunk->cap - chunk->len;
+        if (n > size)
+            n = size;
+        memcpy(chunk->data + chunk->len, data, n);
+        chunk->len += n;
+        fill->size += n;
+        data += n;
+        size -= n;
+    }
+}
+
+/*
+ * fill_chunk - the sink the data of the chunks of a chunked content is
+ * decoded into
+ * Notice: the caller holds the lock of the fill
+ */
+static void fill_chunk(void *arg, char *data, size_t size)
+{
+    fill_content((cachefill *)arg, data, size);
+}
+
+/*
+ * fill_unchunk - the leader received the whole chunked content: make the
+ * headers tell its length instead, the content was collected decoded.
+ * Followers read nothing of a chunked response before it is complete
+ * Return 0 on success, -1 if the content did not end as chunked
+ * Notice: the caller holds the lock of the fill
+ */
+static int fill_unchunk(cachefill *fill)
+{
+    char clen[40];
+    size_t n;
+
+    if (!fill->chunked)
+        return 0;
+    if (fill->frame.mode != FRAME_CHUNKED || !fill->frame.done)
+        return -1;
+
+    header_strip(fill->hdrs, HDR_TRANSFER_ENCODING);
+    header_strip(fill->hdrs, HDR_CONTENT_LENGTH);
+    fill->hdrlen = strlen(fill->hdrs);
+    n = sprintf(clen, "Content-Length: %zu\r\n\r\n", fill->size);
+    if (fill->hdrlen - 2 + n + 1 > fill->hdrcap) {
+        fill->hdrcap = fill->hdrlen - 2 + n + 1;
+        fill->hdrs = Realloc(fill->hdrs, fill->hdrcap);
+    }
+    memcpy(fill->hdrs + fill->hdrlen - 2, clen, n + 1);
+    fill->hdrlen += n - 2;
+    fill->len = fill->hdrlen + fill->size;
+    fill->chunked = 0;
+    return 0;
+}
+
+/*
+ * fill_drop - free the response collected so far
+ * Notice: the caller holds the lock of the fill, or the last reference
+ */
+static void fill_drop(cachefill *fill)
+{
+    if (fill->hdrs != NULL)
+        Free(fill->hdrs);
+    chunks_free(fill->head);
+    fill->hdrs = NULL;
+    fill->hdrcap = 0;
+    fill->head = NULL;
+    fill->tail = NULL;
+}
@@ -0,0 +1,97 @@
+/*
+ * Author: shiweid
+ *
+ * fill.h include the in-flight responses of the cache, used to collapse
+ * concurrent misses on the same uri.
+ * The first miss becomes the leader: it fetches the response from the
+ * server and appends it to the fill as it streams in. Later misses on the
+ * same uri become followers and are served from the fill instead of
+ * contacting the server. When the response is complete the leader stores
+ * it into the cache. If the leader revalidates a stale object instead, the
+ * followers are served that object.
+ * The headers are collected in one buffer and the content in a list of
+ * chunks which becomes the content of the cache object as is. Followers
+ * get nothing before the headers are complete. If they tell that the
+ * response must not be stored (fresh.h) or is too big to be, the
+ * followers are released to fetch it on their own, and the leader leaves
+ * the fill and relays the rest without collecting it. A response whose
+ * length the headers do not tell is only read by the followers once it
+ * is complete: if it gets too big before, it is dropped at once and the
+ * followers, which have read nothing, are released. A chunked content is
+ * collected decoded, and once it is complete its Transfer-Encoding gives
+ * way to a Content-Length: the followers and the cache get a response any
+ * client can read. So a fill never holds
+ * more than MAX_FILL_SIZE and the biggest object of the disk tier.
+ * Followers on a worker thread block on the fill, followers driven by an
+ * event loop register a waiter whose wake function is called when more of
+ * the response is available.
+ */
+
+#ifndef __FILL_H__
+#define __FILL_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "frame.h"
+
+/* A response is collected while it is at most this big: the headers and
+ * the biggest object, plus the biggest one of the disk tier if there is
+ * one */
+#define MAX_FILL_SIZE (MAX_OBJECT_SIZE + MAXBUF)
+
+/* The state of a fill */
+#define FILL_BUSY   0   /* the leader is still fetching */
+#define FILL_DONE   1   /* the whole response is there */
+#define FILL_FAILED 2   /* the leader gave up */
+
+/* What fill_read() returns to a follower released by the leader */
+#define FILL_ALONE -3
+
+typedef struct fill_waiter
+{
+    void (*wake)(struct fill_waiter *w);
+    struct fill_waiter *next;
+}fillwaiter;
+
+typedef struct cache_fill
+{
+    char *uri;
+    unsigned long long hash;
+    char *hdrs;           /* the response headers received so far */
+    size_t hdrlen;
+    size_t hdrcap;
+    int hdrdone;          /* the blank line ending them was received */
+    time_t expires;       /* when the response goes stale */
+    long swr;             /* and how long it may be served stale after */
+    long sie;
+    time_t born;          /* when its age was 0 */
+    objchunk *head;       /* the content received so far */
+    objchunk *tail;
+    size_t size;          /* bytes of content */
+    size_t len;           /* bytes of the response, hdrlen + size */
+    frame frame;          /* the framing of the content */
+    int chunked;          /* it came chunked, it is collected decoded */
+    cacheobj *obj;        /* what the response was stored as, pinned */
+    struct timeval start; /* when the leader started fetching */
+    int state;
+    int over;             /* not to be cached, no new followers */
+    int released;         /* the followers fetch it on their own */
+    int stream;           /* its length fits, followers read it as it comes */
+    int nfollowers;       /* followers still reading */
+    int refcnt;           /* the leader and the followers */
+    fillwaiter *waiters;  /* event driven followers waiting for data */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;  /* blocking followers waiting for data */
+    struct cache_fill *hnext;   /* next fill in the same bucket */
+}cachefill;
+
+cachefill *fill_begin(pxycache *Pxycache, char *uri, int *leader);
+void fill_append(cachefill *fill, char *data, size_t size);
+void fill_end(pxycache *Pxycache, cachefill *fill, int ok);
+int fill_bypass(pxycache *Pxycache, cachefill *fill);
+void fill_reuse(pxycache *Pxycache, cachefill *fill, cacheobj *obj);
+ssize_t fill_read(cachefill *fill, size_t off, char *buf, size_t size,
+        fillwaiter *w);
+void fill_leave(cachefill *fill);
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Author: shiweid
+ *
+ * frame.c include the framing of the responses of the servers. See
+ * frame.h for the overview.
+ */
+
+#include "frame.h"
+#include "header.h"
+
+/* States of the chunked parser */
+#define CH_SIZE      0   /* in the hex size of a chunk */
+#define CH_EXT       1   /* in its extensions, up to the end of the line */
+#define CH_DATA      2   /* in its data */
+#define CH_DATA_END  3   /* in the line ending after the data */
+#define CH_TRAILER   4   /* at the start of a trailer line */
+#define CH_TRAILER_LINE 5    /* inside a trailer line */
+
+#define CHUNK_MAXSIZE (1LL << 40)   /* bigger chunk sizes are garbage */
+
+/* Static helper functions */
+static size_t frame_chunked(frame *fr, char *buf, size_t n, framesink sink,
+        void *arg);
+
+/*
+ * frame_init - set up fr for the response with the headers hdrs, NULL if
+ * they could not be read whole: the response then lasts until the server
+ * closes the connection
+ */
+void frame_init(frame *fr, char *hdrs)
+{
+    int status = (hdrs != NULL) ? header_status(hdrs) : -1;
+    long clen;
+    hdrfield f;
+
+    fr->mode = FRAME_CLOSE;
+    fr->keepalive = 0;
+    fr->done = 0;
+    fr->left = 0;
+    fr->chunkstate = CH_SIZE;
+    if (status < 200)   /* malformed, or an interim response */
+        return;
+
+    /* HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 only
+     * when told to */
+    fr->keepalive = (strncmp(hdrs, "HTTP/1.0", 8) != 0);
+    if (header_find(hdrs, HDR_CONNECTION, &f)) {
+        if (header_token(&f, "close"))
+            fr->keepalive = 0;
+        else if (header_token(&f, "keep-alive"))
+            fr->keepalive = 1;
+    }
+
+    if (status == 204 || status == 304) {
+        fr->mode = FRAME_NONE;
+        fr->done = 1;
+    }
+    else if (header_find(hdrs, HDR_TRANSFER_ENCODING, &f)) {
+        /* Only a chunked last coding delimits the content */
+        if (f.vallen >= 7 && strncasecmp(f.val + f.vallen - 7,
+                    "chunked", 7) == 0)
+            fr->mode = FRAME_CHUNKED;
+    }
+    else if ((clen = header_content_length(hdrs)) >= 0) {
+        fr->mode = FRAME_LENGTH;
+        fr->left = clen;
+        fr->done = (clen == 0);
+    }
+    if (fr->mode == FRAME_CLOSE)
+        fr->keepalive = 0;
+}
+
+/*
+ * frame_delimited - whether the end of the response with the headers hdrs
+ * is known without the connection being closed
+ */
+int frame_delimited(char *hdrs)
+{
+    frame fr;
+
+    frame_init(&fr, hdrs);
+    return fr.mode != FRAME_CLOSE;
+}
+
+/*
+ * frame_feed - feed the n bytes of content in buf to fr. Bytes after the
+ * end of the response are not part of it, the connection is then not
+ * kept: the server sent something it was not asked for. buf may be NULL
+ * for a content of known length, which is only counted
+ * Return how many of the n bytes belong to the response
+ */
+size_t frame_feed(frame *fr, char *buf, size_t n)
+{
+    return frame_decode(fr, buf, n, NULL, NULL);
+}
+
+/*
+ * frame_decode - frame_feed() which also hands the content in the n bytes
+ * of buf to sink, if not NULL, without the framing of the chunks
+ * Return how many of the n bytes belong to the response
+ */
+size_t frame_decode(frame *fr, char *buf, size_t n, framesink sink,
+        void *arg)
+{
+    size_t len = n;
+
+    if (fr->done)
+        len = 0;
+    else if (fr->mode == FRAME_LENGTH) {
+        if ((long long)len > fr->left)
+            len = fr->left;
+        fr->left -= len;
+        fr->done = (fr->left == 0);
+    }
+    else if (fr->mode == FRAME_CHUNKED) {
+        len = frame_chunked(fr, buf, n, sink, arg);
+        sink = NULL;   /* it had the data of the chunks */
+    }
+
+    if (sink != NULL && len > 0)
+        sink(arg, buf, len);
+    if (len < n)
+        fr->keepalive = 0;
+    return len;
+}
+
+/*
+ * frame_chunked - run the chunked parser over the n bytes of buf, handing
+ * the data of the chunks to sink if not NULL
+ * Return how many of them belong to the response
+ */
+static size_t frame_chunked(frame *fr, char *buf, size_t n, framesink sink,
+        void *arg)
+{
+    char *p = buf, *end = buf + n, *nl;
+    size_t len;
+    int c;
+
+    while (p < end && !fr->done) {
+        switch (fr->chunkstate) {
+        case CH_SIZE:
+            c = *p++;
+            if (isxdigit(c)) {
+                fr->left = fr->left * 16 + (isdigit(c) ? c - '0' :
+                        (c | 0x20) - 'a' + 10);
+                if (fr->left > CHUNK_MAXSIZE)
+                    goto bad;
+                break;
+            }
+            if (c != '\n') {
+                if (c != ';' && c != ' ' && c != '\t' && c != '\r')
+                    goto bad;
+                fr->chunkstate = CH_EXT;
+                break;
+            }
+            fr->chunkstate = (fr->left == 0) ? CH_TRAILER : CH_DATA;
+            break;
+
+        case CH_EXT:
+            if ((nl = memchr(p, '\n', end - p)) == NULL) {
+                p = end;
+                break;
+            }
+            p = nl + 1;
+            fr->chunkstate = (fr->left == 0) ? CH_TRAILER : CH_DATA;
+            break;
+
+        case CH_DATA:
+            len = end - p;
+            if ((long long)len > fr->left)
+                len = fr->left;
+            if (sink != NULL)
+                sink(arg, p, len);
+            p += len;
+            if ((fr->left -= len) == 0)
+                fr->chunkstate = CH_DATA_END;
+            break;
+
+        case CH_DATA_END:
+        case CH_TRAILER_LINE:
+            if ((nl = memchr(p, '\n', end - p)) == NULL) {
+                p = end;
+                break;
+            }
+            p = nl + 1;
+            fr->chunkstate = (fr->chunkstate == CH_DATA_END) ? CH_SIZE :
+                CH_TRAILER;
+            break;
+
+        case CH_TRAILER:   /* an empty line ends the response */
+            c = *p++;
+            if (c == '\n')
+                fr->done = 1;
+            else if (c != '\r')
+                fr->chunkstate = CH_TRAILER_LINE;
+            break;
+        }
+    }
+    return p - buf;
+
+bad:
+    /* Not chunked after all, it ends when the server closes */
+    fr->mode = FRAME_CLOSE;
+    fr->keepalive = 0;
+    return n;
+}
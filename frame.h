@@ -0,0 +1,45 @@
+/*
+ * Author: shiweid
+ *
+ * frame.h include the framing of the responses of the servers: where a
+ * response ends, so the connection it came on can carry the next one.
+ * The content of a response is delimited by its Content-Length, by the
+ * chunked transfer coding, or by the server closing the connection; 204
+ * and 304 responses have none. The bytes of the content are fed to the
+ * frame as they arrive and are relayed as they are, chunk sizes included.
+ * What the cache keeps of a chunked response is decoded: frame_decode()
+ * hands it the data of the chunks only.
+ * A connection is kept after the response only if the server did not ask
+ * to close it and the response ended where the framing said it would.
+ */
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include "csapp.h"
+
+/* How the end of a response is found */
+#define FRAME_NONE    0   /* it has no content */
+#define FRAME_LENGTH  1   /* its Content-Length */
+#define FRAME_CHUNKED 2   /* the last chunk and the trailers */
+#define FRAME_CLOSE   3   /* the server closes the connection */
+
+typedef struct frame
+{
+    int mode;
+    int keepalive;    /* the connection may carry another response */
+    int done;         /* the whole response was fed */
+    long long left;   /* bytes of content, or of the current chunk, to come */
+    int chunkstate;   /* where the chunked parser is */
+}frame;
+
+/* Takes the len bytes of content at data, out of what was fed */
+typedef void (*framesink)(void *arg, char *data, size_t len);
+
+void frame_init(frame *fr, char *hdrs);
+int frame_delimited(char *hdrs);
+size_t frame_feed(frame *fr, char *buf, size_t n);
+size_t frame_decode(frame *fr, char *buf, size_t n, framesink sink,
+        void *arg);
+
+#endif
@@ -0,0 +1,377 @@
+/*
+ * Author: shiweid
+ *
+ * fresh.c include the HTTP freshness model of the cache. See fresh.h for
+ * the overview.
+ * Header blocks are NUL terminated and start with the request or status
+ * line, every function skips that line.
+ */
+
+#define _GNU_SOURCE
+#include "fresh.h"
+#include "header.h"
+
+/* What the freshness of a response depends on */
+typedef struct fresh_hdrs
+{
+    int status;
+    int nostore;         /* no-store or private */
+    long maxage;         /* -1 when absent */
+    long smaxage;
+    long age;
+    long swr;            /* stale-while-revalidate, 0 when absent */
+    long sie;            /* stale-if-error */
+    int hasexpires;
+    time_t expires;      /* -1 when absent or invalid */
+    time_t date;
+    time_t lastmod;
+}freshhdrs;
+
+/* Time to live of the responses which do not say how long they are fresh */
+static int fresh_ttl = FRESH_TTL;
+
+/* Static helper functions */
+static void fresh_scan(char *hdrs, freshhdrs *h);
+static time_t fresh_expiry(freshhdrs *h, time_t now);
+static int fresh_find(char *hdrs, int id, char *val);
+static void fresh_copy(hdrfield *f, char *val);
+static void fresh_cc(char *val, freshhdrs *h);
+static int fresh_directive(char **s, char *name, long *arg);
+static int fresh_etag_match(char *list, char *etag);
+
+/*
+ * fresh_set_ttl - set the default time to live, in seconds
+ */
+void fresh_set_ttl(int ttl)
+{
+    fresh_ttl = ttl;
+}
+
+/*
+ * fresh_parse - parse the response headers hdrs, received at now, into fi
+ * Return 0 if the response may be stored, -1 otherwise
+ */
+int fresh_parse(char *hdrs, time_t now, freshinfo *fi)
+{
+    freshhdrs h;
+
+    fresh_scan(hdrs, &h);
+    fi->status = h.status;
+    fi->expires = now;
+    fi->swr = fi->sie = 0;
+    fi->born = now - h.age;
+    if (h.nostore || h.status != 200)
+        return -1;
+    fi->swr = h.swr;
+    fi->sie = h.sie;
+    fi->expires = fresh_expiry(&h, now);
+    return 0;
+}
+
+/*
+ * fresh_revalidate - the stored response headers were confirmed at now by
+ * a 304 with the headers notmod, which update them
+ * Return when the stored response goes stale again
+ */
+time_t fresh_revalidate(char *stored, char *notmod, time_t now)
+{
+    freshhdrs s, n;
+
+    fresh_scan(stored, &s);
+    fresh_scan(notmod, &n);
+    if (n.maxage >= 0 || n.smaxage >= 0) {
+        s.maxage = n.maxage;
+        s.smaxage = n.smaxage;
+    }
+    if (n.hasexpires) {
+        s.hasexpires = 1;
+        s.expires = n.expires;
+    }
+    if (n.lastmod >= 0)
+        s.lastmod = n.lastmod;
+    s.date = n.date;
+    s.age = n.age;
+    return fresh_expiry(&s, now);
+}
+
+/*
+ * fresh_condreq - make the request req to the server conditional on the
+ * validators of the stored response headers, and drop the conditions of
+ * the client: the cache answers those itself. req is at most MAXBUF bytes
+ * with its NUL
+ * Return 1 if the request was made conditional, 0 if stored is NULL or
+ * has no validator
+ */
+int fresh_condreq(char *req, char *stored)
+{
+    char etag[MAXLINE], lastmod[MAXLINE], cond[2 * MAXLINE + 64];
+    int condlen = 0;
+    size_t len;
+
+    header_strip(req, HDR_IF_NONE_MATCH);
+    header_strip(req, HDR_IF_MODIFIED_SINCE);
+    if (stored == NULL)
+        return 0;
+
+    if (fresh_find(stored, HDR_ETAG, etag))
+        condlen += sprintf(cond + condlen, "If-None-Match: %s\r\n", etag);
+    if (fresh_find(stored, HDR_LAST_MODIFIED, lastmod))
+        condlen += sprintf(cond + condlen, "If-Modified-Since: %s\r\n",
+                lastmod);
+    len = strlen(req);
+    if (condlen == 0 || len < 4 || len + condlen >= MAXBUF)
+        return 0;
+
+    /* Before the blank line ending the request */
+    memcpy(req + len - 2, cond, condlen);
+    memcpy(req + len - 2 + condlen, "\r\n", 3);
+    return 1;
+}
+
+/*
+ * fresh_notmodified - whether the conditions of the client request req
+ * hold for the stored response headers: its copy is still good
+ * Return 1 if the client should get a 304, 0 otherwise
+ */
+int fresh_notmodified(char *req, char *stored)
+{
+    char cond[MAXLINE], val[MAXLINE];
+    time_t since, lastmod;
+
+    if (fresh_find(req, HDR_IF_NONE_MATCH, cond))
+        return fresh_find(stored, HDR_ETAG, val) && fresh_etag_match(cond, val);
+    if (fresh_find(req, HDR_IF_MODIFIED_SINCE, cond) &&
+            fresh_find(stored, HDR_LAST_MODIFIED, val)) {
+        since = fresh_date(cond);
+        lastmod = fresh_date(val);
+        return since >= 0 && lastmod >= 0 && lastmod <= since;
+    }
+    return 0;
+}
+
+/*
+ * fresh_304 - build in buf, MAXBUF bytes, the 304 answering a conditional
+ * request for the stored response headers
+ * Return the length of the response
+ */
+int fresh_304(char *stored, char *buf)
+{
+    static int keep[] = { HDR_ETAG, HDR_LAST_MODIFIED, HDR_CACHE_CONTROL,
+        HDR_EXPIRES, HDR_VARY };
+    hdrfield f;
+    size_t i;
+    int len;
+
+    len = sprintf(buf, "HTTP/1.0 304 Not Modified\r\n");
+    for (i = 0; i < sizeof(keep) / sizeof(keep[0]); i++) {
+        if (header_find(stored, keep[i], &f) &&
+                len + f.namelen + f.vallen + 6 < MAXBUF)
+            len += sprintf(buf + len, "%.*s: %.*s\r\n", (int)f.namelen,
+                    f.name, (int)f.vallen, f.val);
+    }
+    len += sprintf(buf + len, "\r\n");
+    return len;
+}
+
+/*
+ * fresh_date - parse an HTTP date, such as "Sun, 06 Nov 1994 08:49:37 GMT"
+ * Return the time, -1 if it is not valid
+ */
+time_t fresh_date(char *s)
+{
+    struct tm tm;
+    char *end;
+
+    memset(&tm, 0, sizeof(tm));
+    if ((end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm)) == NULL ||
+            *end != '\0')
+        return -1;
+    return timegm(&tm);
+}
+
+/*
+ * fresh_scan - collect what the freshness of the response headers hdrs
+ * depends on into h
+ */
+static void fresh_scan(char *hdrs, freshhdrs *h)
+{
+    char val[MAXLINE];
+    char *pos = header_first(hdrs);
+    hdrfield f;
+
+    h->status = header_status(hdrs);
+    h->nostore = 0;
+    h->maxage = h->smaxage = -1;
+    h->age = 0;
+    h->swr = h->sie = 0;
+    h->hasexpires = 0;
+    h->expires = h->date = h->lastmod = -1;
+
+    while (header_next(&pos, &f)) {
+        switch (f.id) {
+        case HDR_CACHE_CONTROL:
+            fresh_copy(&f, val);
+            fresh_cc(val, h);
+            break;
+        case HDR_EXPIRES:
+            fresh_copy(&f, val);
+            h->hasexpires = 1;
+            h->expires = fresh_date(val);
+            break;
+        case HDR_DATE:
+            fresh_copy(&f, val);
+            h->date = fresh_date(val);
+            break;
+        case HDR_LAST_MODIFIED:
+            fresh_copy(&f, val);
+            h->lastmod = fresh_date(val);
+            break;
+        case HDR_AGE:
+            fresh_copy(&f, val);
+            h->age = atol(val);
+            break;
+        }
+    }
+}
+
+/*
+ * fresh_expiry - when a response with the headers h, received at now, goes
+ * stale
+ */
+static time_t fresh_expiry(freshhdrs *h, time_t now)
+{
+    time_t date = (h->date < 0) ? now : h->date;
+    long lifetime, age = h->age;
+
+    if (h->smaxage >= 0)
+        lifetime = h->smaxage;
+    else if (h->maxage >= 0)
+        lifetime = h->maxage;
+    else if (h->hasexpires)   /* an invalid date means already expired */
+        lifetime = (h->expires > date) ? h->expires - date : 0;
+    else if (h->lastmod >= 0 && h->lastmod < date) {
+        lifetime = (date - h->lastmod) / 10;
+        if (lifetime > FRESH_HEURISTIC_MAX)
+            lifetime = FRESH_HEURISTIC_MAX;
+    }
+    else
+        lifetime = fresh_ttl;
+
+    /* The response was already that old when it was received */
+    if (now - date > age)
+        age = now - date;
+    if (age < 0)
+        age = 0;
+    return now + lifetime - age;
+}
+
+/*
+ * fresh_find - copy the value of the header with the id id of hdrs into
+ * val, MAXLINE bytes
+ * Return 1 if there is one, 0 otherwise
+ */
+static int fresh_find(char *hdrs, int id, char *val)
+{
+    hdrfield f;
+
+    if (!header_find(hdrs, id, &f))
+        return 0;
+    fresh_copy(&f, val);
+    return 1;
+}
+
+/*
+ * fresh_copy - copy the value of the field f into val, MAXLINE bytes
+ */
+static void fresh_copy(hdrfield *f, char *val)
+{
+    size_t len = (f->vallen < MAXLINE) ? f->vallen : MAXLINE - 1;
+
+    memcpy(val, f->val, len);
+    val[len] = '\0';
+}
+
+/*
+ * fresh_cc - parse the directives of a Cache-Control header into h.
+ * no-cache makes the response stale at once, so it is revalidated before
+ * every use
+ */
+static void fresh_cc(char *val, freshhdrs *h)
+{
+    char *s = val;
+    long arg;
+
+    while (*s != '\0') {
+        if (fresh_directive(&s, "no-store", NULL) ||
+                fresh_directive(&s, "private", NULL))
+            h->nostore = 1;
+        else if (fresh_directive(&s, "no-cache", NULL))
+            h->maxage = h->smaxage = 0;
+        else if (fresh_directive(&s, "s-maxage", &arg))
+            h->smaxage = (h->smaxage == 0) ? 0 : arg;
+        else if (fresh_directive(&s, "max-age", &arg))
+            h->maxage = (h->maxage == 0) ? 0 : arg;
+        else if (fresh_directive(&s, "stale-while-revalidate", &arg))
+            h->swr = arg;
+        else if (fresh_directive(&s, "stale-if-error", &arg))
+            h->sie = arg;
+        else {   /* skip what the cache does not care about */
+            s += strcspn(s, ",");
+            if (*s == ',')
+                s++;
+        }
+    }
+}
+
+/*
+ * fresh_directive - if the directive at *s is name, move *s past it and
+ * its comma and parse its argument into arg when arg is not NULL
+ * Return 1 if it is name, 0 otherwise
+ */
+static int fresh_directive(char **s, char *name, long *arg)
+{
+    char *p = *s;
+    size_t n = strlen(name);
+
+    p += strspn(p, " \t");
+    if (strncasecmp(p, name, n) != 0 ||
+            (p[n] != '\0' && p[n] != ',' && p[n] != '=' && p[n] != ' '))
+        return 0;
+    p += n;
+    if (arg != NULL) {
+        *arg = (*p == '=') ? strtol(p + 1 + (p[1] == '"'), NULL, 10) : 0;
+        if (*arg < 0)
+            *arg = 0;
+    }
+    p += strcspn(p, ",");
+    if (*p == ',')
+        p++;
+    *s = p;
+    return 1;
+}
+
+/*
+ * fresh_etag_match - weak comparison of etag with the list of entity tags
+ * of an If-None-Match, "*" matches any
+ * Return 1 if one of them matches, 0 otherwise
+ */
+static int fresh_etag_match(char *list, char *etag)
+{
+    char *p = list;
+    size_t n;
+
+    if (strncmp(etag, "W/", 2) == 0)
+        etag += 2;
+    while (*p != '\0') {
+        p += strspn(p, " \t,");
+        if (*p == '*')
+            return 1;
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+        n = strcspn(p, " \t,");
+        if (n > 0 && n == strlen(etag) && strncmp(p, etag, n) == 0)
+            return 1;
+        p += n;
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Author: shiweid
+ *
+ * fresh.h include the HTTP freshness model of the cache.
+ * The headers of a response are parsed once, when they are complete, to
+ * decide whether it may be stored and until when it is fresh. Only 200
+ * responses without no-store or private are stored. The freshness lifetime
+ * comes from s-maxage, max-age, Expires minus Date, 10% of the time since
+ * Last-Modified, or the default TTL, in that order, minus the age the
+ * response already had.
+ * A stale object with an ETag or a Last-Modified is revalidated: the miss
+ * asks the server for it with If-None-Match / If-Modified-Since and a 304
+ * only refreshes its freshness. The conditional requests of the clients
+ * are answered by the cache with a 304 when its copy matches.
+ * Within stale-while-revalidate seconds of going stale an object is still
+ * served as a hit while it is refreshed in the background (refresh.h).
+ * Within stale-if-error seconds it is served when the server fails.
+ */
+
+#ifndef __FRESH_H__
+#define __FRESH_H__
+
+#include "csapp.h"
+#include <time.h>
+
+#define FRESH_TTL 300                 /* default TTL in seconds */
+#define FRESH_HEURISTIC_MAX 86400     /* cap of the Last-Modified heuristic */
+
+typedef struct fresh_info
+{
+    int status;          /* of the status line */
+    time_t expires;      /* when the response goes stale */
+    long swr;            /* seconds it may be served stale while refreshed */
+    long sie;            /* seconds it may be served stale on errors */
+    time_t born;         /* when its age was 0 */
+}freshinfo;
+
+void fresh_set_ttl(int ttl);
+int fresh_parse(char *hdrs, time_t now, freshinfo *fi);
+time_t fresh_revalidate(char *stored, char *notmod, time_t now);
+int fresh_condreq(char *req, char *stored);
+int fresh_notmodified(char *req, char *stored);
+int fresh_304(char *stored, char *buf);
+time_t fresh_date(char *s);
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * Author: shiweid
+ *
+ * hdrbuf.c include an append-only builder of header blocks. See hdrbuf.h
+ * for the overview.
+ */
+
+#include "hdrbuf.h"
+
+/*
+ * hdrbuf_init - start an empty block in buf, cap bytes
+ */
+void hdrbuf_init(hdrbuf *hb, char *buf, size_t cap)
+{
+    hb->buf = buf;
+    hb->len = 0;
+    hb->cap = cap;
+    hb->full = 0;
+    if (cap > 0)
+        buf[0] = '\0';
+}
+
+/*
+ * hdrbuf_add - append the n bytes of s to the block
+ */
+void hdrbuf_add(hdrbuf *hb, const char *s, size_t n)
+{
+    if (hb->full || hb->len + n + 1 > hb->cap) {
+        hb->full = 1;
+        return;
+    }
+    memcpy(hb->buf + hb->len, s, n);
+    hb->len += n;
+    hb->buf[hb->len] = '\0';
+}
+
+/*
+ * hdrbuf_adds - append the string s to the block
+ */
+void hdrbuf_adds(hdrbuf *hb, const char *s)
+{
+    hdrbuf_add(hb, s, strlen(s));
+}
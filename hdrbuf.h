@@ -0,0 +1,28 @@
+/*
+ * Author: shiweid
+ *
+ * hdrbuf.h include an append-only builder of header blocks.
+ * The block is written into a buffer the caller provides, one piece after
+ * the other, so building a request is a single linear pass without any
+ * allocation. The block is kept NUL terminated. A piece which does not fit
+ * marks the builder full, and the block is not to be used.
+ */
+
+#ifndef __HDRBUF_H__
+#define __HDRBUF_H__
+
+#include "csapp.h"
+
+typedef struct hdr_buf
+{
+    char *buf;
+    size_t len;       /* bytes written, without the NUL */
+    size_t cap;       /* size of buf, with the NUL */
+    int full;         /* a piece did not fit */
+}hdrbuf;
+
+void hdrbuf_init(hdrbuf *hb, char *buf, size_t cap);
+void hdrbuf_add(hdrbuf *hb, const char *s, size_t n);
+void hdrbuf_adds(hdrbuf *hb, const char *s);
+
+#endif
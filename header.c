@@ -0,0 +1,261 @@
+/*
+ * Author: shiweid
+ *
+ * header.c include the parser of HTTP header blocks. See header.h for the
+ * overview.
+ * Header blocks are NUL terminated and start with the request or status
+ * line, which header_first() skips.
+ */
+
+#include "header.h"
+
+typedef struct header_name
+{
+    const char *name;
+    size_t len;
+    int id;
+}hdrname;
+
+/* The slot of a name: its first and last letters, case folded, and its
+ * length. The multiplier was searched for offline so the known names
+ * never collide in 32 slots, header_check() makes sure they are where
+ * they hash to */
+#define HEADER_SLOTS 32
+#define HEADER_HASH(name, len) \
+    ((((unsigned char)(name)[0] | 0x20) + \
+      ((unsigned char)(name)[(len) - 1] | 0x20) * 23 + (len)) & \
+     (HEADER_SLOTS - 1))
+
+static const hdrname header_names[HEADER_SLOTS] = {
+    [1] = { "Expires", 7, HDR_EXPIRES },
+    [2] = { "Proxy-Connection", 16, HDR_PROXY_CONNECTION },
+    [4] = { "Cache-Control", 13, HDR_CACHE_CONTROL },
+    [6] = { "Transfer-Encoding", 17, HDR_TRANSFER_ENCODING },
+    [8] = { "Keep-Alive", 10, HDR_KEEP_ALIVE },
+    [9] = { "Content-Length", 14, HDR_CONTENT_LENGTH },
+    [10] = { "ETag", 4, HDR_ETAG },
+    [11] = { "User-Agent", 10, HDR_USER_AGENT },
+    [13] = { "If-Modified-Since", 17, HDR_IF_MODIFIED_SINCE },
+    [14] = { "If-None-Match", 13, HDR_IF_NONE_MATCH },
+    [15] = { "Connection", 10, HDR_CONNECTION },
+    [17] = { "Accept-Encoding", 15, HDR_ACCEPT_ENCODING },
+    [19] = { "Accept", 6, HDR_ACCEPT },
+    [21] = { "Last-Modified", 13, HDR_LAST_MODIFIED },
+    [23] = { "Age", 3, HDR_AGE },
+    [24] = { "Host", 4, HDR_HOST },
+    [25] = { "Vary", 4, HDR_VARY },
+    [27] = { "Date", 4, HDR_DATE },
+};
+
+/*
+ * header_check - check that every known name sits in the slot it hashes
+ * to, with its length, and that every id has one name
+ * Return 0 if so, -1 after printing what is wrong otherwise
+ */
+int header_check(void)
+{
+    int i, seen[HDR_IDS] = { 0 };
+    const hdrname *e;
+
+    for (i = 0; i < HEADER_SLOTS; i++) {
+        e = &header_names[i];
+        if (e->name == NULL)
+            continue;
+        if (e->len != strlen(e->name) || HEADER_HASH(e->name, e->len) != i ||
+                e->id <= HDR_OTHER || e->id >= HDR_IDS || seen[e->id]++) {
+            fprintf(stderr, "header %s is misplaced in slot %d\n", e->name,
+                    i);
+            return -1;
+        }
+    }
+    for (i = HDR_OTHER + 1; i < HDR_IDS; i++) {
+        if (!seen[i]) {
+            fprintf(stderr, "header id %d has no name\n", i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * header_id - the id of the header name of len bytes
+ * Return HDR_OTHER if the proxy does not know it
+ */
+int header_id(const char *name, size_t len)
+{
+    const hdrname *e;
+
+    if (len == 0)
+        return HDR_OTHER;
+    e = &header_names[HEADER_HASH(name, len)];
+    if (e->len == len && strncasecmp(name, e->name, len) == 0)
+        return e->id;
+    return HDR_OTHER;
+}
+
+/*
+ * header_parse - parse the header line of len bytes, with or without its
+ * line ending, into f
+ * Return 0 on success, -1 if it is the blank line ending the block
+ */
+int header_parse(char *line, size_t len, hdrfield *f)
+{
+    char *end = line + len, *colon, *p;
+
+    if (end > line && end[-1] == '\n')
+        end--;
+    if (end > line && end[-1] == '\r')
+        end--;
+    if (end == line)
+        return -1;
+
+    if ((colon = memchr(line, ':', end - line)) == NULL) {
+        f->id = HDR_OTHER;
+        f->name = line;
+        f->namelen = 0;
+        f->val = line;
+        f->vallen = end - line;
+        return 0;
+    }
+    f->name = line;
+    f->namelen = colon - line;
+    f->id = header_id(line, f->namelen);
+    for (p = colon + 1; p < end && (*p == ' ' || *p == '\t'); p++)
+        ;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    f->val = p;
+    f->vallen = end - p;
+    return 0;
+}
+
+/*
+ * header_first - the first field line of the block hdrs, after its start
+ * line
+ */
+char *header_first(char *hdrs)
+{
+    char *nl = strchr(hdrs, '\n');
+
+    return (nl != NULL) ? nl + 1 : hdrs + strlen(hdrs);
+}
+
+/*
+ * header_next - parse the field line at *pos into f and move *pos to the
+ * next one
+ * Return 1 on success, 0 at the end of the block
+ */
+int header_next(char **pos, hdrfield *f)
+{
+    char *line = *pos, *nl;
+    size_t len;
+
+    if (*line == '\0')
+        return 0;
+    nl = strchr(line, '\n');
+    len = (nl != NULL) ? (size_t)(nl + 1 - line) : strlen(line);
+    if (header_parse(line, len, f) < 0)
+        return 0;
+    *pos = line + len;
+    return 1;
+}
+
+/*
+ * header_find - the first field of hdrs with the id id, parsed into f
+ * Return 1 if there is one, 0 otherwise
+ */
+int header_find(char *hdrs, int id, hdrfield *f)
+{
+    char *pos = header_first(hdrs);
+
+    while (header_next(&pos, f)) {
+        if (f->id == id)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * header_token - whether the comma separated value of f has the token
+ */
+int header_token(hdrfield *f, char *token)
+{
+    char *p = f->val, *end = f->val + f->vallen, *q;
+    size_t n = strlen(token);
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        for (q = p; q < end && *q != ','; q++)
+            ;
+        while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+            q--;
+        if ((size_t)(q - p) == n && strncasecmp(p, token, n) == 0)
+            return 1;
+        while (p < end && *p != ',')
+            p++;
+    }
+    return 0;
+}
+
+/*
+ * header_strip - remove the fields of hdrs with the id id
+ */
+void header_strip(char *hdrs, int id)
+{
+    char *line = header_first(hdrs), *next = line;
+    hdrfield f;
+
+    while (header_next(&next, &f)) {
+        if (f.id == id) {
+            memmove(line, next, strlen(next) + 1);
+            next = line;
+        }
+        else
+            line = next;
+    }
+}
+
+/*
+ * header_status - the status code of the response headers hdrs
+ * Return -1 if the status line is malformed
+ */
+int header_status(char *hdrs)
+{
+    char *p = hdrs + 5;
+    int i, status = 0;
+
+    if (strncmp(hdrs, "HTTP/", 5) != 0)
+        return -1;
+    while (isdigit((unsigned char)*p) || *p == '.')
+        p++;
+    if (*p++ != ' ')
+        return -1;
+    for (i = 0; i < 3; i++, p++) {
+        if (!isdigit((unsigned char)*p))
+            return -1;
+        status = status * 10 + *p - '0';
+    }
+    return status;
+}
+
+/*
+ * header_content_length - the Content-Length of the response headers hdrs
+ * Return -1 if there is none or it is not valid
+ */
+long header_content_length(char *hdrs)
+{
+    hdrfield f;
+    long len = 0;
+    size_t i;
+
+    if (!header_find(hdrs, HDR_CONTENT_LENGTH, &f) || f.vallen == 0 ||
+            f.vallen > 18)
+        return -1;
+    for (i = 0; i < f.vallen; i++) {
+        if (!isdigit((unsigned char)f.val[i]))
+            return -1;
+        len = len * 10 + f.val[i] - '0';
+    }
+    return len;
+}
@@ -0,0 +1,61 @@
+/*
+ * Author: shiweid
+ *
+ * header.h include the parser of HTTP header blocks, shared by the request
+ * and the response paths.
+ * A block is walked line by line: the end of a line and the colon of a
+ * field are found with memchr()/strchr(), which the C library runs a word
+ * or a vector at a time. The name of a field is looked up case
+ * insensitively in a perfect hash of the names the proxy cares about, so
+ * callers switch on a small integer instead of comparing strings. Names
+ * and values are returned as views into the block, nothing is copied.
+ */
+
+#ifndef __HEADER_H__
+#define __HEADER_H__
+
+#include "csapp.h"
+
+/* The header names the proxy knows */
+#define HDR_OTHER              0
+#define HDR_HOST               1
+#define HDR_USER_AGENT         2
+#define HDR_ACCEPT             3
+#define HDR_ACCEPT_ENCODING    4
+#define HDR_CONNECTION         5
+#define HDR_PROXY_CONNECTION   6
+#define HDR_KEEP_ALIVE         7
+#define HDR_CONTENT_LENGTH     8
+#define HDR_TRANSFER_ENCODING  9
+#define HDR_CACHE_CONTROL      10
+#define HDR_EXPIRES            11
+#define HDR_DATE               12
+#define HDR_LAST_MODIFIED      13
+#define HDR_AGE                14
+#define HDR_ETAG               15
+#define HDR_VARY               16
+#define HDR_IF_NONE_MATCH      17
+#define HDR_IF_MODIFIED_SINCE  18
+#define HDR_IDS                19   /* the ids above, HDR_OTHER included */
+
+typedef struct header_field
+{
+    int id;           /* HDR_OTHER if the name is not known */
+    char *name;       /* without the colon, empty on a line without one */
+    size_t namelen;
+    char *val;        /* without the surrounding blanks */
+    size_t vallen;
+}hdrfield;
+
+int header_check(void);
+int header_id(const char *name, size_t len);
+int header_parse(char *line, size_t len, hdrfield *f);
+char *header_first(char *hdrs);
+int header_next(char **pos, hdrfield *f);
+int header_find(char *hdrs, int id, hdrfield *f);
+void header_strip(char *hdrs, int id);
+int header_token(hdrfield *f, char *token);
+int header_status(char *hdrs);
+long header_content_length(char *hdrs);
+
+#endif
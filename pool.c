@@ -0,0 +1,238 @@
+/*
+ * Author: shiweid
+ *
+ * pool.c include the pool of idle keep-alive connections to the servers.
+ * See pool.h for the overview.
+ */
+
+#define _GNU_SOURCE
+#include "pool.h"
+
+typedef struct pool_bucket
+{
+    poolconn *head;
+    pthread_mutex_t lock;
+}__attribute__((aligned(64))) poolbucket;
+
+static struct
+{
+    poolbucket buckets[POOL_BUCKETS];
+    int maxidle;          /* per server, 0 disables the pool */
+    unsigned long reused;
+    unsigned long dead;   /* failed the health check */
+    unsigned long expired;
+    unsigned long dropped;    /* the pool of the server was full */
+} pool = { .maxidle = POOL_MAX_IDLE };
+
+/* Static helper functions */
+static poolbucket *pool_bucket(char *host, int port);
+static int pool_expired(poolconn *pc, time_t now);
+static int pool_alive(int fd);
+static void *pool_thread(void *vargp);
+static void pool_sweep(poolbucket *b, time_t now);
+
+/*
+ * pool_init - set up the pool, keeping at most maxidle idle connections
+ * per server, 0 disables it, and start its sweeper
+ */
+void pool_init(int maxidle)
+{
+    pthread_t tid;
+    int i;
+
+    for (i = 0; i < POOL_BUCKETS; i++) {
+        pool.buckets[i].head = NULL;
+        pthread_mutex_init(&pool.buckets[i].lock, NULL);
+    }
+    pool.maxidle = maxidle;
+    if (maxidle > 0)
+        Pthread_create(&tid, NULL, pool_thread, NULL);
+}
+
+/*
+ * pool_enabled - whether connections to the servers are kept
+ */
+int pool_enabled(void)
+{
+    return pool.maxidle > 0;
+}
+
+/*
+ * pool_get - take an idle connection to host and port, whose socket has
+ * flags, out of the pool. born is set to when it was connected
+ * Return its descriptor, -1 if there is none
+ */
+int pool_get(char *host, int port, int flags, time_t *born)
+{
+    poolbucket *b = pool_bucket(host, port);
+    poolconn **pp, *pc;
+    time_t now = time(NULL);
+    int fd;
+
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        for (pp = &b->head; (pc = *pp) != NULL; ) {
+            if (pool_expired(pc, now)) {
+                *pp = pc->next;
+                Close(pc->fd);
+                Free(pc);
+                __atomic_add_fetch(&pool.expired, 1, __ATOMIC_RELAXED);
+            }
+            else if (pc->port == port && pc->flags == flags &&
+                    strcmp(pc->host, host) == 0)
+                break;
+            else
+                pp = &pc->next;
+        }
+        if (pc != NULL)
+            *pp = pc->next;
+        pthread_mutex_unlock(&b->lock);
+        if (pc == NULL)
+            return -1;
+
+        fd = pc->fd;
+        *born = pc->born;
+        Free(pc);
+        if (pool_alive(fd)) {
+            __atomic_add_fetch(&pool.reused, 1, __ATOMIC_RELAXED);
+            return fd;
+        }
+        Close(fd);
+        __atomic_add_fetch(&pool.dead, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * pool_put - put the connection fd to host and port, whose socket has
+ * flags and which was connected at born, in the pool. It is closed if it
+ * is too old or the pool of the server is full
+ */
+void pool_put(char *host, int port, int flags, int fd, time_t born)
+{
+    poolbucket *b = pool_bucket(host, port);
+    poolconn *pc, *p;
+    time_t now = time(NULL);
+    int n = 0;
+
+    if (pool.maxidle == 0 || now - born >= POOL_MAX_AGE) {
+        Close(fd);
+        return;
+    }
+    pc = Malloc(sizeof(poolconn) + strlen(host) + 1);
+    pc->fd = fd;
+    pc->port = port;
+    pc->flags = flags;
+    pc->born = born;
+    pc->idle = now;
+    strcpy(pc->host, host);
+
+    pthread_mutex_lock(&b->lock);
+    for (p = b->head; p != NULL; p = p->next) {
+        if (p->port == port && p->flags == flags &&
+                strcmp(p->host, host) == 0)
+            n++;
+    }
+    if (n < pool.maxidle) {
+        pc->next = b->head;
+        b->head = pc;
+        pc = NULL;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    if (pc != NULL) {
+        Close(fd);
+        Free(pc);
+        __atomic_add_fetch(&pool.dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * pool_stats - print the use of the pool to fp
+ */
+void pool_stats(FILE *fp)
+{
+    if (pool.maxidle > 0)
+        fprintf(fp, "pool: %lu reused, %lu dead, %lu expired, %lu dropped\n",
+                __atomic_load_n(&pool.reused, __ATOMIC_RELAXED),
+                __atomic_load_n(&pool.dead, __ATOMIC_RELAXED),
+                __atomic_load_n(&pool.expired, __ATOMIC_RELAXED),
+                __atomic_load_n(&pool.dropped, __ATOMIC_RELAXED));
+}
+
+/*
+ * pool_thread - close the expired connections of every bucket every
+ * POOL_SWEEP seconds
+ */
+static void *pool_thread(void *vargp)
+{
+    int i;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        sleep(POOL_SWEEP);
+        for (i = 0; i < POOL_BUCKETS; i++)
+            pool_sweep(&pool.buckets[i], time(NULL));
+    }
+    return NULL;
+}
+
+/*
+ * pool_sweep - close the connections of b expired at now, outside of its
+ * lock
+ */
+static void pool_sweep(poolbucket *b, time_t now)
+{
+    poolconn **pp, *pc, *expired = NULL;
+
+    pthread_mutex_lock(&b->lock);
+    for (pp = &b->head; (pc = *pp) != NULL; ) {
+        if (pool_expired(pc, now)) {
+            *pp = pc->next;
+            pc->next = expired;
+            expired = pc;
+        }
+        else
+            pp = &pc->next;
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    while ((pc = expired) != NULL) {
+        expired = pc->next;
+        Close(pc->fd);
+        Free(pc);
+        __atomic_add_fetch(&pool.expired, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * pool_bucket - the bucket of the connections to host and port
+ */
+static poolbucket *pool_bucket(char *host, int port)
+{
+    unsigned long h = 2166136261UL ^ port;
+
+    while (*host != '\0')
+        h = (h ^ (unsigned char)*host++) * 16777619UL;
+    return &pool.buckets[h % POOL_BUCKETS];
+}
+
+/*
+ * pool_expired - whether the idle connection pc is too old to use at now
+ */
+static int pool_expired(poolconn *pc, time_t now)
+{
+    return now - pc->idle >= POOL_IDLE_TIMEOUT ||
+        now - pc->born >= POOL_MAX_AGE;
+}
+
+/*
+ * pool_alive - whether the idle connection fd is still open and has
+ * nothing to read: the server has not closed it or sent anything
+ */
+static int pool_alive(int fd)
+{
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK);
+}
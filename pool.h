@@ -0,0 +1,49 @@
+/*
+ * Author: shiweid
+ *
+ * pool.h include the pool of idle keep-alive connections to the servers.
+ * A response whose framing (frame.h) left the connection reusable puts it
+ * back in the pool of its host and port instead of closing it, and the
+ * next miss on that server takes it and skips the DNS lookup and the TCP
+ * handshake. The pool of a server keeps at most its max-idle connections,
+ * the most recently used are taken first. A connection idle for longer
+ * than POOL_IDLE_TIMEOUT or open for longer than POOL_MAX_AGE is closed,
+ * so is one the server closed or wrote to while it was idle: a health
+ * check peeks at it before it is handed out. The expired connections are
+ * closed when their bucket is searched, and by a sweeper thread every
+ * POOL_SWEEP seconds, so servers which are not asked again do not keep
+ * them open.
+ * The pool is shared by every engine, blocking and non-blocking sockets
+ * are kept apart.
+ */
+
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+#include <time.h>
+
+#define POOL_BUCKETS 64
+#define POOL_MAX_IDLE 8           /* default idle connections per server */
+#define POOL_IDLE_TIMEOUT 15      /* seconds a connection may stay idle */
+#define POOL_MAX_AGE 120          /* seconds a connection may be used */
+#define POOL_SWEEP 5              /* seconds between two sweeps */
+
+typedef struct pool_conn
+{
+    int fd;
+    int port;
+    int flags;            /* SOCK_NONBLOCK or 0 */
+    time_t born;          /* when it was connected */
+    time_t idle;          /* since when it is in the pool */
+    struct pool_conn *next;
+    char host[];
+}poolconn;
+
+void pool_init(int maxidle);
+int pool_enabled(void);
+int pool_get(char *host, int port, int flags, time_t *born);
+void pool_put(char *host, int port, int flags, int fd, time_t born);
+void pool_stats(FILE *fp);
+
+#endif
@@ -1,46 +1,178 @@
+#define _GNU_SOURCE
 #include "csapp.h"
 #include "cache.h"
-
-
-#define S_PORT 80 /* Default server port*/ 
+#include "fill.h"
+#include "slab.h"
+#include "disk.h"
+#include "snap.h"
+#include "fresh.h"
+#include "refresh.h"
+#include "proxy.h"
+#include "hdrbuf.h"
+#include "header.h"
+#include "uri.h"
+#include "frame.h"
+#include "pool.h"
+#include "event.h"
+#include "sbuf.h"
+#include "uring.h"
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 
 static const char *user_agent = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *accepts = "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n";
 static const char *accept_encoding = "Accept-Encoding: gzip, deflate\r\n";
 static const char *connection = "Connection: close\r\n";
 static const char *proxy_connection = "Proxy-Connection: close\r\n";
+static const char *keep_alive = "Connection: keep-alive\r\n";
 
-void *task (void *vargp);
-void doproxy(int fd);
-void clienterror(int fd, char *cause, char *errnum,
-        char *shortmsg, char *longmsg);
-int read_requesthdrs(rio_t *rio, char *buf);
-void get_reshdrs(rio_t *server, char* reshdrs);
-int parse_uri(char *uri, char *furi, char *host);
+#define NWORKERS 16   /* Default number of worker threads */
+#define SBUFSIZE 256  /* Default number of queued connections */
+#define SPLICE_SIZE 65536   /* bytes moved per splice(), a pipe holds that */
+
+void *worker(void *vargp);
+void *reporter(void *vargp);
+void usage(char *prog);
+int doproxy(rio_t *rio, int *corked);
+int client_next(rio_t *rio, int *corked);
 void fwdreq2server(int server_fd, char *req);
 void fwdres2client(int client_fd, char *res, size_t size);
-void fwdobj2client(int client_fd, cacheobj *obj);
+int fwdobj2client(int client_fd, cacheobj *obj, int keepalive);
+int fwdiov2client(int client_fd, struct iovec *iov, int n);
+int fwdfill2client(int client_fd, cachefill *fill, char *uri);
+int fwddisk2client(int client_fd, diskref *ref, int keepalive);
+int fwdstale2client(int client_fd, cacheobj *stale, cachefill *fill,
+        int notmod, int keepalive);
+ssize_t fwdsplice2client(int client_fd, rio_t *server, size_t left);
 
-/* The cache */ 
-pxycache *Pxycache;
+/* The cache, its shards are cache line aligned so it is not malloced */ 
+static pxycache cache;
+pxycache *Pxycache = &cache;
+
+/* Connections accepted by main and waiting for a worker */
+sbuf_t sbuf;
+int threaded = 0;
+
+int client_idle = CLIENT_IDLE_TIMEOUT;
 
 int main(int argc, char **argv)
 {
-    int listenfd, port, clientlen;
+    int listenfd, connfd, port, clientlen, i;
+    int opt, nworkers = NWORKERS, qsize = SBUFSIZE;
+    int block = 0, interval = 0, percpu = 0, use_uring = 0;
+    char *policy = "lru", *diskpath = NULL, *snappath = NULL;
+    int snapint = 0, ttl = FRESH_TTL, nrefresh = REFRESH_THREADS, age = 0;
+    int maxidle = POOL_MAX_IDLE;
+    long disksize = DISK_SIZE;
     struct sockaddr_in clientaddr;
     pthread_t tid;
 
-    /* Init the cache */ 
-    Pxycache = Malloc(sizeof(pxycache));
-    init_cache(Pxycache);
-
     Signal(SIGPIPE, SIG_IGN);
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "tw:q:brus:e:d:D:p:P:T:R:ak:i:")) != -1) {
+        switch (opt) {
+        case 't': /* worker threads instead of the event loop */
+            threaded = 1;
+            break;
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'q':
+            qsize = atoi(optarg);
+            break;
+        case 'b': /* wait for a free slot instead of answering 503 */
+            block = 1;
+            break;
+        case 'r': /* one event loop and listener per CPU */
+            percpu = 1;
+            break;
+        case 'u': /* io_uring engine, epoll if it is not available */
+            use_uring = 1;
+            break;
+        case 's':
+            interval = atoi(optarg);
+            break;
+        case 'e': /* eviction policy of the cache */
+            policy = optarg;
+            break;
+        case 'd': /* file of the disk tier */
+            diskpath = optarg;
+            break;
+        case 'D':
+            disksize = atol(optarg);
+            break;
+        case 'p': /* snapshot of the cache kept across restarts */
+            snappath = optarg;
+            break;
+        case 'P':
+            snapint = atoi(optarg);
+            break;
+        case 'T': /* freshness of responses which do not tell */
+            ttl = atoi(optarg);
+            break;
+        case 'R': /* threads refreshing stale objects in the background */
+            nrefresh = atoi(optarg);
+            break;
+        case 'a': /* an Age header on the hits */
+            age = 1;
+            break;
+        case 'k': /* idle connections kept per server */
+            maxidle = atoi(optarg);
+            break;
+        case 'i': /* keep-alive timeout of the client connections */
+            client_idle = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || nworkers <= 0 || qsize <= 0 || interval < 0 ||
+            disksize <= 0 || snapint < 0 || ttl < 0 || nrefresh < 0 ||
+            maxidle < 0 || client_idle < 0 ||
+            ((percpu || use_uring) && threaded))
+        usage(argv[0]);
+    port = atoi(argv[optind]);
+
+    /* Every header is classified through the table of known names */
+    if (header_check() < 0)
         exit(1);
+
+    /* Init the cache */ 
+    if (init_cache(Pxycache, policy) < 0)
+        usage(argv[0]);
+    fresh_set_ttl(ttl);
+    cache_set_age(age);
+    if (diskpath != NULL && disk_init(diskpath, (size_t)disksize << 20) < 0)
+        usage(argv[0]);
+
+    /* Warm up from the snapshot of the last run. The snapshot thread must
+     * be the first one so the others block SIGTERM */
+    if (snappath != NULL) {
+        snap_load(snappath);
+        snap_start(Pxycache, snappath, snapint);
+    }
+
+    pool_init(maxidle);
+    refresh_init(Pxycache, nrefresh);
+
+    /* Prethreaded: a fixed pool of workers serves the accepted
+     * connections through the bounded buffer */
+    if (threaded) {
+        sbuf_init(&sbuf, qsize);
+        for (i = 0; i < nworkers; i++)
+            Pthread_create(&tid, NULL, worker, NULL);
+    }
+
+    if (interval > 0)
+        Pthread_create(&tid, NULL, reporter, (void *)(long)interval);
+
+    if (percpu) {
+        if (event_loop_percpu(port, use_uring) < 0)
+            fprintf(stderr, "The port may be unavalible\n");
+        return 0;
     }
-    port = atoi(argv[1]);
 
     listenfd = Open_listenfd(port);
     if (listenfd == -1) {
@@ -48,270 +180,882 @@ int main(int argc, char **argv)
        return 0;
     }
 
+    if (!threaded) {
+        if (!use_uring || uring_loop(listenfd) < 0)
+            event_loop(listenfd);
+        return 0;
+    }
+
     while (1) {
-        int *connfdp;
-        connfdp = Malloc(sizeof(int));
         clientlen = sizeof(clientaddr);
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-        Pthread_create(&tid, NULL, (void *)task, (void *)connfdp);
+        connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
+        if (connfd < 0)
+            continue;
+        if (block)
+            sbuf_insert(&sbuf, connfd);
+        else if (sbuf_tryinsert(&sbuf, connfd) < 0) {
+            clienterror(connfd, "", "503", "Service Unavailable",
+                    "The proxy is overloaded, try again later");
+            Close(connfd);
+        }
     }
 
     return 0;
 }
 
 /*
- * task - the job function for multithreads
+ * usage - print the command line options and exit
+ */
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-r] [-u] [-t [-w workers] [-q queue] [-b]] "
+            "[-s secs] [-e policy] [-d file [-D MB]]\n"
+            "       [-p file [-P secs]] [-T secs] [-R threads] [-a] [-k idle] "
+            "[-i secs]\n       <port>\n", prog);
+    fprintf(stderr, "  -r  one event loop per CPU, each with its own "
+            "SO_REUSEPORT listener\n");
+    fprintf(stderr, "  -u  io_uring instead of epoll when the kernel has it\n");
+    fprintf(stderr, "  -t  serve connections with a pool of worker threads\n");
+    fprintf(stderr, "  -w  number of worker threads (default %d)\n", NWORKERS);
+    fprintf(stderr, "  -q  connections queued for the workers (default %d)\n",
+            SBUFSIZE);
+    fprintf(stderr, "  -b  wait when the queue is full instead of answering 503\n");
+    fprintf(stderr, "  -s  print statistics every secs seconds\n");
+    fprintf(stderr, "  -e  cache eviction policy: lru (default), clock, "
+            "s3fifo, tinylfu or gdsf\n");
+    fprintf(stderr, "  -d  file of the disk tier behind the cache, recreated\n");
+    fprintf(stderr, "  -D  size of the disk tier in MB (default %d)\n",
+            DISK_SIZE);
+    fprintf(stderr, "  -p  snapshot of the cache, loaded at startup and "
+            "saved on SIGTERM\n");
+    fprintf(stderr, "  -P  also save the snapshot every secs seconds\n");
+    fprintf(stderr, "  -T  seconds a response without freshness information "
+            "stays fresh\n      (default %d)\n", FRESH_TTL);
+    fprintf(stderr, "  -R  threads refreshing stale objects in the background "
+            "(default %d)\n", REFRESH_THREADS);
+    fprintf(stderr, "  -a  add an Age header to the responses served from "
+            "the cache\n");
+    fprintf(stderr, "  -k  idle keep-alive connections kept per server, 0 "
+            "closes them\n      (default %d)\n", POOL_MAX_IDLE);
+    fprintf(stderr, "  -i  seconds a client connection waits for its next "
+            "request, 0 closes\n      it after each response (default %d)\n",
+            CLIENT_IDLE_TIMEOUT);
+    exit(1);
+}
+
+/*
+ * worker - the job function for the worker threads, which serve the
+ * requests of a connection until the client closes it or goes idle
+ */
+void *worker(void *vargp)
+{
+    rio_t rio;
+    int connfd, corked;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        connfd = sbuf_remove(&sbuf);
+        client_nodelay(connfd);
+        Rio_readinitb(&rio, connfd);
+        corked = 0;
+        while (doproxy(&rio, &corked) && client_next(&rio, &corked))
+            ;
+        Close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * client_next - wait for the next request of the client of rio, at most
+ * client_idle seconds. The responses to the pipelined requests already in
+ * rio are held back by corked, so they leave in full segments, until
+ * there are none left
+ * Return 1 if there is a request to read, 0 if the client closed the
+ * connection or stayed idle
+ */
+int client_next(rio_t *rio, int *corked)
+{
+    struct pollfd pfd;
+    int rc;
+
+    if (client_pipelined(rio)) {
+        client_cork(rio->rio_fd, corked, 1);
+        return 1;
+    }
+    client_cork(rio->rio_fd, corked, 0);
+    if (rio->rio_cnt > 0)
+        return 1;
+
+    pfd.fd = rio->rio_fd;
+    pfd.events = POLLIN;
+    while ((rc = poll(&pfd, 1, client_idle * 1000)) < 0 && errno == EINTR)
+        ;
+    return rc > 0;
+}
+
+/*
+ * reporter - print the statistics of the proxy periodically
  */
-void *task (void *vargp) {
-    int connfd = *((int *)vargp);
+void *reporter(void *vargp)
+{
+    int interval = (int)(long)vargp;
+
     Pthread_detach(pthread_self());
-    Free(vargp);
-    doproxy(connfd);
-    Close(connfd);
+    while (1) {
+        sleep(interval);
+        if (threaded)
+            sbuf_stats(&sbuf, stdout);
+        printf("cache: %lu bytes\n", (unsigned long)cache_size(Pxycache));
+        slab_stats(stdout);
+        disk_stats(stdout);
+        snap_stats(stdout);
+        refresh_stats(stdout);
+        pool_stats(stdout);
+        fflush(stdout);
+    }
     return NULL;
 }
 
 /*
- * doproxy - handle the proxy operations for a client 
- * No cache version:
+ * doproxy - handle the proxy operations for a request of the client of
+ * rio_client
  * 1. Get HTTP request and header information from client
- * 2. Forward the request and header information to the server
- * 3. Get response from server and forward it back to client
+ * 2. Serve the object from the cache if it is there
+ * 3. Otherwise forward the request to the server, get the response,
+ *    forward it back to client and try to cache it
+ * The responses to pipelined requests are held back by corked until a
+ * request has to wait for the server
+ * Return 1 if the client may send another request on the connection
  */
-void doproxy(int clientfd)
+int doproxy(rio_t *rio_client, int *corked)
 {
-    int hdr_res, port;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], protocal[MAXLINE];
-    char furi[MAXLINE]; /* Formated URI */ 
+    int clientfd = rio_client->rio_fd;
+    int port;
+    char method[MAXLINE], uri[MAXLINE];
     char host[MAXLINE];
-    char req[MAXBUF], resbuf[MAXBUF], reqbuf[MAXBUF];
+    char req[MAXBUF], resbuf[MAXBUF];
     char res[MAXBUF];
     int p2s;  /* fd from proxy to server*/ 
     ssize_t size;
-    rio_t rio_client, rio_server;
-    char *original_uri;
+    size_t hdrlen;
+    cachefill *fill;
+    int leader, notmod, status, keepalive;
+    time_t born;
+    frame fr;
+    diskref dref;
+    rio_t rio_server;
 
     /* Get HTTP request and header information from client */
-    Rio_readinitb(&rio_client, clientfd);
-    if (Rio_readlineb(&rio_client, buf, MAXLINE) < 0) {
-        return;
-    }
-
-    if (sscanf(buf, "%s %s %s", method, uri, protocal) != 3)
-        return;
-
-    if (strcasecmp(method, "GET") != 0) {
+    switch (parse_request(rio_client, method, uri, req, host, &port,
+                &keepalive)) {
+    case -1:
+        return 0;
+    case -2:
         clienterror(clientfd, method, "501", "Not Implemented",
                 "Proxy does not support method other than GET");
-        return;
+        return 0;
+    case -3:
+        clienterror(clientfd, "", "400", "Bad Request",
+                "The request header is too large");
+        return 0;
     }
+    dbg_printf("The request to the server is \r\n%s", req);
 
-    hdr_res = read_requesthdrs(&rio_client, reqbuf);
-    if (hdr_res == -1) {
-        return;
+    cacheobj *obj, *stale;
+
+    /* If the requested object was cached, forward the object to client,
+     * or a 304 if the copy of the client is still good */
+    if ((obj = get_obj_from_cache(Pxycache, uri, &stale)) != NULL) {
+        dbg_printf("--------Cache hit--------\n");
+        if (fresh_notmodified(req, obj->reshdrs))
+            fwdres2client(clientfd, res, client_304(obj->reshdrs, res,
+                        &keepalive));
+        else
+            keepalive = fwdobj2client(clientfd, obj, keepalive);
+        obj_read_done(obj);
+        return keepalive;
+    }
+    if (disk_lookup(uri, hash_uri(uri), &dref, 0) == 0) {
+        dbg_printf("--------Disk hit--------\n");
+        if (stale != NULL)
+            obj_read_done(stale);
+        keepalive = fwddisk2client(clientfd, &dref, keepalive);
+        disk_read_done(&dref);
+        return keepalive;
     }
 
-    /* Forward the HTTP request to the server */
-    port = parse_uri(uri, furi, host);
-    port = ((port == 0) ? S_PORT:port);
-    if (!hdr_res) {
-        sprintf(req, "Host %s\r\n%s", host, reqbuf);
-        sprintf(reqbuf, "%s", req);
+    /* If the object was not cached, send the request to server and try to
+     * cache the object. What was held back for the client goes first */
+    dbg_printf("++++++++Cache miss+++++++\n");
+    client_cork(clientfd, corked, 0);
+    fill = fill_begin(Pxycache, uri, &leader);
+    if (fill != NULL && !leader) {
+        /* Another request is fetching it, forward its response unless it
+         * will not be cached */
+        dbg_printf("Following the fetch in flight\n");
+        if (fwdfill2client(clientfd, fill, uri) == 0) {
+            fill_leave(fill);
+            if (stale != NULL)
+                obj_read_done(stale);
+            return 0;
+        }
+        fill_leave(fill);
+        fill = NULL;
     }
-    sprintf(req, "GET %s HTTP/1.0\r\n%s", furi, reqbuf);
-    dbg_printf("The request to the server is \r\n%s", req);
 
-    /* If the requested object was cached, forward the object to client*/
-    cacheobj *obj;
-    if ((obj = get_obj_from_cache(Pxycache, uri)) != NULL) {
-        dbg_printf("--------Cache hit--------\n");
-        fwdobj2client(clientfd, obj);
-        obj_read_done(Pxycache);
+    /* A stale copy with validators is revalidated, one allowed to be
+     * served on errors is kept in case the server fails */
+    notmod = (stale != NULL && fresh_notmodified(req, stale->reshdrs));
+    if (!fresh_condreq(req, (stale != NULL) ? stale->reshdrs : NULL) &&
+            stale != NULL && !OBJ_SIE(stale, time(NULL))) {
+        obj_read_done(stale);
+        stale = NULL;
     }
-    else {
-        /* If the object was not cached, send the request to server and try to
-         * cache the object */
-        dbg_printf("++++++++Cache miss+++++++\n");
-        p2s = Open_clientfd(host, port);
-
-        if (p2s == -1) { 
-            clienterror(clientfd, host, "400", "Bad Request",
-                    "The host name or port number maybe invalid");
-            return;
+    p2s = server_request(host, port, req, &rio_server, res, &born);
+
+    if (p2s == -1) { 
+        if (stale != NULL) {
+            dbg_printf("Serving the stale object on error\n");
+            return fwdstale2client(clientfd, stale, fill, notmod, keepalive);
+        }
+        if (fill != NULL)
+            fill_end(Pxycache, fill, 0);
+        if (disk_lookup(uri, hash_uri(uri), &dref, 1) == 0) {
+            dbg_printf("Serving the stale disk object on error\n");
+            keepalive = fwddisk2client(clientfd, &dref, keepalive);
+            disk_read_done(&dref);
+            return keepalive;
         }
-        fwdreq2server(p2s, req);
-
-        /* Get feed back from server */
-        Rio_readinitb(&rio_server, p2s);
-
-        /* Read the response from the server, parse the response header, create the cache obj
-         * and store the object to Pxycache */ 
-        get_reshdrs(&rio_server, res);
-        fwdres2client(clientfd, res, strlen(res));
-        char *reshdrs;
-        reshdrs = Malloc(strlen(res)+1);
-        strcpy(reshdrs, res);
-        char content[MAX_OBJECT_SIZE];
-        
-        size_t tmp_size = 0;
-        while((size = Rio_readnb(&rio_server, resbuf, MAXBUF)) > 0) {
-            if (size < 0)
-                return;
-            fwdres2client(clientfd, resbuf, size);
-            tmp_size += size;
-            if (tmp_size <= MAX_OBJECT_SIZE)
-                memcpy((char *)(content + tmp_size - size), resbuf, size);
-            memset(resbuf, 0, MAXBUF);
+        clienterror(clientfd, host, "400", "Bad Request",
+                "The host name or port number maybe invalid");
+        return 0;
+    }
+
+    /* Forward the response to the client and to the fill, which stores
+     * it to Pxycache once complete. The connection to the server is kept
+     * if the framing of the response allows, the one to the client if it
+     * also ends where its framing says */ 
+    status = header_status(res);
+    frame_init(&fr, res);
+    if (stale != NULL && (status == 304 || ((status < 0 ||
+                        status >= 500) && OBJ_SIE(stale, time(NULL))))) {
+        if (status == 304) {
+            dbg_printf("Revalidated the stale object\n");
+            obj_refresh(stale, fresh_revalidate(stale->reshdrs, res,
+                        time(NULL)));
         }
+        keepalive = fwdstale2client(clientfd, stale, fill, notmod,
+                keepalive);
+        server_release(p2s, host, port, born, &fr, &rio_server);
+        return keepalive;
+    }
+    if (stale != NULL)
+        obj_read_done(stale);
+    else if ((status < 0 || status >= 500) &&
+            disk_lookup(uri, hash_uri(uri), &dref, 1) == 0) {
+        dbg_printf("Serving the stale disk object on error\n");
+        if (fill != NULL)
+            fill_end(Pxycache, fill, 0);
+        keepalive = fwddisk2client(clientfd, &dref, keepalive);
+        disk_read_done(&dref);
+        server_release(p2s, host, port, born, &fr, &rio_server);
+        return keepalive;
+    }
 
-        /* store the original_uri*/ 
-        original_uri = Malloc(strlen(uri)+1);
-        strcpy(original_uri, uri);
+    hdrlen = strlen(res);
+    if (fill != NULL)
+        fill_append(fill, res, hdrlen);
+    fwdres2client(clientfd, res, client_reshdrs(res, hdrlen, hdrlen, MAXBUF,
+                &keepalive));
 
-        cacheobj *tmp_obj;
-        tmp_obj = Malloc(sizeof(cacheobj));
-        init_obj(tmp_obj, original_uri, content, tmp_size, reshdrs);
-        insert_object(Pxycache, tmp_obj);
-#ifdef DEBUG
-        check_cache(Pxycache);
-#endif
-        Close(p2s);
+    /* A content of known length which will not be cached goes from
+     * the server to the client without being copied. The connection to
+     * the server is dropped if the client went away meanwhile */
+    if (fr.mode == FRAME_LENGTH && (fill == NULL ||
+                fill_bypass(Pxycache, fill) == 0)) {
+        if ((size = fwdsplice2client(clientfd, &rio_server, fr.left)) < 0)
+            keepalive = 0;
+        else
+            frame_feed(&fr, NULL, size);
+        server_release(p2s, host, port, born, &fr, &rio_server);
+        return keepalive && fr.done;
     }
-    return;
+
+    size = 0;
+    while (!fr.done &&
+            (size = Rio_readsomeb(&rio_server, resbuf, MAXBUF)) > 0) {
+        size = frame_feed(&fr, resbuf, size);
+        fwdres2client(clientfd, resbuf, size);
+        if (fill != NULL)
+            fill_append(fill, resbuf, size);
+    }
+
+    if (fill != NULL)
+        fill_end(Pxycache, fill, fr.done ||
+                (fr.mode == FRAME_CLOSE && size == 0));
+    server_release(p2s, host, port, born, &fr, &rio_server);
+    return keepalive && fr.done;
 }
 
 /*
- * read_requesthdrs - read the header from client rio and then
- * store in req a new request header which will be forward to server later
- * Return 0 if the original header does not contain a Host
- * Return 1 otherwise on success
- * Return -1 on error
+ * parse_request - read the request line and headers from the client rio,
+ * and build in req, MAXBUF bytes, the request which will be forwarded to
+ * the server, in one pass. The method of the request line is stored in
+ * method, the cache key of its uri (uri.h) in uri, the server to contact
+ * in host and port. keepalive is set to whether the client connection
+ * may carry another request after this one: HTTP/1.1 keeps it unless the
+ * client asks to close it, HTTP/1.0 only when asked to. The request goes
+ * to the server in the version of the client, so a server never sends
+ * chunks to a client which can not read them
+ * Return 0 on success
+ * Return -1 if the request can not be read or is malformed
+ * Return -2 if the method is not supported
+ * Return -3 if the request, its request line or its uri do not fit
  */
-int  read_requesthdrs(rio_t *rio, char *req)
+int parse_request(rio_t *rio, char *method, char *uri, char *req,
+        char *host, int *port, int *keepalive)
 {
-    char buf[MAXLINE];
-    char host[MAXLINE];
-    int ret = 0;
-    int user_agt = 0;
-    int acc = 0;
-    int accept_enc = 0;
-    int conn = 0;
-    int proxy_conn = 0;
-
-    while(strcmp(buf, "\r\n") != 0) {
-        if ((Rio_readlineb(rio, buf, MAXLINE)) < 0)
+    char *line, *end, *u, *v;
+    ssize_t n;
+    size_t len;
+    int http11;
+    uriview uv;
+    hdrbuf hb;
+
+    /* The request line is the method, the uri and the version. The views
+     * into rio are used up before the headers are read */
+    if ((n = Rio_readlinev(rio, &line)) <= 0)
+        return -1;
+    if (line[n - 1] != '\n')
+        return -3;
+    for (end = line + n - 1; end > line && isspace((unsigned char)end[-1]); end--)
+        ;
+    if ((u = memchr(line, ' ', end - line)) == NULL || u == line)
+        return -1;
+    len = (u - line < MAXLINE) ? u - line : MAXLINE - 1;
+    memcpy(method, line, len);
+    method[len] = '\0';
+    u++;
+    if ((v = memchr(u, ' ', end - u)) == NULL || v == u || v + 1 == end)
+        return -1;
+
+    http11 = (end - v > 8 && strncmp(v + 1, "HTTP/1.", 7) == 0 &&
+            v[8] != '0');
+    *keepalive = http11;
+    if (strcasecmp(method, "GET") != 0)
+        return -2;
+
+    if (uri_parse(u, v - u, &uv) < 0)
+        return -1;
+    if (uri_key(&uv, uri, MAXLINE) < 0 || uri_host(&uv, host, MAXLINE) < 0)
+        return -3;
+    *port = uri_port(&uv);
+
+    hdrbuf_init(&hb, req, MAXBUF);
+    hdrbuf_adds(&hb, URI_SLASH(&uv) ? "GET /" : "GET ");
+    hdrbuf_add(&hb, uv.path, uv.pathlen);
+    hdrbuf_adds(&hb, (pool_enabled() && http11) ? " HTTP/1.1\r\n" :
+            " HTTP/1.0\r\n");
+    if (read_requesthdrs(rio, &hb, host, *port, keepalive) < 0)
+        return -1;
+    *keepalive = *keepalive && client_idle > 0;
+    return hb.full ? -3 : 0;
+}
+
+/*
+ * read_requesthdrs - read the header from client rio and append to hb the
+ * headers which will be forward to server later, ending with the blank
+ * line. host and port are the server of the uri, sent when the client did
+ * not send a Host. The Connection headers of the client update keepalive
+ * Return 0 on success, -1 on error
+ */
+int read_requesthdrs(rio_t *rio, hdrbuf *hb, char *host, int port,
+        int *keepalive)
+{
+    char *line;
+    ssize_t n;
+    int hashost = 0;
+    hdrfield f;
+
+    while (1) {
+        if ((n = Rio_readlinev(rio, &line)) <= 0)
             return -1;
-        if (strstr(buf, "Host:")) {
-            ret = 1;
-            sscanf(buf, "%*[^:]: %s", host);
-            sprintf(req, "Host: %s\r\n", host);
+        if (header_parse(line, n, &f) < 0)
+            break;
+
+        switch (f.id) {
+        case HDR_CONNECTION:
+        case HDR_PROXY_CONNECTION:
+            if (header_token(&f, "close"))
+                *keepalive = 0;
+            else if (header_token(&f, "keep-alive"))
+                *keepalive = 1;
+            continue;
+        case HDR_USER_AGENT:   /* the proxy sends these its own way */
+        case HDR_ACCEPT:
+        case HDR_ACCEPT_ENCODING:
+        case HDR_KEEP_ALIVE:
+            continue;
+        case HDR_HOST:
+            hashost = 1;
+            break;
         }
-        else if (strstr(buf, "User-Agent:")) {
-            sprintf(req, "%s%s", req, user_agent);
-            user_agt = 1;
+        hdrbuf_add(hb, line, n);
+    }
+
+    if (hashost == 0)
+        host_header(hb, host, port);
+    server_reqhdrs(hb);
+    return 0;
+}
+
+/*
+ * host_header - append to hb the Host header of the server host and port,
+ * an IPv6 literal in brackets and the port unless it is the default one
+ */
+void host_header(hdrbuf *hb, char *host, int port)
+{
+    char portstr[16];
+    int ipv6 = (strchr(host, ':') != NULL);
+
+    hdrbuf_adds(hb, ipv6 ? "Host: [" : "Host: ");
+    hdrbuf_adds(hb, host);
+    if (ipv6)
+        hdrbuf_adds(hb, "]");
+    if (port != 80) {
+        sprintf(portstr, ":%d", port);
+        hdrbuf_adds(hb, portstr);
+    }
+    hdrbuf_adds(hb, "\r\n");
+}
+
+/*
+ * server_reqhdrs - append to hb the headers the proxy sends with every
+ * request to a server, ending with the blank line
+ */
+void server_reqhdrs(hdrbuf *hb)
+{
+    hdrbuf_adds(hb, user_agent);
+    hdrbuf_adds(hb, accepts);
+    hdrbuf_adds(hb, accept_encoding);
+    if (pool_enabled())
+        hdrbuf_adds(hb, keep_alive);
+    else {
+        hdrbuf_adds(hb, connection);
+        hdrbuf_adds(hb, proxy_connection);
+    }
+    hdrbuf_adds(hb, "\r\n");
+}
+
+/*
+ * get_reshdrs - get response headers from server, at most MAXBUF bytes
+ * with the NUL, the lines which do not fit are dropped
+ * Return the number of bytes read, 0 if the server closed the connection
+ * before sending any
+ */
+size_t get_reshdrs(rio_t *server, char* reshdrs)
+{
+    char *line;
+    ssize_t n;
+    size_t len = 0, total = 0;
+
+    while ((n = Rio_readlinev(server, &line)) > 0) {
+        total += n;
+        if ((n == 2 && line[0] == '\r') || line[0] == '\n')
+            break;
+        if (len + n + 3 <= MAXBUF) {
+            memcpy(reshdrs + len, line, n);
+            len += n;
         }
-        else if (strstr(buf, "Accept:")) {
-            sprintf(req, "%s%s", req, accepts);
-            acc = 1;
+    }
+    memcpy(reshdrs + len, "\r\n", 3);
+    return total;
+}
+
+/*
+ * server_request - send req to the server at host and port and read the
+ * headers of its response into res, MAXBUF bytes, with rio. An idle
+ * connection of the pool is used when there is one, if the server closed
+ * it meanwhile the request is sent again over a new one. born is set to
+ * when the connection was made
+ * Return its descriptor, -1 if the server can not be reached
+ */
+int server_request(char *host, int port, char *req, rio_t *rio, char *res,
+        time_t *born)
+{
+    int fd, reused;
+
+    while (1) {
+        reused = ((fd = pool_get(host, port, 0, born)) >= 0);
+        if (!reused) {
+            if ((fd = Open_clientfd(host, port)) < 0)
+                return -1;
+            *born = time(NULL);
         }
-        else if (strstr(buf, "Accept-Encoding:")){
-            sprintf(req, "%s%s", req, accept_encoding);
-            accept_enc = 1;
+        fwdreq2server(fd, req);
+        Rio_readinitb(rio, fd);
+        if (get_reshdrs(rio, res) > 0 || !reused)
+            return fd;
+        Close(fd);
+    }
+}
+
+/*
+ * server_release - done with the connection fd to host and port, made at
+ * born, which carried the response framed by fr, read with rio: it goes
+ * back to the pool if it can carry another one, it is closed otherwise
+ */
+void server_release(int fd, char *host, int port, time_t born, frame *fr,
+        rio_t *rio)
+{
+    if (fr->done && fr->keepalive && rio->rio_cnt <= 0)
+        pool_put(host, port, 0, fd, born);
+    else
+        Close(fd);
+}
+
+/*
+ * fwdreq2server - forward the requeset to server
+ */
+void fwdreq2server(int server_fd, char *req)
+{
+   Rio_writen(server_fd, req, strlen(req));
+}
+
+/*
+ * fwdres2client - forward the result to client
+ */
+void fwdres2client(int client_fd, char *res, size_t size)
+{
+    Rio_writen(client_fd, res, size);
+}
+
+/*
+ * fwdobj2client - forward the cached object to client, the headers and
+ * content with one writev() unless it has more chunks than OBJ_IOV. The
+ * client is told whether keepalive keeps its connection
+ * Return 1 if the client may send another request on the connection
+ */
+int fwdobj2client(int client_fd, cacheobj *obj, int keepalive)
+{
+    struct iovec iov[OBJ_IOV];
+    char extra[OBJ_EXTRALEN];
+    objchunk *rest;
+    int n;
+
+    keepalive = keepalive && frame_delimited(obj->reshdrs);
+    n = obj_iov(obj, extra, client_connection(keepalive), iov, &rest);
+    while (fwdiov2client(client_fd, iov, n) == 0) {
+        if (rest == NULL)
+            return keepalive;
+        n = chunks_iov(rest, iov, OBJ_IOV, &rest);
+    }
+    return 0;
+}
+
+/*
+ * fwdiov2client - forward the n buffers of iov to client, iov is consumed
+ * Return 0 on success, -1 on error
+ */
+int fwdiov2client(int client_fd, struct iovec *iov, int n)
+{
+    ssize_t res;
+
+    while (n > 0) {
+        if ((res = writev(client_fd, iov, n)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
-        else if (strstr(buf, "Connection:")){
-            sprintf(req, "%s%s", req, connection);
-            conn = 1;
+        while (n > 0 && (size_t)res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            n--;
         }
-        else if (strstr(buf, "Proxy-Connectioan:")){
-            sprintf(req, "%s%s", req, proxy_connection);
-            proxy_conn = 1;
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + res;
+            iov->iov_len -= res;
         }
-        else {
-            if (strcmp(buf, "\r\n") != 0)
-                sprintf(req, "%s%s", req, buf);
+    }
+    return 0;
+}
+
+/*
+ * fwddisk2client - forward the object of the disk tier to client, the
+ * content straight from the file. The client is told whether keepalive
+ * keeps its connection
+ * Return 1 if the client may send another request on the connection
+ */
+int fwddisk2client(int client_fd, diskref *ref, int keepalive)
+{
+    char buf[MAXBUF], *hdrs;
+    off_t off = ref->bodyoff;
+    size_t left = ref->bodylen, len;
+    ssize_t n;
+
+    hdrs = client_diskhdrs(ref, buf, &len, &keepalive);
+    fwdres2client(client_fd, hdrs, len);
+    while (left > 0) {
+        if ((n = sendfile(client_fd, disk_fd(), &off, left)) <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return 0;
         }
+        left -= n;
+    }
+    return keepalive;
+}
+
+/*
+ * fwdstale2client - forward the stale object, revalidated or kept because
+ * the server failed, to client, or a 304 if notmod. The followers of fill
+ * get it as well. The pin on stale is released
+ * Return 1 if the client may send another request on the connection
+ */
+int fwdstale2client(int client_fd, cacheobj *stale, cachefill *fill,
+        int notmod, int keepalive)
+{
+    char buf[MAXBUF];
+
+    if (fill != NULL)
+        fill_reuse(Pxycache, fill, stale);
+    if (notmod)
+        fwdres2client(client_fd, buf, client_304(stale->reshdrs, buf,
+                    &keepalive));
+    else
+        keepalive = fwdobj2client(client_fd, stale, keepalive);
+    obj_read_done(stale);
+    return keepalive;
+}
+
+/*
+ * fwdsplice2client - forward the left bytes of content still to come from
+ * server to client. What server has buffered goes first, the rest moves
+ * through a pipe with splice() and never enters user space. Without a
+ * pipe it is copied through a buffer
+ * Return the number of bytes forwarded, fewer if the server closed early,
+ * -1 if writing to the client failed
+ */
+ssize_t fwdsplice2client(int client_fd, rio_t *server, size_t left)
+{
+    size_t total = left;
+    char buf[MAXBUF];
+    int pfd[2];
+    ssize_t n, m, ret = -1;
+
+    n = ((size_t)server->rio_cnt < left) ? server->rio_cnt : (ssize_t)left;
+    if (n > 0) {
+        if (Rio_writen(client_fd, server->rio_bufptr, n) != n)
+            return -1;
+        server->rio_bufptr += n;
+        server->rio_cnt -= n;
+        left -= n;
     }
 
-    /* Format a new req which will be foward to server later*/ 
-    if (user_agt == 0)
-        sprintf(req, "%s%s", req, user_agent);
-    if (acc == 0)
-        sprintf(req, "%s%s", req, accepts);
-    if (accept_enc == 0)
-        sprintf(req, "%s%s", req, accept_encoding);
-    if (conn == 0)
-        sprintf(req, "%s%s", req, connection);
-    if (proxy_conn == 0)
-        sprintf(req, "%s%s", req, proxy_connection);
-    sprintf(req, "%s\r\n", req);
+    if (pipe(pfd) < 0) {
+        while (left > 0 && (n = Rio_readnb(server, buf,
+                        left < MAXBUF ? left : MAXBUF)) > 0) {
+            if (Rio_writen(client_fd, buf, n) != n)
+                return -1;
+            left -= n;
+        }
+        return total - left;
+    }
 
+    while (left > 0) {
+        n = splice(server->rio_fd, NULL, pfd[1], NULL,
+                left < SPLICE_SIZE ? left : SPLICE_SIZE,
+                SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        left -= n;
+        while (n > 0) {
+            m = splice(pfd[0], NULL, client_fd, NULL, n,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m <= 0)
+                goto out;
+            n -= m;
+        }
+    }
+    ret = total - left;
+out:
+    Close(pfd[0]);
+    Close(pfd[1]);
     return ret;
 }
 
 /*
- * get_reshdrs - get response headers from server
+ * fwdfill2client - forward the response another request is fetching to
+ * client as it comes in. If the fetch fails before anything was
+ * forwarded the client gets the error it would have got itself
+ * Return 0 if the response was forwarded, -1 if the client must fetch it
+ * on its own
  */
-void get_reshdrs(rio_t *server, char* reshdrs)
+int fwdfill2client(int client_fd, cachefill *fill, char *uri)
 {
-    char buf[MAXLINE];
+    char buf[MAXBUF];
+    size_t off = 0;
+    ssize_t n;
 
-    strcpy(reshdrs, "");
-    Rio_readlineb(server, buf, MAXLINE);
-    while (strcmp(buf, "\r\n") != 0) {
-        strcat(reshdrs, buf);
-        Rio_readlineb(server, buf, MAXLINE);
+    while ((n = fill_read(fill, off, buf, MAXBUF, NULL)) > 0) {
+        fwdres2client(client_fd, buf, n);
+        off += n;
     }
-    strcat(reshdrs, "\r\n");
+    if (n == FILL_ALONE)
+        return -1;
+    if (n < 0 && off == 0)
+        clienterror(client_fd, uri, "400", "Bad Request",
+                "The host name or port number maybe invalid");
+    return 0;
 }
 
 /*
- * parse_uri - parse the current uri such as http:// into a formatted
- * uri(furi) without hostname and a hostname
- * If the uri contains a port information, return the port number
- * Else retun 0
+ * client_connection - the Connection header telling a client whether
+ * keepalive keeps its connection
  */
-int parse_uri(char *uri, char *furi, char *host)
+const char *client_connection(int keepalive)
 {
-    int port;
+    return keepalive ? keep_alive : connection;
+}
+
+/*
+ * client_reshdrs - turn the headers of the response in buf, the first
+ * hdrlen of its n bytes, into the ones sent to the client: the connection
+ * headers of the server are dropped and client_connection() is added.
+ * buf holds size bytes. keepalive is cleared if the response does not
+ * tell where it ends, or if the headers can not be rewritten
+ * Return the new number of bytes in buf
+ */
+size_t client_reshdrs(char *buf, size_t hdrlen, size_t n, size_t size,
+        int *keepalive)
+{
+    const char *line;
+    size_t len, linelen;
+    char c;
 
-    sscanf(uri, "%*[^:]://%[^/]%s", host, furi);
+    if (hdrlen < 4 || hdrlen >= size ||
+            memcmp(buf + hdrlen - 4, "\r\n\r\n", 4) != 0) {
+        *keepalive = 0;
+        return n;
+    }
 
-    if (strstr(host, ":")) {
-        char buf[MAXLINE];
-        strcpy(buf, host);
-        sscanf(buf, "%[^:]:%d", host, &port);
-        return port;
+    /* The headers are a string while they are rewritten */
+    c = buf[hdrlen];
+    buf[hdrlen] = '\0';
+    if (*keepalive && !frame_delimited(buf))
+        *keepalive = 0;
+    header_strip(buf, HDR_CONNECTION);
+    header_strip(buf, HDR_PROXY_CONNECTION);
+    header_strip(buf, HDR_KEEP_ALIVE);
+    len = strlen(buf);
+    buf[hdrlen] = c;
+
+    line = client_connection(*keepalive);
+    linelen = strlen(line);
+    if (len + linelen + n - hdrlen >= size) {
+        *keepalive = 0;
+        linelen = 0;
     }
 
-    return 0;
+    /* Before the blank line ending the headers, the content moves */
+    memmove(buf + len + linelen, buf + hdrlen, n - hdrlen);
+    memcpy(buf + len - 2, line, linelen);
+    memcpy(buf + len - 2 + linelen, "\r\n", 2);
+    return len + linelen + n - hdrlen;
 }
 
 /*
- * fwdreq2server - forward the requeset to server
+ * client_304 - build in buf, MAXBUF bytes, the 304 answering a client
+ * whose copy of the stored response headers is still good
+ * Return the length of the response
  */
-void fwdreq2server(int server_fd, char *req)
+int client_304(char *stored, char *buf, int *keepalive)
 {
-   Rio_writen(server_fd, req, strlen(req));
+    size_t len = fresh_304(stored, buf);
+
+    return client_reshdrs(buf, len, len, MAXBUF, keepalive);
 }
 
 /*
- * fwdres2client - forward the result to client
+ * client_diskhdrs - the headers of the object of the disk tier ref as
+ * sent to the client, rewritten in buf, MAXBUF bytes, when they fit.
+ * keepalive is cleared otherwise
+ * Return the headers, their length in len
  */
-void fwdres2client(int client_fd, char *res, size_t size)
+char *client_diskhdrs(diskref *ref, char *buf, size_t *len, int *keepalive)
 {
-    Rio_writen(client_fd, res, size);
+    if (ref->hdrlen >= MAXBUF) {
+        *keepalive = 0;
+        *len = ref->hdrlen;
+        return ref->hdrs;
+    }
+    memcpy(buf, ref->hdrs, ref->hdrlen);
+    *len = client_reshdrs(buf, ref->hdrlen, ref->hdrlen, MAXBUF, keepalive);
+    return buf;
 }
 
 /*
- * fwdobj2client - forward the cached object to client
+ * client_pipelined - whether the client of rio already sent a whole
+ * request which was not read yet
  */
-void fwdobj2client(int client_fd, cacheobj *obj)
+int client_pipelined(rio_t *rio)
 {
-    /* First forward back the response header */ 
-    fwdres2client(client_fd, obj->reshdrs, strlen(obj->reshdrs));
+    return rio->rio_cnt > 0 &&
+        memmem(rio->rio_bufptr, rio->rio_cnt, "\r\n\r\n", 4) != NULL;
+}
 
-    /* Forward back the content */ 
-    fwdres2client(client_fd, obj->content, obj->content_size);
+/*
+ * client_nodelay - send what is written to the client fd at once, a kept
+ * connection must not wait for the ack of the previous response
+ */
+void client_nodelay(int fd)
+{
+    int on = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/*
+ * client_cork - hold back the partial segments sent to the client fd while
+ * on, so the responses to pipelined requests are sent in full segments,
+ * and flush them when off. corked is whether they are held back now
+ */
+void client_cork(int fd, int *corked, int on)
+{
+    if (*corked == on)
+        return;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0)
+        *corked = on;
+}
+
+/*
+ * build_clienterror - build in buf an error message for the client
+ * Return the length of the message
+ */
+int build_clienterror(char *buf, char *cause, char *errnum,
+        char *shortmsg, char *longmsg)
+{
+    char body[MAXBUF];
+    int blen, len;
+
+    /* Build the HTTP response body, the cause comes from the client
+     * so it is truncated to keep the message inside buf */
+    blen = sprintf(body, "<html><title>Proxy Error</title>");
+    blen += sprintf(body + blen, "<body bgcolor=""ffffff"">\r\n");
+    blen += sprintf(body + blen, "%s: %s\r\n", errnum, shortmsg);
+    blen += sprintf(body + blen, "<p>%s: %.1024s\r\n", longmsg, cause);
+    blen += sprintf(body + blen, "<hr><em>The Proxy Server</em>\r\n");
+
+    /* Build the HTTP response */
+    len = sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    len += sprintf(buf + len, "Content-type: text/html\r\n");
+    len += sprintf(buf + len, "Content_length: %d\r\n\r\n", blen);
+    memcpy(buf + len, body, blen);
+    return len + blen;
 }
 
 /*
@@ -320,21 +1064,9 @@ void fwdobj2client(int client_fd, cacheobj *obj)
 void clienterror(int fd, char *cause, char *errnum,
         char *shortmsg, char *longmsg)
 {
-    char buf[MAXLINE], body[MAXBUF];
-
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Proxy Server</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content_length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf,strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    char buf[MAXBUF];
+    int len;
+
+    len = build_clienterror(buf, cause, errnum, shortmsg, longmsg);
+    Rio_writen(fd, buf, len);
 }
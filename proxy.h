@@ -0,0 +1,54 @@
+/*
+ * Author: shiweid
+ *
+ * proxy.h include the request handling helpers shared by the
+ * thread-per-connection path in proxy.c and the event driven engine
+ */
+
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "hdrbuf.h"
+#include "frame.h"
+#include "disk.h"
+
+#define S_PORT 80 /* Default server port*/
+#define CLIENT_IDLE_TIMEOUT 5   /* seconds a client connection is kept idle */
+#define CLIENT_REQUEST_TIMEOUT 10  /* seconds a new client has to send its
+                                    * first request */
+#define CLIENT_HDRLEN 24        /* the Connection header sent to clients */
+
+/* The cache */
+extern pxycache *Pxycache;
+
+/* Seconds a client connection waits for its next request, 0 closes it
+ * after the first response */
+extern int client_idle;
+
+int parse_request(rio_t *rio, char *method, char *uri, char *req,
+        char *host, int *port, int *keepalive);
+int read_requesthdrs(rio_t *rio, hdrbuf *hb, char *host, int port,
+        int *keepalive);
+void server_reqhdrs(hdrbuf *hb);
+void host_header(hdrbuf *hb, char *host, int port);
+size_t get_reshdrs(rio_t *server, char *reshdrs);
+int server_request(char *host, int port, char *req, rio_t *rio, char *res,
+        time_t *born);
+void server_release(int fd, char *host, int port, time_t born, frame *fr,
+        rio_t *rio);
+const char *client_connection(int keepalive);
+size_t client_reshdrs(char *buf, size_t hdrlen, size_t n, size_t size,
+        int *keepalive);
+int client_304(char *stored, char *buf, int *keepalive);
+char *client_diskhdrs(diskref *ref, char *buf, size_t *len, int *keepalive);
+int client_pipelined(rio_t *rio);
+void client_nodelay(int fd);
+void client_cork(int fd, int *corked, int on);
+int build_clienterror(char *buf, char *cause, char *errnum,
+        char *shortmsg, char *longmsg);
+void clienterror(int fd, char *cause, char *errnum,
+        char *shortmsg, char *longmsg);
+
+#endif
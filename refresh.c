@@ -0,0 +1,206 @@
+/*
+ * Author: shiweid
+ *
+ * refresh.c include the background refresh of the cache. See refresh.h
+ * for the overview.
+ * The queue is a ring of pinned objects under one mutex, the refreshers
+ * sleep on its condition variable.
+ */
+
+#include "refresh.h"
+#include "fill.h"
+#include "fresh.h"
+#include "header.h"
+#include "uri.h"
+#include "pool.h"
+#include "proxy.h"
+
+typedef struct refresh_state
+{
+    pxycache *cache;         /* NULL until the refreshers are started */
+    cacheobj *queue[REFRESH_QUEUE];
+    int head;
+    int count;
+    unsigned long refreshed; /* fetched again or revalidated */
+    unsigned long failed;    /* the server failed, the stale object stays */
+    unsigned long skipped;   /* the queue was full */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}refreshstate;
+
+static refreshstate refresh = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/* Static helper functions */
+static void *refresh_thread(void *vargp);
+static int refresh_fetch(cacheobj *obj);
+static int refresh_request(cacheobj *obj, char *req, char *host, int *port);
+
+/*
+ * refresh_init - start nthreads refreshers for the objects of Pxycache
+ * Notice: with no refresher, objects are never served stale while they
+ * are revalidated
+ */
+void refresh_init(pxycache *Pxycache, int nthreads)
+{
+    pthread_t tid;
+    int i;
+
+    if (nthreads <= 0)
+        return;
+    refresh.cache = Pxycache;
+    for (i = 0; i < nthreads; i++)
+        Pthread_create(&tid, NULL, refresh_thread, NULL);
+}
+
+/*
+ * refresh_schedule - queue a refresh of the stale object obj, which the
+ * caller has pinned. Nothing happens if obj is already queued
+ */
+void refresh_schedule(cacheobj *obj)
+{
+    if (refresh.cache == NULL ||
+            !__sync_bool_compare_and_swap(&obj->refreshing, 0, 1))
+        return;
+
+    pthread_mutex_lock(&refresh.lock);
+    if (refresh.count == REFRESH_QUEUE) {
+        refresh.skipped++;
+        pthread_mutex_unlock(&refresh.lock);
+        __atomic_store_n(&obj->refreshing, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+    refresh.queue[(refresh.head + refresh.count) % REFRESH_QUEUE] = obj;
+    refresh.count++;
+    pthread_cond_signal(&refresh.cond);
+    pthread_mutex_unlock(&refresh.lock);
+}
+
+/*
+ * refresh_stats - print the background refreshes to fp
+ */
+void refresh_stats(FILE *fp)
+{
+    pthread_mutex_lock(&refresh.lock);
+    if (refresh.cache != NULL)
+        fprintf(fp, "refresh: %lu refreshed, %lu failed, %lu skipped, "
+                "%d queued\n", refresh.refreshed, refresh.failed,
+                refresh.skipped, refresh.count);
+    pthread_mutex_unlock(&refresh.lock);
+}
+
+/*
+ * refresh_thread - refresh the queued objects one by one
+ */
+static void *refresh_thread(void *vargp)
+{
+    cacheobj *obj;
+    int rc;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&refresh.lock);
+        while (refresh.count == 0)
+            pthread_cond_wait(&refresh.cond, &refresh.lock);
+        obj = refresh.queue[refresh.head];
+        refresh.head = (refresh.head + 1) % REFRESH_QUEUE;
+        refresh.count--;
+        pthread_mutex_unlock(&refresh.lock);
+
+        rc = refresh_fetch(obj);
+
+        pthread_mutex_lock(&refresh.lock);
+        if (rc == 0)
+            refresh.refreshed++;
+        else if (rc < 0)
+            refresh.failed++;
+        pthread_mutex_unlock(&refresh.lock);
+        __atomic_store_n(&obj->refreshing, 0, __ATOMIC_RELEASE);
+        obj_read_done(obj);
+    }
+    return NULL;
+}
+
+/*
+ * refresh_fetch - fetch obj again as the leader of a fill on its uri.
+ * The followers are served the new response, or obj if it was revalidated
+ * or the server failed
+ * Return 0 if obj was refreshed, 1 if another fetch of the uri was
+ * already in flight, -1 if the server failed
+ */
+static int refresh_fetch(cacheobj *obj)
+{
+    char req[MAXBUF], res[MAXBUF], buf[MAXBUF], host[MAXLINE];
+    int port, fd, leader, status, ok;
+    ssize_t size = 0;
+    time_t born;
+    cachefill *fill;
+    frame fr;
+    rio_t rio;
+
+    fill = fill_begin(refresh.cache, obj->uri, &leader);
+    if (fill == NULL)
+        return 1;
+    if (!leader) {   /* a miss is fetching it already */
+        fill_leave(fill);
+        return 1;
+    }
+
+    dbg_printf("Refreshing %s\n", obj->uri);
+    if (refresh_request(obj, req, host, &port) < 0 ||
+            (fd = server_request(host, port, req, &rio, res, &born)) < 0) {
+        fill_reuse(refresh.cache, fill, obj);
+        return -1;
+    }
+
+    status = header_status(res);
+    frame_init(&fr, res);
+    if (status == 304)
+        obj_refresh(obj, fresh_revalidate(obj->reshdrs, res, time(NULL)));
+    if (status == 304 || status < 0 || status >= 500) {
+        fill_reuse(refresh.cache, fill, obj);
+        server_release(fd, host, port, born, &fr, &rio);
+        return (status == 304) ? 0 : -1;
+    }
+
+    /* A new response, it replaces obj once stored */
+    fill_append(fill, res, strlen(res));
+    while (!fr.done && (size = Rio_readsomeb(&rio, buf, MAXBUF)) > 0)
+        fill_append(fill, buf, frame_feed(&fr, buf, size));
+    ok = fr.done || (fr.mode == FRAME_CLOSE && size == 0);
+    fill_end(refresh.cache, fill, ok);
+    server_release(fd, host, port, born, &fr, &rio);
+    return ok ? 0 : -1;
+}
+
+/*
+ * refresh_request - build in req the request refreshing obj, conditional
+ * if obj has validators, and the server to send it to in host and port
+ * Return 0 on success, -1 if the uri of obj can not be parsed or the
+ * request does not fit
+ */
+static int refresh_request(cacheobj *obj, char *req, char *host, int *port)
+{
+    uriview uv;
+    hdrbuf hb;
+
+    if (uri_parse(obj->uri, strlen(obj->uri), &uv) < 0 ||
+            uri_host(&uv, host, MAXLINE) < 0)
+        return -1;
+    *port = uri_port(&uv);
+
+    /* The same request a client missing obj makes the proxy send */
+    hdrbuf_init(&hb, req, MAXBUF);
+    hdrbuf_adds(&hb, URI_SLASH(&uv) ? "GET /" : "GET ");
+    hdrbuf_add(&hb, uv.path, uv.pathlen);
+    hdrbuf_adds(&hb, pool_enabled() ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n");
+    host_header(&hb, host, *port);
+    server_reqhdrs(&hb);
+    if (hb.full)
+        return -1;
+    fresh_condreq(req, obj->reshdrs);
+    return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * Author: shiweid
+ *
+ * refresh.h include the background refresh of the cache.
+ * An object hit within stale-while-revalidate seconds of going stale is
+ * served as it is and queued for a refresh. A small pool of refresher
+ * threads fetches it again, conditionally when it has validators, through
+ * a fill, so the refresh and the misses on the same uri share one fetch.
+ * A 304 only extends the freshness of the object, a new response replaces
+ * it, and if the server fails the stale object stays.
+ * An object is queued once at a time. When the queue is full the refresh
+ * is skipped, the next hit queues it again.
+ */
+
+#ifndef __REFRESH_H__
+#define __REFRESH_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define REFRESH_THREADS 2    /* default number of refresher threads */
+#define REFRESH_QUEUE 256    /* objects waiting for a refresh */
+
+void refresh_init(pxycache *Pxycache, int nthreads);
+void refresh_schedule(cacheobj *obj);
+void refresh_stats(FILE *fp);
+
+#endif
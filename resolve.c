@@ -0,0 +1,121 @@
+/*
+ * Author: shiweid
+ *
+ * resolve.c include the resolution of the server names for the event
+ * driven engines. See resolve.h for the overview.
+ * The requests wait in a FIFO list under one mutex, they are owned by the
+ * connections so queueing one allocates nothing.
+ */
+
+#include "resolve.h"
+
+typedef struct resolve_state
+{
+    resolvereq *head;
+    resolvereq *tail;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}resolvestate;
+
+static resolvestate resolver = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+static pthread_once_t resolve_once = PTHREAD_ONCE_INIT;
+
+/* Static helper functions */
+static void resolve_init(void);
+static void *resolve_thread(void *vargp);
+static int resolve_addr(resolvereq *r);
+
+/*
+ * resolve_start - resolve the host and port of r into r->addr. A numeric
+ * address is resolved at once, a name is queued for the resolvers
+ * Return 0 if r->res is set already, 1 if r->done will be called once it
+ * is
+ */
+int resolve_start(resolvereq *r)
+{
+    struct sockaddr_in *in = (struct sockaddr_in *)r->addr;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)r->addr;
+
+    bzero((char *)r->addr, sizeof(*r->addr));
+    if (inet_pton(AF_INET, r->host, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(r->port);
+        r->addrlen = sizeof(*in);
+        r->res = 0;
+        return 0;
+    }
+    if (inet_pton(AF_INET6, r->host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(r->port);
+        r->addrlen = sizeof(*in6);
+        r->res = 0;
+        return 0;
+    }
+
+    Pthread_once(&resolve_once, resolve_init);
+    r->next = NULL;
+    pthread_mutex_lock(&resolver.lock);
+    if (resolver.tail != NULL)
+        resolver.tail->next = r;
+    else
+        resolver.head = r;
+    resolver.tail = r;
+    pthread_cond_signal(&resolver.cond);
+    pthread_mutex_unlock(&resolver.lock);
+    return 1;
+}
+
+/*
+ * resolve_init - start the resolver threads
+ */
+static void resolve_init(void)
+{
+    pthread_t tid;
+    int i;
+
+    for (i = 0; i < RESOLVE_THREADS; i++)
+        Pthread_create(&tid, NULL, resolve_thread, NULL);
+}
+
+/*
+ * resolve_thread - resolve the queued requests one by one
+ */
+static void *resolve_thread(void *vargp)
+{
+    resolvereq *r;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&resolver.lock);
+        while (resolver.head == NULL)
+            pthread_cond_wait(&resolver.cond, &resolver.lock);
+        r = resolver.head;
+        if ((resolver.head = r->next) == NULL)
+            resolver.tail = NULL;
+        pthread_mutex_unlock(&resolver.lock);
+
+        r->res = resolve_addr(r);
+        r->done(r);
+    }
+    return NULL;
+}
+
+/*
+ * resolve_addr - fill in the addr of r with the first address of its host
+ * and port
+ * Return 0 on success -1 otherwise
+ */
+static int resolve_addr(resolvereq *r)
+{
+    struct addrinfo *addr_info;
+
+    if (Getaddrinfo(r->host, r->port, &addr_info) == -1)
+        return -1;
+    memcpy(r->addr, addr_info->ai_addr, addr_info->ai_addrlen);
+    r->addrlen = addr_info->ai_addrlen;
+    freeaddrinfo(addr_info);
+    return 0;
+}
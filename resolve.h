@@ -0,0 +1,32 @@
+/*
+ * Author: shiweid
+ *
+ * resolve.h include the resolution of the server names for the event
+ * driven engines. getaddrinfo() blocks, and one slow lookup inside a loop
+ * would stall every connection of that loop, so the loops hand the names
+ * to a small pool of resolver threads and wait to be called back. A
+ * numeric address, IPv4 or IPv6, is resolved at once. The threads start with the first
+ * name they are given.
+ */
+
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__
+
+#include "csapp.h"
+
+#define RESOLVE_THREADS 4   /* lookups in flight at once */
+
+typedef struct resolve_req
+{
+    char *host;
+    int port;
+    struct sockaddr_storage *addr;   /* filled in once resolved, */
+    socklen_t addrlen;               /* IPv4 or IPv6 */
+    int res;                    /* 0 if it was resolved, -1 otherwise */
+    void (*done)(struct resolve_req *r);   /* from a resolver thread */
+    struct resolve_req *next;
+}resolvereq;
+
+int resolve_start(resolvereq *r);
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ * Author: shiweid
+ *
+ * sbuf.c include a bounded buffer of connected descriptors shared by the
+ * accepting thread and the worker threads of the prethreaded proxy.
+ */
+
+#include "sbuf.h"
+
+/* Static helper function */
+static void sbuf_put(sbuf_t *sp, int item);
+
+/*
+ * sbuf_init - create an empty, bounded, shared FIFO buffer with n slots
+ */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->stamp = Calloc(n, sizeof(struct timeval));
+    sp->n = n;                  /* Buffer holds max of n items */
+    sp->front = sp->rear = 0;   /* Empty buffer iff front == rear */
+    Sem_init(&sp->mutex, 0, 1); /* Binary semaphore for locking */
+    Sem_init(&sp->slots, 0, n); /* Initially, buf has n empty slots */
+    Sem_init(&sp->items, 0, 0); /* Initially, buf has zero data items */
+    sp->inserted = sp->rejected = 0;
+    sp->depth = sp->maxdepth = 0;
+    sp->waitus = sp->maxwaitus = 0;
+}
+
+/*
+ * sbuf_deinit - clean up buffer sp
+ */
+void sbuf_deinit(sbuf_t *sp)
+{
+    Free(sp->buf);
+    Free(sp->stamp);
+}
+
+/*
+ * sbuf_insert - insert item onto the rear of shared buffer sp,
+ * waiting for a free slot
+ */
+void sbuf_insert(sbuf_t *sp, int item)
+{
+    P(&sp->slots);              /* Wait for available slot */
+    sbuf_put(sp, item);
+}
+
+/*
+ * sbuf_tryinsert - insert item onto the rear of shared buffer sp
+ * Return 0 on success -1 if the buffer is full
+ */
+int sbuf_tryinsert(sbuf_t *sp, int item)
+{
+    if (sem_trywait(&sp->slots) < 0) {
+        P(&sp->mutex);
+        sp->rejected++;
+        V(&sp->mutex);
+        return -1;
+    }
+    sbuf_put(sp, item);
+    return 0;
+}
+
+/*
+ * sbuf_remove - remove and return the first item from buffer sp
+ */
+int sbuf_remove(sbuf_t *sp)
+{
+    int item, i;
+    struct timeval now;
+    unsigned long long us;
+
+    P(&sp->items);              /* Wait for available item */
+    P(&sp->mutex);              /* Lock the buffer */
+    i = sp->front = (sp->front + 1) % sp->n;
+    item = sp->buf[i];          /* Remove the item */
+    gettimeofday(&now, NULL);
+    us = (now.tv_sec - sp->stamp[i].tv_sec) * 1000000ULL +
+        now.tv_usec - sp->stamp[i].tv_usec;
+    sp->waitus += us;
+    if (us > sp->maxwaitus)
+        sp->maxwaitus = us;
+    sp->depth--;
+    V(&sp->mutex);              /* Unlock the buffer */
+    V(&sp->slots);              /* Announce available slot */
+    return item;
+}
+
+/*
+ * sbuf_stats - print the queue statistics of sp to fp
+ */
+void sbuf_stats(sbuf_t *sp, FILE *fp)
+{
+    unsigned long removed;
+
+    P(&sp->mutex);
+    removed = sp->inserted - sp->depth;
+    fprintf(fp, "queue: depth %d/%d (max %d), %lu queued, %lu rejected, "
+            "wait avg %llu us max %llu us\n",
+            sp->depth, sp->n, sp->maxdepth, sp->inserted, sp->rejected,
+            removed ? sp->waitus / removed : 0ULL, sp->maxwaitus);
+    V(&sp->mutex);
+}
+
+/*
+ * sbuf_put - store item in a slot already reserved by the caller
+ */
+static void sbuf_put(sbuf_t *sp, int item)
+{
+    int i;
+
+    P(&sp->mutex);              /* Lock the buffer */
+    i = sp->rear = (sp->rear + 1) % sp->n;
+    sp->buf[i] = item;          /* Insert the item */
+    gettimeofday(&sp->stamp[i], NULL);
+    sp->inserted++;
+    if (++sp->depth > sp->maxdepth)
+        sp->maxdepth = sp->depth;
+    V(&sp->mutex);              /* Unlock the buffer */
+    V(&sp->items);              /* Announce available item */
+}
@@ -0,0 +1,41 @@
+/*
+ * Author: shiweid
+ *
+ * sbuf.h include a bounded buffer of connected descriptors shared by the
+ * accepting thread (producer) and the worker threads (consumers) of the
+ * prethreaded proxy. It is protected by semaphores, and keeps statistics
+ * on the queue depth and on the time descriptors wait in the queue.
+ */
+
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+typedef struct {
+    int *buf;                 /* Buffer array */
+    struct timeval *stamp;    /* When each item was inserted */
+    int n;                    /* Maximum number of slots */
+    int front;                /* buf[(front+1)%n] is first item */
+    int rear;                 /* buf[rear%n] is last item */
+    sem_t mutex;              /* Protects accesses to buf */
+    sem_t slots;              /* Counts available slots */
+    sem_t items;              /* Counts available items */
+
+    /* Statistics, protected by mutex */
+    unsigned long inserted;   /* items ever inserted */
+    unsigned long rejected;   /* items refused because the buffer was full */
+    int depth;                /* items currently queued */
+    int maxdepth;
+    unsigned long long waitus;    /* total time spent queued */
+    unsigned long long maxwaitus;
+} sbuf_t;
+
+void sbuf_init(sbuf_t *sp, int n);
+void sbuf_deinit(sbuf_t *sp);
+void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_tryinsert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+void sbuf_stats(sbuf_t *sp, FILE *fp);
+
+#endif
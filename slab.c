@@ -0,0 +1,288 @@
+/*
+ * Author: shiweid
+ *
+ * slab.c include the memory allocator of the cache. See slab.h for the
+ * overview.
+ * Every class has its own lock and a list of the slabs which still have
+ * free blocks. A slab is carved lazily, so its pages are only touched once
+ * its blocks are used. The arena hands out slabs under its own lock, which
+ * is always taken after the lock of a class.
+ */
+
+#include <sys/mman.h>
+#include "slab.h"
+
+typedef struct slab
+{
+    struct slab *prev;    /* in the partial list of its class */
+    struct slab *next;    /* or in the free list of the arena */
+    void *free;           /* freed blocks, linked through their first word */
+    char *base;
+    int cls;              /* -1 while the slab belongs to the arena */
+    unsigned int inuse;   /* blocks allocated */
+    unsigned int carved;  /* blocks ever handed out */
+    unsigned int nblocks;
+}slab;
+
+typedef struct slab_class
+{
+    size_t size;
+    slab *partial;        /* slabs with free blocks */
+    unsigned long nslabs;
+    unsigned long inuse;      /* blocks allocated */
+    unsigned long requested;  /* bytes asked for in these blocks */
+    pthread_mutex_t lock;
+}slabclass;
+
+typedef struct slab_arena
+{
+    char *base;
+    size_t nslabs;
+    size_t used;          /* slabs ever taken from the arena */
+    slab *desc;           /* the descriptor of every slab */
+    slab *free;           /* slabs given back, their pages released */
+    unsigned long outside;    /* bytes malloced instead */
+    pthread_mutex_t lock;
+    slabclass classes[SLAB_CLASSES];
+}slabarena;
+
+static slabarena arena;
+
+/* Static helper functions */
+static int slab_class(size_t size);
+static slab *slab_get(int cls);
+static void slab_put(slab *s);
+static void slab_link(slabclass *c, slab *s);
+static void slab_unlink(slabclass *c, slab *s);
+
+/*
+ * slab_init - reserve the arena and set up the size classes
+ * Notice: if the arena can not be reserved every block is malloced
+ */
+void slab_init(void)
+{
+    int i;
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        arena.classes[i].size = (size_t)1 << (i + SLAB_MIN_SHIFT);
+        arena.classes[i].partial = NULL;
+        arena.classes[i].nslabs = 0;
+        arena.classes[i].inuse = 0;
+        arena.classes[i].requested = 0;
+        pthread_mutex_init(&arena.classes[i].lock, NULL);
+    }
+    pthread_mutex_init(&arena.lock, NULL);
+    arena.used = 0;
+    arena.free = NULL;
+    arena.outside = 0;
+
+    arena.base = mmap(NULL, SLAB_ARENA_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena.base == MAP_FAILED) {
+        unix_error("slab arena mmap error");
+        arena.base = NULL;
+        arena.nslabs = 0;
+        arena.desc = NULL;
+        return;
+    }
+    arena.nslabs = SLAB_ARENA_SIZE / SLAB_SIZE;
+    arena.desc = Calloc(arena.nslabs, sizeof(slab));
+}
+
+/*
+ * slab_alloc - allocate a block of at least size bytes
+ */
+void *slab_alloc(size_t size)
+{
+    int cls = slab_class(size);
+    slabclass *c;
+    slab *s;
+    void *p;
+
+    if (cls < 0 || arena.base == NULL)
+        goto outside;
+
+    c = &arena.classes[cls];
+    pthread_mutex_lock(&c->lock);
+    if ((s = c->partial) == NULL) {
+        if ((s = slab_get(cls)) == NULL) {
+            pthread_mutex_unlock(&c->lock);
+            goto outside;
+        }
+        c->nslabs++;
+        slab_link(c, s);
+    }
+
+    if (s->free != NULL) {
+        p = s->free;
+        s->free = *(void **)p;
+    }
+    else
+        p = s->base + (size_t)s->carved++ * c->size;
+    if (++s->inuse == s->nblocks)
+        slab_unlink(c, s);
+    c->inuse++;
+    c->requested += size;
+    pthread_mutex_unlock(&c->lock);
+    return p;
+
+outside:
+    __atomic_add_fetch(&arena.outside, size, __ATOMIC_RELAXED);
+    return Malloc(size);
+}
+
+/*
+ * slab_free - free the block p, allocated with the same size
+ */
+void slab_free(void *p, size_t size)
+{
+    slab *s;
+    slabclass *c;
+
+    if (arena.base == NULL || (char *)p < arena.base ||
+            (char *)p >= arena.base + SLAB_ARENA_SIZE) {
+        __atomic_sub_fetch(&arena.outside, size, __ATOMIC_RELAXED);
+        Free(p);
+        return;
+    }
+
+    s = &arena.desc[((char *)p - arena.base) / SLAB_SIZE];
+    c = &arena.classes[s->cls];
+    pthread_mutex_lock(&c->lock);
+    if (s->inuse == s->nblocks)   /* it was full */
+        slab_link(c, s);
+    *(void **)p = s->free;
+    s->free = p;
+    s->inuse--;
+    c->inuse--;
+    c->requested -= size;
+
+    /* Keep the last slab of the class to avoid churning on it */
+    if (s->inuse == 0 && (c->partial != s || s->next != NULL)) {
+        slab_unlink(c, s);
+        c->nslabs--;
+        slab_put(s);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * slab_stats - print the utilisation and the fragmentation of every class
+ * in use, and the memory held by the allocator
+ * Notice: utilisation is the share of the blocks of the slabs which are
+ * allocated, fragmentation the share of the allocated bytes nobody asked
+ * for
+ */
+void slab_stats(FILE *fp)
+{
+    int i;
+    slabclass *c;
+    size_t blocks, bytes;
+    unsigned long nslabs = 0;
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        c = &arena.classes[i];
+        pthread_mutex_lock(&c->lock);
+        if (c->nslabs > 0) {
+            blocks = c->nslabs * (SLAB_SIZE / c->size);
+            bytes = c->inuse * c->size;
+            fprintf(fp, "slab %5lu: %lu slabs, %lu/%lu blocks used (%lu%%), "
+                    "fragmentation %lu%%\n", (unsigned long)c->size,
+                    c->nslabs, c->inuse, (unsigned long)blocks,
+                    (unsigned long)(100 * c->inuse / blocks),
+                    bytes ? (unsigned long)(100 * (bytes - c->requested) / bytes)
+                    : 0UL);
+            nslabs += c->nslabs;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    fprintf(fp, "slab: %lu KB in %lu slabs, %lu KB outside\n",
+            nslabs * SLAB_SIZE / 1024, nslabs,
+            __atomic_load_n(&arena.outside, __ATOMIC_RELAXED) / 1024);
+}
+
+/*
+ * slab_class - the class of the blocks of size bytes
+ * Return -1 if it is bigger than the largest class
+ */
+static int slab_class(size_t size)
+{
+    int shift;
+
+    if (size > ((size_t)1 << SLAB_MAX_SHIFT))
+        return -1;
+    if (size <= ((size_t)1 << SLAB_MIN_SHIFT))
+        return 0;
+    shift = 8 * sizeof(unsigned long) - __builtin_clzl(size - 1);
+    return shift - SLAB_MIN_SHIFT;
+}
+
+/*
+ * slab_get - take an empty slab from the arena for class cls
+ * Return NULL if the arena is used up
+ * Notice: the caller holds the lock of the class
+ */
+static slab *slab_get(int cls)
+{
+    slab *s;
+
+    pthread_mutex_lock(&arena.lock);
+    if ((s = arena.free) != NULL)
+        arena.free = s->next;
+    else if (arena.used < arena.nslabs) {
+        s = &arena.desc[arena.used];
+        s->base = arena.base + arena.used * SLAB_SIZE;
+        arena.used++;
+    }
+    pthread_mutex_unlock(&arena.lock);
+    if (s == NULL)
+        return NULL;
+
+    s->prev = s->next = NULL;
+    s->free = NULL;
+    s->cls = cls;
+    s->inuse = 0;
+    s->carved = 0;
+    s->nblocks = SLAB_SIZE >> (cls + SLAB_MIN_SHIFT);
+    return s;
+}
+
+/*
+ * slab_put - give the empty slab s back to the arena and its pages back to
+ * the kernel
+ */
+static void slab_put(slab *s)
+{
+    madvise(s->base, SLAB_SIZE, MADV_DONTNEED);
+    s->cls = -1;
+    pthread_mutex_lock(&arena.lock);
+    s->next = arena.free;
+    arena.free = s;
+    pthread_mutex_unlock(&arena.lock);
+}
+
+/*
+ * slab_link - put s at the head of the partial list of c
+ */
+static void slab_link(slabclass *c, slab *s)
+{
+    s->prev = NULL;
+    s->next = c->partial;
+    if (c->partial != NULL)
+        c->partial->prev = s;
+    c->partial = s;
+}
+
+/*
+ * slab_unlink - take s off the partial list of c
+ */
+static void slab_unlink(slabclass *c, slab *s)
+{
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        c->partial = s->next;
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+    s->prev = s->next = NULL;
+}
@@ -0,0 +1,32 @@
+/*
+ * Author: shiweid
+ *
+ * slab.h include the memory allocator of the cache.
+ * Blocks are served from power of two size classes. Every class carves
+ * SLAB_SIZE slabs into blocks of its size and keeps the free blocks of
+ * each slab on a free list, so allocating and freeing are O(1) and blocks
+ * of different sizes never fragment each other.
+ * The slabs come from one arena reserved at startup. A slab whose blocks
+ * are all free goes back to the arena and its pages back to the kernel,
+ * so the resident size follows what the cache holds. Requests bigger than
+ * the largest class, or made once the arena is used up, fall back to
+ * malloc.
+ */
+
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MIN_SHIFT 6                    /* the smallest class, 64 bytes */
+#define SLAB_MAX_SHIFT 15                   /* the largest class, 32KB */
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_ARENA_SIZE (64 * 1024 * 1024)  /* address space, not memory */
+
+void slab_init(void);
+void *slab_alloc(size_t size);
+void slab_free(void *p, size_t size);
+void slab_stats(FILE *fp);
+
+#endif
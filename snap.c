@@ -0,0 +1,403 @@
+/*
+ * Author: shiweid
+ *
+ * snap.c include the snapshot of the cache. See snap.h for the overview.
+ * The file is a header followed by one record per object: the record
+ * header, the uri, the response headers and the content, padded to 8
+ * bytes. The objects of the loaded snapshot nobody has asked for yet are
+ * copied into the next snapshot as they are.
+ */
+
+#include <sys/mman.h>
+#include "snap.h"
+
+#define SNAP_MAGIC 0x70787973   /* "pxys" */
+#define SNAP_VERSION 3
+
+typedef struct snap_header
+{
+    unsigned int magic;
+    unsigned int version;
+}snaphdr;
+
+typedef struct snap_record
+{
+    unsigned int urilen;
+    unsigned int hdrlen;
+    unsigned int bodylen;
+    unsigned int freq;       /* hits seen by the eviction policy */
+    unsigned long long hash;
+    unsigned long cost;
+    time_t expires;
+    time_t born;
+    unsigned int swr;
+    unsigned int sie;
+}snaprec;
+
+typedef struct snap_entry
+{
+    unsigned long long hash;
+    size_t off;              /* of the record in the mapping */
+    struct snap_entry *next;
+}snapent;
+
+typedef struct snap_state
+{
+    char *base;              /* the loaded snapshot, NULL once used up */
+    size_t size;
+    snapent *buckets[SNAP_BUCKETS];
+    unsigned long nobjs;     /* objects still in the mapping */
+    unsigned long taken;     /* objects copied into the cache */
+    pthread_mutex_t lock;
+
+    /* What the snapshot thread saves */
+    pxycache *cache;
+    char *path;
+    int interval;
+}snapstate;
+
+static snapstate snap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Static helper functions */
+static void *snap_thread(void *vargp);
+static int snap_shard(cacheshard *shard, FILE *fp);
+static int snap_write(FILE *fp, cacheobj *obj);
+static int snap_rest(FILE *fp);
+static snapent *snap_find(char *uri, unsigned long long hash, snapent ***pp);
+static size_t snap_reclen(snaprec *rec);
+
+/*
+ * snap_load - map the snapshot at path and index its objects
+ * Return 0 on success, -1 if there is no usable snapshot
+ * Notice: a snapshot cut short is used up to its last whole record
+ */
+int snap_load(char *path)
+{
+    int fd;
+    struct stat st;
+    snaphdr *hdr;
+    snaprec *rec;
+    snapent *e;
+    size_t off, reclen;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snaphdr)) {
+        close(fd);
+        return -1;
+    }
+    snap.size = st.st_size;
+    snap.base = mmap(NULL, snap.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snap.base == MAP_FAILED) {
+        unix_error("snapshot mmap error");
+        snap.base = NULL;
+        return -1;
+    }
+
+    hdr = (snaphdr *)snap.base;
+    if (hdr->magic != SNAP_MAGIC || hdr->version != SNAP_VERSION) {
+        fprintf(stderr, "%s is not a snapshot of the cache\n", path);
+        munmap(snap.base, snap.size);
+        snap.base = NULL;
+        return -1;
+    }
+
+    off = sizeof(snaphdr);
+    while (off + sizeof(snaprec) <= snap.size) {
+        rec = (snaprec *)(snap.base + off);
+        reclen = snap_reclen(rec);
+        if (rec->urilen >= MAXLINE || rec->bodylen > MAX_OBJECT_SIZE ||
+                off + reclen > snap.size)
+            break;
+        e = Malloc(sizeof(snapent));
+        e->hash = rec->hash;
+        e->off = off;
+        e->next = snap.buckets[rec->hash % SNAP_BUCKETS];
+        snap.buckets[rec->hash % SNAP_BUCKETS] = e;
+        snap.nobjs++;
+        off += reclen;
+    }
+
+    if (snap.nobjs == 0) {
+        munmap(snap.base, snap.size);
+        snap.base = NULL;
+    }
+    return 0;
+}
+
+/*
+ * snap_take - take the object of uri out of the loaded snapshot, one which
+ * may not be served even stale is dropped
+ * Return a new object for the cache, NULL if the snapshot does not have a
+ * usable one
+ */
+cacheobj *snap_take(char *uri, unsigned long long hash)
+{
+    snapent *e, **pp;
+    snaprec *rec;
+    char *hdrs;
+    cacheobj *obj;
+
+    if (snap.base == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&snap.lock);
+    if ((e = snap_find(uri, hash, &pp)) == NULL) {
+        pthread_mutex_unlock(&snap.lock);
+        return NULL;
+    }
+    rec = (snaprec *)(snap.base + e->off);
+    hdrs = (char *)(rec + 1) + rec->urilen;
+    obj = NULL;
+    if (OBJ_KEPT(rec, time(NULL))) {
+        obj = new_obj(uri, hdrs, rec->hdrlen,
+                chunks_copy(hdrs + rec->hdrlen, rec->bodylen), rec->bodylen);
+        obj->freq = rec->freq;
+        obj->cost = rec->cost;
+        obj->expires = rec->expires;
+        obj->born = rec->born;
+        obj->swr = rec->swr;
+        obj->sie = rec->sie;
+    }
+
+    *pp = e->next;
+    Free(e);
+    if (obj != NULL)
+        snap.taken++;
+    if (--snap.nobjs == 0) {   /* used up */
+        munmap(snap.base, snap.size);
+        snap.base = NULL;
+    }
+    pthread_mutex_unlock(&snap.lock);
+    return obj;
+}
+
+/*
+ * snap_save - write a snapshot of the cache to path
+ * Return 0 on success -1 on error
+ * Notice: the cache keeps serving, every shard is only locked while its
+ * objects are pinned
+ */
+int snap_save(pxycache *Pxycache, char *path)
+{
+    char tmp[MAXLINE];
+    FILE *fp;
+    snaphdr hdr = { SNAP_MAGIC, SNAP_VERSION };
+    int i, rc = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        unix_error("snapshot fopen error");
+        return -1;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        rc = -1;
+    for (i = 0; i < CACHE_SHARDS && rc == 0; i++)
+        rc = snap_shard(&Pxycache->shards[i], fp);
+    if (rc == 0)
+        rc = snap_rest(fp);
+    if (rc == 0 && (fflush(fp) != 0 || fsync(fileno(fp)) < 0))
+        rc = -1;
+    if (fclose(fp) != 0)
+        rc = -1;
+
+    if (rc < 0 || rename(tmp, path) < 0) {
+        unix_error("snapshot write error");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * snap_start - save the cache to path on SIGTERM, then exit, and every
+ * interval seconds if interval is not 0
+ * Notice: must be called before any other thread is created, they all
+ * inherit the blocked SIGTERM so only the snapshot thread takes it
+ */
+void snap_start(pxycache *Pxycache, char *path, int interval)
+{
+    sigset_t set;
+    pthread_t tid;
+
+    snap.cache = Pxycache;
+    snap.path = path;
+    snap.interval = interval;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    Pthread_create(&tid, NULL, snap_thread, NULL);
+}
+
+/*
+ * snap_stats - print what is left of the loaded snapshot to fp
+ */
+void snap_stats(FILE *fp)
+{
+    pthread_mutex_lock(&snap.lock);
+    if (snap.path != NULL)
+        fprintf(fp, "snapshot: %lu objects restored, %lu left\n",
+                snap.taken, snap.nobjs);
+    pthread_mutex_unlock(&snap.lock);
+}
+
+/*
+ * snap_thread - wait for SIGTERM or the next periodic snapshot
+ */
+static void *snap_thread(void *vargp)
+{
+    sigset_t set;
+    struct timespec ts;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    sigemptyset(&set);
+    sigaddset(&set, SIGTERM);
+    while (1) {
+        if (snap.interval > 0) {
+            ts.tv_sec = snap.interval;
+            ts.tv_nsec = 0;
+            sig = sigtimedwait(&set, NULL, &ts);
+        }
+        else
+            sig = sigwaitinfo(&set, NULL);
+
+        if (sig == SIGTERM) {
+            snap_save(snap.cache, snap.path);
+            exit(0);
+        }
+        if (sig < 0 && errno == EAGAIN)
+            snap_save(snap.cache, snap.path);
+    }
+    return NULL;
+}
+
+/*
+ * snap_shard - write the objects of shard which may still be served to fp,
+ * list by list and oldest first. Each is restored on its own the first
+ * time it is missed, so the order does not rebuild the lists
+ * Return 0 on success -1 on error
+ */
+static int snap_shard(cacheshard *shard, FILE *fp)
+{
+    cacheobj **objs, *obj;
+    size_t n = 0, i;
+    int l, rc = 0;
+    time_t now = time(NULL);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    objs = Malloc((shard->nobjs + 1) * sizeof(cacheobj *));
+    for (l = 0; l < CACHE_LISTS; l++) {
+        for (obj = shard->lists[l].rear; obj != NULL; obj = obj->prev) {
+            if (!OBJ_KEPT(obj, now))
+                continue;
+            __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+            objs[n++] = obj;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    for (i = 0; i < n; i++) {
+        if (rc == 0)
+            rc = snap_write(fp, objs[i]);
+        obj_read_done(objs[i]);
+    }
+    Free(objs);
+    return rc;
+}
+
+/*
+ * snap_write - write the record of obj to fp
+ * Return 0 on success -1 on error
+ */
+static int snap_write(FILE *fp, cacheobj *obj)
+{
+    static const char pad[8];
+    snaprec rec;
+    objchunk *chunk;
+    size_t padlen;
+
+    rec.urilen = strlen(obj->uri);
+    rec.hdrlen = obj->hdrlen;
+    rec.bodylen = obj->content_size;
+    rec.freq = obj->freq;
+    rec.hash = obj->hash;
+    rec.cost = obj->cost;
+    rec.expires = obj->expires;
+    rec.born = obj->born;
+    rec.swr = obj->swr;
+    rec.sie = obj->sie;
+
+    if (fwrite(&rec, sizeof(rec), 1, fp) != 1 ||
+            fwrite(obj->uri, 1, rec.urilen, fp) != rec.urilen ||
+            fwrite(obj->reshdrs, 1, rec.hdrlen, fp) != rec.hdrlen)
+        return -1;
+    for (chunk = obj->content; chunk != NULL; chunk = chunk->next) {
+        if (fwrite(chunk->data, 1, chunk->len, fp) != chunk->len)
+            return -1;
+    }
+    padlen = snap_reclen(&rec) - sizeof(rec) - rec.urilen - rec.hdrlen -
+        rec.bodylen;
+    if (fwrite(pad, 1, padlen, fp) != padlen)
+        return -1;
+    return 0;
+}
+
+/*
+ * snap_rest - copy the records of the loaded snapshot nobody asked for to
+ * fp, so they survive another restart. Those which may not be served even
+ * stale any more are left out
+ * Return 0 on success -1 on error
+ */
+static int snap_rest(FILE *fp)
+{
+    snapent *e;
+    snaprec *rec;
+    int i, rc = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&snap.lock);
+    for (i = 0; i < SNAP_BUCKETS && snap.base != NULL && rc == 0; i++) {
+        for (e = snap.buckets[i]; e != NULL && rc == 0; e = e->next) {
+            rec = (snaprec *)(snap.base + e->off);
+            if (OBJ_KEPT(rec, now) &&
+                    fwrite(rec, snap_reclen(rec), 1, fp) != 1)
+                rc = -1;
+        }
+    }
+    pthread_mutex_unlock(&snap.lock);
+    return rc;
+}
+
+/*
+ * snap_find - the index entry of uri, *pp is set to the link pointing to it
+ * Return NULL if the snapshot does not have it
+ * Notice: the caller holds the lock
+ */
+static snapent *snap_find(char *uri, unsigned long long hash, snapent ***pp)
+{
+    snapent *e;
+    snaprec *rec;
+    size_t urilen = strlen(uri);
+
+    for (*pp = &snap.buckets[hash % SNAP_BUCKETS]; (e = **pp) != NULL;
+            *pp = &e->next) {
+        rec = (snaprec *)(snap.base + e->off);
+        if (e->hash == hash && rec->urilen == urilen &&
+                memcmp(rec + 1, uri, urilen) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * snap_reclen - the length of a record, padded to 8 bytes
+ */
+static size_t snap_reclen(snaprec *rec)
+{
+    return (sizeof(snaprec) + (size_t)rec->urilen + rec->hdrlen +
+            rec->bodylen + 7) & ~(size_t)7;
+}
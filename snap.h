@@ -0,0 +1,29 @@
+/*
+ * Author: shiweid
+ *
+ * snap.h include the snapshot of the cache, kept across restarts.
+ * The snapshot is written on SIGTERM and every few seconds if asked to:
+ * the uri, headers, content, hits and fetch cost of every cached object,
+ * oldest first. It is written to a temporary file renamed over the old
+ * one, so a crash never leaves half a snapshot behind.
+ * At startup the snapshot is mapped and only its index is built. An
+ * object is copied into the cache the first time it is missed, so the
+ * proxy serves hits at once without loading everything up front. The
+ * mapping is dropped once every object was taken.
+ */
+
+#ifndef __SNAP_H__
+#define __SNAP_H__
+
+#include "csapp.h"
+#include "cache.h"
+
+#define SNAP_BUCKETS 4096   /* buckets of the index of the loaded snapshot */
+
+int snap_load(char *path);
+cacheobj *snap_take(char *uri, unsigned long long hash);
+int snap_save(pxycache *Pxycache, char *path);
+void snap_start(pxycache *Pxycache, char *path, int interval);
+void snap_stats(FILE *fp);
+
+#endif
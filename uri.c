@@ -0,0 +1,154 @@
+/*
+ * Author: shiweid
+ *
+ * uri.c include the parser of the absolute uris of proxy requests. See
+ * uri.h for the overview.
+ */
+
+#define _GNU_SOURCE
+#include "uri.h"
+
+/* Static helper functions */
+static int uri_default_port(char *scheme, size_t len);
+static int uri_copy(char *dst, size_t size, size_t *len, const char *src,
+        size_t n, int lower);
+
+/*
+ * uri_parse - parse the len bytes of uri into u
+ * Return 0 on success, -1 if it is not an absolute uri with a host
+ */
+int uri_parse(char *uri, size_t len, uriview *u)
+{
+    char *end = uri + len, *p, *auth, *authend, *at;
+    long port;
+
+    /* The scheme, up to "://" */
+    for (p = uri; p < end && (isalnum((unsigned char)*p) || *p == '+' ||
+                *p == '-' || *p == '.'); p++)
+        ;
+    if (p == uri || end - p < 3 || memcmp(p, "://", 3) != 0)
+        return -1;
+    u->scheme = uri;
+    u->schemelen = p - uri;
+
+    /* The authority, up to the path, the query or the fragment */
+    auth = p + 3;
+    for (authend = auth; authend < end && *authend != '/' &&
+            *authend != '?' && *authend != '#'; authend++)
+        ;
+    if ((at = memrchr(auth, '@', authend - auth)) != NULL)
+        auth = at + 1;
+
+    u->ipv6 = (auth < authend && *auth == '[');
+    if (u->ipv6) {
+        if ((p = memchr(auth, ']', authend - auth)) == NULL)
+            return -1;
+        u->host = auth + 1;
+        u->hostlen = p - u->host;
+        p++;
+    }
+    else {
+        if ((p = memchr(auth, ':', authend - auth)) == NULL)
+            p = authend;
+        u->host = auth;
+        u->hostlen = p - auth;
+    }
+    if (u->hostlen == 0)
+        return -1;
+
+    /* An empty port is the default one */
+    u->port = 0;
+    if (p < authend) {
+        if (*p++ != ':')
+            return -1;
+        for (port = 0; p < authend; p++) {
+            if (!isdigit((unsigned char)*p) ||
+                    (port = port * 10 + *p - '0') > 65535)
+                return -1;
+        }
+        u->port = port;
+    }
+
+    u->path = authend;
+    if ((p = memchr(authend, '#', end - authend)) == NULL)
+        p = end;
+    u->pathlen = p - authend;
+    return 0;
+}
+
+/*
+ * uri_port - the port of the server of u
+ */
+int uri_port(uriview *u)
+{
+    return (u->port != 0) ? u->port : uri_default_port(u->scheme, u->schemelen);
+}
+
+/*
+ * uri_key - write the cache key of u into key, size bytes with the NUL
+ * Return its length, -1 if it does not fit
+ */
+int uri_key(uriview *u, char *key, size_t size)
+{
+    char port[8];
+    size_t len = 0;
+    int rc = 0;
+
+    rc |= uri_copy(key, size, &len, u->scheme, u->schemelen, 1);
+    rc |= uri_copy(key, size, &len, "://[", u->ipv6 ? 4 : 3, 0);
+    rc |= uri_copy(key, size, &len, u->host, u->hostlen, 1);
+    if (u->ipv6)
+        rc |= uri_copy(key, size, &len, "]", 1, 0);
+    if (u->port != 0 && u->port != uri_default_port(u->scheme, u->schemelen)) {
+        rc |= uri_copy(key, size, &len, port,
+                sprintf(port, ":%d", u->port), 0);
+    }
+    if (URI_SLASH(u))
+        rc |= uri_copy(key, size, &len, "/", 1, 0);
+    rc |= uri_copy(key, size, &len, u->path, u->pathlen, 0);
+    return (rc < 0) ? -1 : (int)len;
+}
+
+/*
+ * uri_host - copy the host of u into host, size bytes with the NUL
+ * Return 0 on success, -1 if it does not fit
+ */
+int uri_host(uriview *u, char *host, size_t size)
+{
+    size_t len = 0;
+
+    return uri_copy(host, size, &len, u->host, u->hostlen, 0);
+}
+
+/*
+ * uri_default_port - the port of the scheme of len bytes when a uri has none
+ */
+static int uri_default_port(char *scheme, size_t len)
+{
+    if (len == 5 && strncasecmp(scheme, "https", 5) == 0)
+        return 443;
+    return 80;
+}
+
+/*
+ * uri_copy - append the n bytes of src to dst, size bytes, whose first len
+ * bytes are used, lowercased if lower. dst stays NUL terminated
+ * Return 0 on success, -1 if they do not fit
+ */
+static int uri_copy(char *dst, size_t size, size_t *len, const char *src,
+        size_t n, int lower)
+{
+    size_t i;
+
+    if (*len + n + 1 > size)
+        return -1;
+    if (lower) {
+        for (i = 0; i < n; i++)
+            dst[*len + i] = tolower((unsigned char)src[i]);
+    }
+    else
+        memcpy(dst + *len, src, n);
+    *len += n;
+    dst[*len] = '\0';
+    return 0;
+}
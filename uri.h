@@ -0,0 +1,39 @@
+/*
+ * Author: shiweid
+ *
+ * uri.h include the parser of the absolute uris of proxy requests, such
+ * as http://user@Example.com:80/a/b?c#d.
+ * The uri is parsed in one pass into views of its scheme, host, port and
+ * path, nothing is copied. An IPv6 literal host is given without its
+ * brackets, userinfo is skipped and the fragment is not part of the path.
+ * The cache key of a uri is its normalized form: the scheme and host
+ * lowercased, the default port and the userinfo dropped and an empty path
+ * made /, so the spellings of the same resource share one cache entry.
+ */
+
+#ifndef __URI_H__
+#define __URI_H__
+
+#include "csapp.h"
+
+typedef struct uri_view
+{
+    char *scheme;
+    size_t schemelen;
+    char *host;
+    size_t hostlen;
+    int ipv6;         /* the host is an IPv6 literal */
+    int port;         /* 0 if the uri has none */
+    char *path;       /* with the query, may be empty */
+    size_t pathlen;
+}uriview;
+
+/* Whether the path of u needs a / in front, it is empty or only a query */
+#define URI_SLASH(u) ((u)->pathlen == 0 || (u)->path[0] != '/')
+
+int uri_parse(char *uri, size_t len, uriview *u);
+int uri_port(uriview *u);
+int uri_key(uriview *u, char *key, size_t size);
+int uri_host(uriview *u, char *host, size_t size);
+
+#endif
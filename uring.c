@@ -0,0 +1,493 @@
+/*
+ * Author: shiweid
+ *
+ * uring.c include the io_uring engine of the proxy.
+ * Every connection has at most one operation in flight, tagged with the
+ * connection in the user_data of its SQE. The loop submits everything that
+ * was queued while handling the previous completions and waits for more
+ * in a single io_uring_enter(). The listening socket uses a multishot
+ * accept when the kernel supports it. The recv of a connection waiting
+ * for a request of its client is linked to a timeout, which cancels it
+ * after CLIENT_REQUEST_TIMEOUT seconds for the first request, client_idle
+ * seconds for the next ones.
+ * The handlers run while completions are reaped, so they never wait for
+ * room in a full SQ: what does not fit is deferred to the next iteration
+ * of the loop, after the completions freed the kernel to take more.
+ * The rings are set up with the raw system calls, the proxy does not
+ * depend on liburing.
+ */
+
+#include "csapp.h"
+#include <sys/syscall.h>
+#include "conn.h"
+#include "proxy.h"
+#include "uring.h"
+
+/* user_data of the SQEs which do not belong to a connection, connections
+ * are at least 8 byte aligned so the low bits tell them apart */
+#define UD_ACCEPT 1
+#define UD_WAKE   2   /* read of the eventfd of the wake queue */
+#define UD_CLOSE  3   /* the descriptor is in the upper bits */
+#define UD_TIMEOUT 4  /* the timeout linked to the recv of a kept connection */
+
+/* Static helper functions */
+static int uring_setup(uring *ring);
+static void uring_teardown(uring *ring);
+static unsigned uring_room(uring *ring, unsigned n);
+static struct io_uring_sqe *uring_sqe(uring *ring);
+static void uring_commit(uring *ring);
+static int uring_enter(uring *ring, unsigned min_complete);
+static void uring_accept(uring *ring);
+static void uring_wait_wake(uring *ring);
+static void uring_submit_op(uring *ring, conn *c);
+static int uring_queue_op(uring *ring, conn *c);
+static void uring_defer(uring *ring, conn *c);
+static void uring_flush(uring *ring);
+static void uring_release(uring *ring, conn *c);
+static void uring_close(uring *ring, int fd);
+static void uring_complete(uring *ring, unsigned long long data,
+        int res, unsigned flags);
+
+/*
+ * uring_loop - serve the connections accepted on listenfd forever
+ * Return -1 if io_uring is not available, so the caller can fall back to
+ * the epoll engine
+ */
+int uring_loop(int listenfd)
+{
+    uring ring;
+    unsigned head, tail;
+    struct io_uring_cqe *cqe;
+
+    ring.listenfd = listenfd;
+    ring.multishot = 1;
+    ring.first.tv_sec = CLIENT_REQUEST_TIMEOUT;
+    ring.first.tv_nsec = 0;
+    ring.idle.tv_sec = client_idle;
+    ring.idle.tv_nsec = 0;
+    ring.deferred = ring.deftail = NULL;
+    ring.defer_accept = ring.defer_wake = 0;
+    if (uring_setup(&ring) < 0)
+        return -1;
+    if (connqueue_init(&ring.wakeq, 0) < 0) {   /* the ring waits for it */
+        uring_teardown(&ring);
+        return -1;
+    }
+
+    uring_accept(&ring);
+    uring_wait_wake(&ring);
+    while (1) {
+        uring_flush(&ring);
+        if (uring_enter(&ring, 1) < 0) {
+            Close(ring.wakeq.efd);
+            uring_teardown(&ring);
+            return -1;
+        }
+
+        /* Reap every completion, the handlers queue the next SQEs */
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            cqe = &ring.cqes[head & *ring.cq_mask];
+            uring_complete(&ring, cqe->user_data, cqe->res, cqe->flags);
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+    return 0;
+}
+
+/*
+ * uring_complete - handle one completion
+ */
+static void uring_complete(uring *ring, unsigned long long data,
+        int res, unsigned flags)
+{
+    conn *c, *next;
+
+    if (data == UD_ACCEPT) {
+        if (res == -EINVAL && ring->multishot) {
+            /* Older kernel: one accept per SQE */
+            ring->multishot = 0;
+            uring_accept(ring);
+            return;
+        }
+        if (!(flags & IORING_CQE_F_MORE))
+            uring_accept(ring);
+        if (res < 0) {
+            if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED)
+                posix_error(-res, "io_uring accept error");
+            return;
+        }
+        /* The ring waits, sockets may block */
+        c = conn_new(res, 0, &ring->wakeq);
+        uring_submit_op(ring, c);
+        return;
+    }
+
+    if (data == UD_WAKE) {
+        for (c = connqueue_take(&ring->wakeq); c != NULL; c = next) {
+            next = c->wnext;
+            conn_advance(c, 0);
+            uring_submit_op(ring, c);
+        }
+        uring_wait_wake(ring);
+        return;
+    }
+
+    if (data == UD_TIMEOUT)   /* its recv completes as well */
+        return;
+
+    if ((data & 3) == UD_CLOSE) {
+        /* Close the descriptor ourselves if the kernel could not */
+        if (res < 0 && res != -EBADF)
+            close((int)(data >> 2));
+        return;
+    }
+
+    c = (conn *)(unsigned long)data;
+    if (res < 0)
+        errno = -res;
+    conn_advance(c, res < 0 ? -1 : res);
+    uring_submit_op(ring, c);
+}
+
+/*
+ * uring_submit_op - queue the outstanding operation of the connection,
+ * or close and free it once it is done. A connection the client keeps
+ * goes on with the next request
+ */
+static void uring_submit_op(uring *ring, conn *c)
+{
+    if (c->op == OP_NONE && c->state == CS_NEXT) {
+        uring_release(ring, c);
+        conn_next(c);
+    }
+    if (c->op == OP_NONE) {
+        uring_close(ring, c->clientfd);
+        c->clientfd = -1;
+        uring_release(ring, c);
+        conn_free(c);
+        return;
+    }
+    if (c->op == OP_WAIT)   /* until the UD_WAKE completion */
+        return;
+    if (ring->deferred != NULL || uring_queue_op(ring, c) < 0)
+        uring_defer(ring, c);   /* after the ones deferred before */
+}
+
+/*
+ * uring_queue_op - queue the SQE of the outstanding operation of the
+ * connection, and the timeout linked to it
+ * Return 0 on success -1 if the SQ has no room for them
+ */
+static int uring_queue_op(uring *ring, conn *c)
+{
+    struct io_uring_sqe *sqe;
+    int timeout;
+
+    /* A recv and its timeout go in the same submission to stay linked */
+    timeout = (c->op == OP_RECV && c->state == CS_READ_REQ);
+    if (uring_room(ring, timeout ? 2 : 1) == 0)
+        return -1;
+
+    sqe = uring_sqe(ring);
+    sqe->fd = c->opfd;
+    sqe->user_data = (unsigned long)c;
+    switch (c->op) {
+    case OP_RECV:
+        sqe->opcode = IORING_OP_RECV;
+        sqe->addr = (unsigned long)c->opbuf;
+        sqe->len = c->oplen;
+        break;
+    case OP_SEND:
+    case OP_SENDFILE:   /* opbuf is in the mapping of the disk tier */
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (unsigned long)c->opbuf;
+        sqe->len = c->oplen;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        break;
+    case OP_SENDMSG:
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (unsigned long)&c->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        break;
+    case OP_CONNECT:
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->addr = (unsigned long)&c->addr;
+        sqe->off = c->rreq.addrlen;
+        break;
+    }
+    if (timeout)
+        sqe->flags |= IOSQE_IO_LINK;
+    uring_commit(ring);
+
+    if (timeout) {
+        sqe = uring_sqe(ring);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (unsigned long)(c->served > 0 ? &ring->idle :
+                &ring->first);
+        sqe->len = 1;
+        sqe->user_data = UD_TIMEOUT;
+        uring_commit(ring);
+    }
+    return 0;
+}
+
+/*
+ * uring_defer - append the connection to the ones whose operation waits
+ * for room in the SQ
+ */
+static void uring_defer(uring *ring, conn *c)
+{
+    c->wnext = NULL;
+    if (ring->deftail == NULL)
+        ring->deferred = c;
+    else
+        ring->deftail->wnext = c;
+    ring->deftail = c;
+}
+
+/*
+ * uring_flush - queue what was deferred while the SQ was full, as much of
+ * it as fits now
+ */
+static void uring_flush(uring *ring)
+{
+    conn *c;
+
+    if (ring->defer_accept && uring_room(ring, 1) > 0) {
+        ring->defer_accept = 0;
+        uring_accept(ring);
+    }
+    if (ring->defer_wake && uring_room(ring, 1) > 0) {
+        ring->defer_wake = 0;
+        uring_wait_wake(ring);
+    }
+    while ((c = ring->deferred) != NULL && uring_queue_op(ring, c) == 0) {
+        ring->deferred = c->wnext;
+        if (ring->deferred == NULL)
+            ring->deftail = NULL;
+    }
+}
+
+/*
+ * uring_release - close the connection to the server of the connection,
+ * unless it goes back to the pool
+ */
+static void uring_release(uring *ring, conn *c)
+{
+    if (c->serverfd >= 0 && !conn_server_idle(c)) {
+        uring_close(ring, c->serverfd);
+        c->serverfd = -1;
+    }
+}
+
+/*
+ * uring_accept - queue an accept on the listening socket
+ */
+static void uring_accept(uring *ring)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+
+    if (sqe == NULL) {
+        ring->defer_accept = 1;
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->listenfd;
+    sqe->user_data = UD_ACCEPT;
+    if (ring->multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    uring_commit(ring);
+}
+
+/*
+ * uring_wait_wake - queue a read of the eventfd of the wake queue
+ */
+static void uring_wait_wake(uring *ring)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+
+    if (sqe == NULL) {
+        ring->defer_wake = 1;
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->wakeq.efd;
+    sqe->addr = (unsigned long)&ring->wakecnt;
+    sqe->len = sizeof(ring->wakecnt);
+    sqe->user_data = UD_WAKE;
+    uring_commit(ring);
+}
+
+/*
+ * uring_close - queue the close of fd, or close it at once if the SQ is
+ * full
+ */
+static void uring_close(uring *ring, int fd)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring);
+
+    if (sqe == NULL) {
+        Close(fd);
+        return;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = ((unsigned long long)fd << 2) | UD_CLOSE;
+    uring_commit(ring);
+}
+
+/*
+ * uring_room - make room for n SQEs: if the SQ is too full, the queued
+ * ones are submitted once. That may not help while the kernel waits for
+ * completions to be reaped, so it is not retried
+ * Return the number of free SQEs if there are at least n, 0 otherwise
+ */
+static unsigned uring_room(uring *ring, unsigned n)
+{
+    unsigned room;
+
+    room = ring->sq_entries - (*ring->sq_tail -
+            __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+    if (room < n) {
+        uring_enter(ring, 0);
+        room = ring->sq_entries - (*ring->sq_tail -
+                __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+    }
+    return (room < n) ? 0 : room;
+}
+
+/*
+ * uring_sqe - return a cleared SQE at the tail of the submission queue
+ * Return NULL if the queue is full, see uring_room()
+ */
+static struct io_uring_sqe *uring_sqe(uring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uring_room(ring, 1) == 0)
+        return NULL;
+    sqe = &ring->sqes[*ring->sq_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * uring_commit - make the SQE returned by uring_sqe() visible to the kernel
+ */
+static void uring_commit(uring *ring)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+}
+
+/*
+ * uring_enter - submit the queued SQEs and wait for min_complete
+ * completions
+ * Return 0 on success -1 on error
+ */
+static int uring_enter(uring *ring, unsigned min_complete)
+{
+    int rc;
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+    while ((rc = syscall(__NR_io_uring_enter, ring->fd, ring->sq_pending,
+                    min_complete, flags, NULL, 0)) < 0) {
+        if (errno == EINTR)
+            continue;
+        if (errno == EBUSY || errno == EAGAIN) /* completions first */
+            return 0;
+        unix_error("io_uring_enter error");
+        return -1;
+    }
+    ring->sq_pending -= rc;
+    return 0;
+}
+
+/*
+ * uring_setup - create the ring and map its queues
+ * Return 0 on success -1 on error
+ */
+static int uring_setup(uring *ring)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_ENTRIES * 8;   /* every connection can complete */
+    if ((ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+        unix_error("io_uring_setup error");
+        return -1;
+    }
+
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_len > ring->sq_ring_len)
+            ring->sq_ring_len = ring->cq_ring_len;
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_len);
+            goto fail;
+        }
+    }
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ring != ring->sq_ring)
+            munmap(ring->cq_ring, ring->cq_ring_len);
+        munmap(ring->sq_ring, ring->sq_ring_len);
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_pending = 0;
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+    return 0;
+
+fail:
+    unix_error("io_uring mmap error");
+    close(ring->fd);
+    return -1;
+}
+
+/*
+ * uring_teardown - unmap the queues and close the ring
+ */
+static void uring_teardown(uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    munmap(ring->sq_ring, ring->sq_ring_len);
+    close(ring->fd);
+}
@@ -0,0 +1,60 @@
+/*
+ * Author: shiweid
+ *
+ * uring.h include the io_uring engine of the proxy. It drives the same
+ * connection state machine as the epoll engine (conn.h), but submits the
+ * outstanding operation of every connection to an io_uring and handles
+ * the completions, so one io_uring_enter() submits and reaps a whole
+ * batch of accepts, recvs, sends, connects and closes.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include "conn.h"
+
+#define URING_ENTRIES 256   /* submission queue entries */
+
+typedef struct uring
+{
+    int fd;
+    int listenfd;
+    int multishot;            /* accept is multishot */
+    connqueue wakeq;          /* followers woken up, see conn.h */
+    uint64_t wakecnt;         /* read from the eventfd of wakeq */
+    struct __kernel_timespec first;  /* the wait for the first request */
+    struct __kernel_timespec idle;   /* the wait for the next request */
+
+    /* What could not be queued while the SQ was full, queued by the next
+     * iteration of the loop once completions were reaped */
+    conn *deferred;
+    conn *deftail;
+    int defer_accept;
+    int defer_wake;
+
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_pending;      /* queued but not submitted yet */
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    size_t sqes_len;
+}uring;
+
+int uring_loop(int listenfd);
+
+#endif